@@ -0,0 +1,477 @@
+#include "defs.h"
+
+// Every block read from or written to disk goes through here, so
+// build it optimized even when the rest is built for debugging.
+#pragma GCC optimize("O3")
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// AES-128 in XTS mode (IEEE 1619) for encrypting disk blocks.
+// Each block is one data unit, with its block no as the tweak:
+// the tweak encrypted under the second key is xored in before and
+// after each 16 bytes go through AES under the first key, and is
+// multiplied by x in GF(2^128) from one 16 bytes to the next.
+// Kernels: portable T-tables, AES-NI (8 blocks at a time), VAES (16 at
+// a time) and VAES on 512-bit registers (32 at a time), picked at run
+// time by what the CPU has.
+
+#define NR 10 // rounds for a 128-bit key
+
+int aesimpl; // AES_PORTABLE ... AES_VAES512, set by xts_setkey()
+int xtskeyed; // xts_setkey() was called
+
+static uchar sbox[256], isbox[256];
+static uint te[4][256], td[4][256];
+
+// Round keys: the data key for encryption and decryption (the
+// equivalent inverse cipher's), the tweak key for encryption.
+static uint ek[4 * (NR + 1)], dk[4 * (NR + 1)], tk[4 * (NR + 1)];
+// the same as bytes, for the AES instructions
+static uchar ekb[NR + 1][16], dkb[NR + 1][16], tkb[NR + 1][16];
+
+#define GETU32(p)                                                              \
+  ((uint)(p)[0] << 24 | (uint)(p)[1] << 16 | (uint)(p)[2] << 8 | (p)[3])
+#define PUTU32(p, v)                                                           \
+  ((p)[0] = (v) >> 24, (p)[1] = (v) >> 16, (p)[2] = (v) >> 8, (p)[3] = (v))
+#define ROR(w, n) ((w) >> (n) | (w) << (32 - (n)))
+
+// Multiply in GF(2^8).
+static uchar gmul(uchar a, uchar b) {
+  uchar p = 0;
+
+  for (; b; b >>= 1) {
+    if (b & 1)
+      p ^= a;
+    a = a << 1 ^ (a & 0x80 ? 0x1b : 0);
+  }
+  return p;
+}
+
+// Build the S-boxes and T-tables.
+static void aesinit(void) {
+  uchar p = 1, q = 1, x, s, is;
+  int i;
+
+  // p runs over the multiplicative group, q over its inverses
+  do {
+    p = p ^ p << 1 ^ (p & 0x80 ? 0x1b : 0);
+    q ^= q << 1;
+    q ^= q << 2;
+    q ^= q << 4;
+    if (q & 0x80)
+      q ^= 0x09;
+    x = q ^ (q << 1 | q >> 7) ^ (q << 2 | q >> 6) ^ (q << 3 | q >> 5) ^
+        (q << 4 | q >> 4);
+    sbox[p] = x ^ 0x63;
+  } while (p != 1);
+  sbox[0] = 0x63;
+
+  for (i = 0; i < 256; i++)
+    isbox[sbox[i]] = i;
+  for (i = 0; i < 256; i++) {
+    s = sbox[i];
+    is = isbox[i];
+    te[0][i] = (uint)gmul(s, 2) << 24 | s << 16 | s << 8 | gmul(s, 3);
+    td[0][i] = (uint)gmul(is, 14) << 24 | gmul(is, 9) << 16 |
+               gmul(is, 13) << 8 | gmul(is, 11);
+    te[1][i] = ROR(te[0][i], 8);
+    te[2][i] = ROR(te[0][i], 16);
+    te[3][i] = ROR(te[0][i], 24);
+    td[1][i] = ROR(td[0][i], 8);
+    td[2][i] = ROR(td[0][i], 16);
+    td[3][i] = ROR(td[0][i], 24);
+  }
+}
+
+static void expand(const uchar *key, uint *rk) {
+  uint t;
+  uchar rcon = 1;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    rk[i] = GETU32(key + 4 * i);
+  for (i = 4; i < 4 * (NR + 1); i++) {
+    t = rk[i - 1];
+    if (i % 4 == 0) {
+      t = (uint)sbox[t >> 16 & 0xff] << 24 | sbox[t >> 8 & 0xff] << 16 |
+          sbox[t & 0xff] << 8 | sbox[t >> 24];
+      t ^= (uint)rcon << 24;
+      rcon = gmul(rcon, 2);
+    }
+    rk[i] = rk[i - 4] ^ t;
+  }
+}
+
+static void tobytes(uint *rk, uchar (*b)[16]) {
+  int i;
+
+  for (i = 0; i < 4 * (NR + 1); i++)
+    PUTU32(b[i / 4] + 4 * (i % 4), rk[i]);
+}
+
+static void aesenc(const uint *rk, const uchar *in, uchar *out) {
+  uint s0, s1, s2, s3, t0, t1, t2, t3;
+  int r;
+
+  s0 = GETU32(in) ^ rk[0];
+  s1 = GETU32(in + 4) ^ rk[1];
+  s2 = GETU32(in + 8) ^ rk[2];
+  s3 = GETU32(in + 12) ^ rk[3];
+  for (r = 1; r < NR; r++) {
+    rk += 4;
+    t0 = te[0][s0 >> 24] ^ te[1][s1 >> 16 & 0xff] ^ te[2][s2 >> 8 & 0xff] ^
+         te[3][s3 & 0xff] ^ rk[0];
+    t1 = te[0][s1 >> 24] ^ te[1][s2 >> 16 & 0xff] ^ te[2][s3 >> 8 & 0xff] ^
+         te[3][s0 & 0xff] ^ rk[1];
+    t2 = te[0][s2 >> 24] ^ te[1][s3 >> 16 & 0xff] ^ te[2][s0 >> 8 & 0xff] ^
+         te[3][s1 & 0xff] ^ rk[2];
+    t3 = te[0][s3 >> 24] ^ te[1][s0 >> 16 & 0xff] ^ te[2][s1 >> 8 & 0xff] ^
+         te[3][s2 & 0xff] ^ rk[3];
+    s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+  }
+  rk += 4;
+  t0 = (uint)sbox[s0 >> 24] << 24 | sbox[s1 >> 16 & 0xff] << 16 |
+       sbox[s2 >> 8 & 0xff] << 8 | sbox[s3 & 0xff];
+  t1 = (uint)sbox[s1 >> 24] << 24 | sbox[s2 >> 16 & 0xff] << 16 |
+       sbox[s3 >> 8 & 0xff] << 8 | sbox[s0 & 0xff];
+  t2 = (uint)sbox[s2 >> 24] << 24 | sbox[s3 >> 16 & 0xff] << 16 |
+       sbox[s0 >> 8 & 0xff] << 8 | sbox[s1 & 0xff];
+  t3 = (uint)sbox[s3 >> 24] << 24 | sbox[s0 >> 16 & 0xff] << 16 |
+       sbox[s1 >> 8 & 0xff] << 8 | sbox[s2 & 0xff];
+  PUTU32(out, t0 ^ rk[0]);
+  PUTU32(out + 4, t1 ^ rk[1]);
+  PUTU32(out + 8, t2 ^ rk[2]);
+  PUTU32(out + 12, t3 ^ rk[3]);
+}
+
+static void aesdec(const uint *rk, const uchar *in, uchar *out) {
+  uint s0, s1, s2, s3, t0, t1, t2, t3;
+  int r;
+
+  s0 = GETU32(in) ^ rk[0];
+  s1 = GETU32(in + 4) ^ rk[1];
+  s2 = GETU32(in + 8) ^ rk[2];
+  s3 = GETU32(in + 12) ^ rk[3];
+  for (r = 1; r < NR; r++) {
+    rk += 4;
+    t0 = td[0][s0 >> 24] ^ td[1][s3 >> 16 & 0xff] ^ td[2][s2 >> 8 & 0xff] ^
+         td[3][s1 & 0xff] ^ rk[0];
+    t1 = td[0][s1 >> 24] ^ td[1][s0 >> 16 & 0xff] ^ td[2][s3 >> 8 & 0xff] ^
+         td[3][s2 & 0xff] ^ rk[1];
+    t2 = td[0][s2 >> 24] ^ td[1][s1 >> 16 & 0xff] ^ td[2][s0 >> 8 & 0xff] ^
+         td[3][s3 & 0xff] ^ rk[2];
+    t3 = td[0][s3 >> 24] ^ td[1][s2 >> 16 & 0xff] ^ td[2][s1 >> 8 & 0xff] ^
+         td[3][s0 & 0xff] ^ rk[3];
+    s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+  }
+  rk += 4;
+  t0 = (uint)isbox[s0 >> 24] << 24 | isbox[s3 >> 16 & 0xff] << 16 |
+       isbox[s2 >> 8 & 0xff] << 8 | isbox[s1 & 0xff];
+  t1 = (uint)isbox[s1 >> 24] << 24 | isbox[s0 >> 16 & 0xff] << 16 |
+       isbox[s3 >> 8 & 0xff] << 8 | isbox[s2 & 0xff];
+  t2 = (uint)isbox[s2 >> 24] << 24 | isbox[s1 >> 16 & 0xff] << 16 |
+       isbox[s0 >> 8 & 0xff] << 8 | isbox[s3 & 0xff];
+  t3 = (uint)isbox[s3 >> 24] << 24 | isbox[s2 >> 16 & 0xff] << 16 |
+       isbox[s1 >> 8 & 0xff] << 8 | isbox[s0 & 0xff];
+  PUTU32(out, t0 ^ rk[0]);
+  PUTU32(out + 4, t1 ^ rk[1]);
+  PUTU32(out + 8, t2 ^ rk[2]);
+  PUTU32(out + 12, t3 ^ rk[3]);
+}
+
+static void xts_portable(uint64 unit, const uchar *src, uchar *dst, int n,
+                         int enc) {
+  uchar t[16], x[16], c, carry;
+  int i, off;
+
+  memset(t, 0, sizeof(t));
+  for (i = 0; i < 8; i++)
+    t[i] = unit >> 8 * i;
+  aesenc(tk, t, t);
+
+  for (off = 0; off < n; off += 16) {
+    for (i = 0; i < 16; i++)
+      x[i] = src[off + i] ^ t[i];
+    if (enc)
+      aesenc(ek, x, x);
+    else
+      aesdec(dk, x, x);
+    for (i = 0; i < 16; i++)
+      dst[off + i] = x[i] ^ t[i];
+
+    // t *= x, little endian
+    for (i = 0, carry = 0; i < 16; i++) {
+      c = t[i] >> 7;
+      t[i] = t[i] << 1 | carry;
+      carry = c;
+    }
+    if (carry)
+      t[0] ^= 0x87;
+  }
+}
+
+#if defined(__x86_64__)
+// The helpers are inlined into each kernel and take its instruction
+// encoding: mixing legacy SSE code with 256-bit AVX code is slow.
+
+// t * x
+__attribute__((always_inline)) static inline __m128i xmul1(__m128i t) {
+  __m128i c = _mm_srai_epi32(t, 31); // top bit of each 32-bit lane
+  c = _mm_and_si128(c, _mm_set_epi32(0x87, 1, 1, 1));
+  c = _mm_shuffle_epi32(c, 0x93); // into the next lane, the last into the first
+  return _mm_xor_si128(_mm_slli_epi32(t, 1), c);
+}
+
+// t * x^8: a byte shift, and the byte shifted out folded back in
+// (x^128 = x^7 + x^2 + x + 1)
+__attribute__((always_inline)) static inline __m128i xmul8(__m128i t) {
+  __m128i h = _mm_srli_si128(t, 15);
+  t = _mm_xor_si128(_mm_slli_si128(t, 1), h);
+  t = _mm_xor_si128(t, _mm_slli_epi64(h, 1));
+  t = _mm_xor_si128(t, _mm_slli_epi64(h, 2));
+  return _mm_xor_si128(t, _mm_slli_epi64(h, 7));
+}
+
+// The first tweak.
+__attribute__((target("aes"), always_inline)) static inline __m128i
+tweak(uint64 unit) {
+  __m128i t = _mm_xor_si128(_mm_set_epi64x(0, unit),
+                            _mm_loadu_si128((__m128i *)tkb[0]));
+  int r;
+
+  for (r = 1; r < NR; r++)
+    t = _mm_aesenc_si128(t, _mm_loadu_si128((__m128i *)tkb[r]));
+  return _mm_aesenclast_si128(t, _mm_loadu_si128((__m128i *)tkb[NR]));
+}
+
+// 8 blocks at a time, so the AES units stay busy; n % 128 == 0.
+__attribute__((target("aes"))) static void
+xts_ni(uint64 unit, const uchar *src, uchar *dst, int n, int enc) {
+  __m128i k[NR + 1], tw[8], x[8];
+  int i, r, off;
+
+  for (r = 0; r <= NR; r++)
+    k[r] = _mm_loadu_si128((__m128i *)(enc ? ekb[r] : dkb[r]));
+  tw[0] = tweak(unit);
+  for (i = 1; i < 8; i++)
+    tw[i] = xmul1(tw[i - 1]);
+
+  for (off = 0; off < n; off += 128) {
+    for (i = 0; i < 8; i++)
+      x[i] = _mm_xor_si128(
+          _mm_xor_si128(_mm_loadu_si128((__m128i *)(src + off) + i), tw[i]),
+          k[0]);
+    if (enc) {
+      for (r = 1; r < NR; r++)
+        for (i = 0; i < 8; i++)
+          x[i] = _mm_aesenc_si128(x[i], k[r]);
+      for (i = 0; i < 8; i++)
+        x[i] = _mm_aesenclast_si128(x[i], k[NR]);
+    } else {
+      for (r = 1; r < NR; r++)
+        for (i = 0; i < 8; i++)
+          x[i] = _mm_aesdec_si128(x[i], k[r]);
+      for (i = 0; i < 8; i++)
+        x[i] = _mm_aesdeclast_si128(x[i], k[NR]);
+    }
+    for (i = 0; i < 8; i++) {
+      _mm_storeu_si128((__m128i *)(dst + off) + i, _mm_xor_si128(x[i], tw[i]));
+      tw[i] = xmul8(tw[i]);
+    }
+  }
+}
+
+// 16 blocks at a time, two to a 256-bit register; n % 256 == 0.
+__attribute__((target("vaes,avx2,aes"))) static void
+xts_vaes(uint64 unit, const uchar *src, uchar *dst, int n, int enc) {
+  __m256i k[NR + 1], tw[8], x[8], h;
+  __m128i t;
+  int i, r, off;
+
+  for (r = 0; r <= NR; r++)
+    k[r] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((__m128i *)(enc ? ekb[r] : dkb[r])));
+  t = tweak(unit);
+  for (i = 0; i < 8; i++) {
+    tw[i] = _mm256_set_m128i(xmul1(t), t);
+    t = xmul1(xmul1(t));
+  }
+
+  for (off = 0; off < n; off += 256) {
+    for (i = 0; i < 8; i++)
+      x[i] = _mm256_xor_si256(
+          _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(src + off) + i),
+                           tw[i]),
+          k[0]);
+    if (enc) {
+      for (r = 1; r < NR; r++)
+        for (i = 0; i < 8; i++)
+          x[i] = _mm256_aesenc_epi128(x[i], k[r]);
+      for (i = 0; i < 8; i++)
+        x[i] = _mm256_aesenclast_epi128(x[i], k[NR]);
+    } else {
+      for (r = 1; r < NR; r++)
+        for (i = 0; i < 8; i++)
+          x[i] = _mm256_aesdec_epi128(x[i], k[r]);
+      for (i = 0; i < 8; i++)
+        x[i] = _mm256_aesdeclast_epi128(x[i], k[NR]);
+    }
+    for (i = 0; i < 8; i++) {
+      _mm256_storeu_si256((__m256i *)(dst + off) + i,
+                          _mm256_xor_si256(x[i], tw[i]));
+      // * x^16 in each half, as in xmul8()
+      h = _mm256_bsrli_epi128(tw[i], 14);
+      tw[i] = _mm256_xor_si256(_mm256_bslli_epi128(tw[i], 2), h);
+      tw[i] = _mm256_xor_si256(tw[i], _mm256_slli_epi64(h, 1));
+      tw[i] = _mm256_xor_si256(tw[i], _mm256_slli_epi64(h, 2));
+      tw[i] = _mm256_xor_si256(tw[i], _mm256_slli_epi64(h, 7));
+    }
+  }
+}
+
+// 32 blocks at a time, four to a 512-bit register; n % 512 == 0.
+__attribute__((target("vaes,avx512f,avx512bw,aes"))) static void
+xts_vaes512(uint64 unit, const uchar *src, uchar *dst, int n, int enc) {
+  __m512i k[NR + 1], tw[8], x[8], h;
+  __m128i t;
+  int i, r, off;
+
+  for (r = 0; r <= NR; r++)
+    k[r] = _mm512_broadcast_i32x4(
+        _mm_loadu_si128((__m128i *)(enc ? ekb[r] : dkb[r])));
+  t = tweak(unit);
+  for (i = 0; i < 8; i++) {
+    tw[i] = _mm512_castsi128_si512(t);
+    tw[i] = _mm512_inserti32x4(tw[i], t = xmul1(t), 1);
+    tw[i] = _mm512_inserti32x4(tw[i], t = xmul1(t), 2);
+    tw[i] = _mm512_inserti32x4(tw[i], t = xmul1(t), 3);
+    t = xmul1(t);
+  }
+
+  for (off = 0; off < n; off += 512) {
+    for (i = 0; i < 8; i++)
+      x[i] = _mm512_xor_si512(
+          _mm512_xor_si512(_mm512_loadu_si512((__m512i *)(src + off) + i),
+                           tw[i]),
+          k[0]);
+    if (enc) {
+      for (r = 1; r < NR; r++)
+        for (i = 0; i < 8; i++)
+          x[i] = _mm512_aesenc_epi128(x[i], k[r]);
+      for (i = 0; i < 8; i++)
+        x[i] = _mm512_aesenclast_epi128(x[i], k[NR]);
+    } else {
+      for (r = 1; r < NR; r++)
+        for (i = 0; i < 8; i++)
+          x[i] = _mm512_aesdec_epi128(x[i], k[r]);
+      for (i = 0; i < 8; i++)
+        x[i] = _mm512_aesdeclast_epi128(x[i], k[NR]);
+    }
+    for (i = 0; i < 8; i++) {
+      _mm512_storeu_si512((__m512i *)(dst + off) + i,
+                          _mm512_xor_si512(x[i], tw[i]));
+      // * x^32 in each quarter, as in xmul8()
+      h = _mm512_bsrli_epi128(tw[i], 12);
+      tw[i] = _mm512_xor_si512(_mm512_bslli_epi128(tw[i], 4), h);
+      tw[i] = _mm512_xor_si512(tw[i], _mm512_slli_epi64(h, 1));
+      tw[i] = _mm512_xor_si512(tw[i], _mm512_slli_epi64(h, 2));
+      tw[i] = _mm512_xor_si512(tw[i], _mm512_slli_epi64(h, 7));
+    }
+  }
+}
+#endif
+
+// Set the 32-byte key: the data key, then the tweak key.
+void xts_setkey(const uchar *key) {
+  int r, i;
+
+  if (sbox[0] == 0)
+    aesinit();
+  expand(key, ek);
+  expand(key + 16, tk);
+
+  // decryption runs the rounds backwards, with InvMixColumns applied
+  // to the middle round keys
+  for (r = 0; r <= NR; r++) {
+    for (i = 0; i < 4; i++) {
+      uint w = ek[4 * (NR - r) + i];
+      if (r > 0 && r < NR)
+        w = td[0][sbox[w >> 24]] ^ td[1][sbox[w >> 16 & 0xff]] ^
+            td[2][sbox[w >> 8 & 0xff]] ^ td[3][sbox[w & 0xff]];
+      dk[4 * r + i] = w;
+    }
+  }
+  tobytes(ek, ekb);
+  tobytes(dk, dkb);
+  tobytes(tk, tkb);
+  xtskeyed = 1;
+
+  aesimpl = AES_PORTABLE;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("aes"))
+    aesimpl = AES_NI;
+  if (aesimpl == AES_NI && __builtin_cpu_supports("vaes") &&
+      __builtin_cpu_supports("avx2"))
+    aesimpl = AES_VAES;
+  if (aesimpl == AES_VAES && __builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512bw"))
+    aesimpl = AES_VAES512;
+#endif
+}
+
+// Read a key file: 64 hex digits. Returns 0, or -1 if it is not one.
+int xts_loadkey(const char *path, uchar *key) {
+  FILE *f;
+  int i, c, n = 0;
+
+  if ((f = fopen(path, "r")) == NULL)
+    return -1;
+  memset(key, 0, XTSKEYLEN);
+  while ((c = fgetc(f)) != EOF && n < 2 * XTSKEYLEN) {
+    if (c >= '0' && c <= '9')
+      i = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      i = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      i = c - 'A' + 10;
+    else if (c == ' ' || c == '\n' || c == '\t' || c == '\r')
+      continue;
+    else
+      break;
+    key[n / 2] |= i << (n % 2 ? 0 : 4);
+    n++;
+  }
+  fclose(f);
+  return n == 2 * XTSKEYLEN ? 0 : -1;
+}
+
+static void xts(uint64 unit, const char *src, char *dst, int n, int enc) {
+#if defined(__x86_64__)
+  if (aesimpl >= AES_VAES512 && n % 512 == 0) {
+    xts_vaes512(unit, (const uchar *)src, (uchar *)dst, n, enc);
+    return;
+  }
+  if (aesimpl >= AES_VAES && n % 256 == 0) {
+    xts_vaes(unit, (const uchar *)src, (uchar *)dst, n, enc);
+    return;
+  }
+  if (aesimpl >= AES_NI && n % 128 == 0) {
+    xts_ni(unit, (const uchar *)src, (uchar *)dst, n, enc);
+    return;
+  }
+#endif
+  xts_portable(unit, (const uchar *)src, (uchar *)dst, n, enc);
+}
+
+// Encrypt data unit (block) no unit, n bytes (a multiple of 16), from
+// src to dst, which may be the same.
+void xts_encrypt(uint64 unit, const char *src, char *dst, int n) {
+  xts(unit, src, dst, n, 1);
+}
+
+void xts_decrypt(uint64 unit, const char *src, char *dst, int n) {
+  xts(unit, src, dst, n, 0);
+}
@@ -0,0 +1,119 @@
+// Block size benchmark: sequential and random throughput on one image.
+// make bench-bsize runs it on images made with each block size.
+#include "../defs.h"
+#include "../fcntl.h"
+#include "../file.h"
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK (1024 * 1024) // bytes per sequential read or write
+#define RANDSZ 4096         // bytes per random read or write
+
+static char buf[CHUNK];
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+  printf("Usage: bsbench [-o data=ordered] "
+         "[-k keyfile [-a aes|aesni|vaes|vaes512]] "
+         "fs.img [MiB] [random ops]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, fd, i, mb = 64, nops = 20000, datamode = DATA_JOURNAL;
+  int64 nchunk, off;
+  double t, seqw, seqr, randr, randw;
+  uchar key[XTSKEYLEN];
+  int maximpl = AES_VAES512;
+
+  while ((opt = getopt(argc, argv, "o:k:a:")) != -1) {
+    if (opt == 'o' && !strcmp(optarg, "data=ordered"))
+      datamode = DATA_ORDERED;
+    else if (opt == 'k' && xts_loadkey(optarg, key) == 0)
+      xts_setkey(key);
+    else if (opt == 'a' && !strcmp(optarg, "aes"))
+      maximpl = AES_PORTABLE; // slower AES kernels, to compare
+    else if (opt == 'a' && !strcmp(optarg, "aesni"))
+      maximpl = AES_NI;
+    else if (opt == 'a' && !strcmp(optarg, "vaes"))
+      maximpl = AES_VAES;
+    else if (opt == 'a' && !strcmp(optarg, "vaes512"))
+      maximpl = AES_VAES512;
+    else
+      usage();
+  }
+  if (aesimpl > maximpl)
+    aesimpl = maximpl;
+  if (optind >= argc)
+    usage();
+  if (optind + 1 < argc)
+    mb = atoi(argv[optind + 1]);
+  if (optind + 2 < argc)
+    nops = atoi(argv[optind + 2]);
+
+  if (secfs_mount(argv[optind], datamode, 0, 0) == 0) {
+    printf("bsbench: can't mount %s\n", argv[optind]);
+    exit(1);
+  }
+
+  if ((fd = ffopen("bsbench", O_CREATE | O_RDWR | O_TRUNC)) < 0) {
+    printf("bsbench: can't create file\n");
+    exit(1);
+  }
+  memset(buf, 'b', sizeof(buf));
+  nchunk = (int64)mb * 1024 * 1024 / CHUNK;
+
+  // sequential write, until the data is on disk
+  t = now();
+  for (i = 0; i < nchunk; i++) {
+    if (ffwrite(fd, buf, CHUNK) != CHUNK) {
+      printf("bsbench: write failed, image too small?\n");
+      exit(1);
+    }
+  }
+  ffsync(fd);
+  seqw = mb / (now() - t);
+
+  // sequential read
+  ffseek(fd, 0, 0);
+  t = now();
+  for (i = 0; i < nchunk; i++)
+    ffread(fd, buf, CHUNK);
+  seqr = mb / (now() - t);
+
+  // random aligned reads, then writes, over the whole file
+  srand(1);
+  t = now();
+  for (i = 0; i < nops; i++) {
+    off = (int64)(rand() % (nchunk * (CHUNK / RANDSZ))) * RANDSZ;
+    ffpread(fd, buf, RANDSZ, off);
+  }
+  randr = nops / (now() - t);
+
+  t = now();
+  for (i = 0; i < nops; i++) {
+    off = (int64)(rand() % (nchunk * (CHUNK / RANDSZ))) * RANDSZ;
+    ffpwrite(fd, buf, RANDSZ, off);
+  }
+  ffsync(fd);
+  randw = nops / (now() - t);
+
+  if (xtskeyed)
+    printf("%s ", aesimpl == AES_VAES512 ? "vaes512"
+                  : aesimpl == AES_VAES  ? "vaes"
+                  : aesimpl == AES_NI    ? "aesni"
+                                         : "aes");
+  printf("bsize %5u: seq write %7.1f MB/s  seq read %7.1f MB/s  "
+         "rand read %8.0f op/s  rand write %8.0f op/s\n",
+         BSIZE, seqw, seqr, randr, randw);
+
+  ffclose(fd);
+  ffunlink("bsbench");
+  return 0;
+}
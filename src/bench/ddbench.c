@@ -0,0 +1,113 @@
+// Deduplication benchmark: writes a corpus with many duplicate blocks
+// and reports the space it takes and the write throughput.
+// make bench-dedup runs it on a plain and a dedup image.
+#include "../defs.h"
+#include "../buf.h"
+#include "../fcntl.h"
+#include "../file.h"
+#include "../fs.h"
+#include <time.h>
+#include <unistd.h>
+
+#define FILESZ (1024 * 1024) // bytes per file
+#define NBASE 4              // distinct files the corpus is copied from
+#define EDIT 8               // one block in EDIT of a copy is unique
+
+static char base[NBASE][FILESZ], buf[FILESZ];
+static uint64 rnd = 88172645463325252ULL;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64 xorshift(void) {
+  rnd ^= rnd << 13;
+  rnd ^= rnd >> 7;
+  rnd ^= rnd << 17;
+  return rnd;
+}
+
+static void fill(char *p, int n) {
+  for (; n >= sizeof(uint64); n -= sizeof(uint64), p += sizeof(uint64))
+    *(uint64 *)p = xorshift();
+}
+
+// Number of blocks in use, from the bitmap.
+static uint nused(void) {
+  struct superblock *sb = curfs->super;
+  struct buf *bp;
+  uint b, n = 0;
+
+  for (b = 0; b < sb->size; b++) {
+    bp = bread(curfs->dev, BBLOCK(b, (*sb)));
+    n += (bp->data[(b % BPB) / 8] & (1 << (b % 8))) != 0;
+    brelse(bp);
+  }
+  return n;
+}
+
+static void usage(void) {
+  printf("Usage: ddbench [-o data=ordered] fs.img [MiB]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, fd, i, j, mb = 64, datamode = DATA_JOURNAL;
+  uint used;
+  char name[DIRSIZ];
+  double t;
+
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    if (opt == 'o' && !strcmp(optarg, "data=ordered"))
+      datamode = DATA_ORDERED;
+    else
+      usage();
+  }
+  if (optind >= argc)
+    usage();
+  if (optind + 1 < argc)
+    mb = atoi(argv[optind + 1]);
+
+  if (secfs_mount(argv[optind], datamode, 0, 0) == 0) {
+    printf("ddbench: can't mount %s\n", argv[optind]);
+    exit(1);
+  }
+
+  for (i = 0; i < NBASE; i++)
+    fill(base[i], FILESZ);
+  used = nused();
+
+  // copies of the base files, each with some blocks of its own
+  t = now();
+  for (i = 0; i < mb; i++) {
+    memcpy(buf, base[i % NBASE], FILESZ);
+    for (j = 0; j < FILESZ / BSIZE; j++)
+      if (xorshift() % EDIT == 0)
+        fill(buf + j * BSIZE, BSIZE);
+    snprintf(name, sizeof(name), "dd%d", i);
+    if ((fd = ffopen(name, O_CREATE | O_RDWR | O_TRUNC)) < 0 ||
+        ffwrite(fd, buf, FILESZ) != FILESZ) {
+      printf("ddbench: write failed, image too small?\n");
+      exit(1);
+    }
+    ffsync(fd);
+    ffclose(fd);
+  }
+  t = now() - t;
+  used = nused() - used;
+
+  printf("%s: logical %d MB  used %.1f MB (%u blocks)  saved %4.1f%%  "
+         "write %7.1f MB/s\n",
+         curfs->super->flags & FS_DEDUP ? "dedup" : "plain", mb,
+         (double)used * BSIZE / 1048576, used,
+         100 - 100.0 * used * BSIZE / ((double)mb * FILESZ), mb / t);
+
+  for (i = 0; i < mb; i++) {
+    snprintf(name, sizeof(name), "dd%d", i);
+    ffunlink(name);
+  }
+  return 0;
+}
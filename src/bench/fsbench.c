@@ -0,0 +1,351 @@
+// File system micro-benchmarks: throughput and latency percentiles of
+// the core operations, on a fresh image, as a table and as JSON.
+// make bench runs it.
+#include "../defs.h"
+#include "../fcntl.h"
+#include "../file.h"
+#include "../fs.h"
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK (1024 * 1024) // bytes per sequential read or write
+#define RANDSZ 4096         // bytes per random read or write
+#define MAXDEPTH 16         // deepest path namei() is timed on
+#define NLOOKUP 2000        // lookups timed at each depth
+#define NCOMMIT 2000        // small synced writes timed
+
+static char buf[CHUNK];
+
+// The result of one benchmark.
+struct result {
+  char name[32];
+  int nops;
+  double rate; // in unit per second
+  const char *unit;
+  double p50, p99, p999; // latency of an operation (us)
+};
+
+static struct result results[32];
+static int nresult;
+static double *lat; // latency of each operation (s)
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int dblcmp(const void *a, const void *b) {
+  double x = *(double *)a, y = *(double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// The q quantile of lat[0..n-1] (sorted), nearest rank, in us.
+static double pct(int n, double q) {
+  int i = (int)(q * n + 0.999999) - 1;
+
+  if (i < 0)
+    i = 0;
+  if (i >= n)
+    i = n - 1;
+  return lat[i] * 1e6;
+}
+
+// Record benchmark name: n operations of latencies lat[0..n-1],
+// amount units done in t seconds.
+static void report(const char *name, int n, double amount, const char *unit,
+                   double t) {
+  struct result *r = &results[nresult++];
+
+  qsort(lat, n, sizeof(double), dblcmp);
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->nops = n;
+  r->rate = amount / t;
+  r->unit = unit;
+  r->p50 = pct(n, 0.5);
+  r->p99 = pct(n, 0.99);
+  r->p999 = pct(n, 0.999);
+  printf("%-16s %8d ops %10.1f %-6s p50 %9.1f us  p99 %9.1f us  "
+         "p999 %9.1f us\n",
+         r->name, n, r->rate, r->unit, r->p50, r->p99, r->p999);
+}
+
+static void fail(const char *what) {
+  printf("fsbench: %s failed, image too small?\n", what);
+  exit(1);
+}
+
+// Sequential and random throughput on one file of mb MiB.
+static void benchrw(int mb, int nops) {
+  int fd, i, nchunk = mb * (1024 * 1024 / CHUNK);
+  int64 off;
+  double t, t0;
+
+  if ((fd = ffopen("rw", O_CREATE | O_RDWR | O_TRUNC)) < 0)
+    fail("create");
+  memset(buf, 'b', sizeof(buf));
+
+  // sequential write, until the data is on disk
+  t = now();
+  for (i = 0; i < nchunk; i++) {
+    t0 = now();
+    if (ffwrite(fd, buf, CHUNK) != CHUNK)
+      fail("write");
+    lat[i] = now() - t0;
+  }
+  ffsync(fd);
+  report("seq_write", nchunk, mb, "MB/s", now() - t);
+
+  // sequential read
+  ffseek(fd, 0, 0);
+  t = now();
+  for (i = 0; i < nchunk; i++) {
+    t0 = now();
+    ffread(fd, buf, CHUNK);
+    lat[i] = now() - t0;
+  }
+  report("seq_read", nchunk, mb, "MB/s", now() - t);
+
+  // random aligned reads, then writes, over the whole file
+  srand(1);
+  t = now();
+  for (i = 0; i < nops; i++) {
+    off = (int64)(rand() % (nchunk * (CHUNK / RANDSZ))) * RANDSZ;
+    t0 = now();
+    ffpread(fd, buf, RANDSZ, off);
+    lat[i] = now() - t0;
+  }
+  report("rand_read", nops, nops, "op/s", now() - t);
+
+  t = now();
+  for (i = 0; i < nops; i++) {
+    off = (int64)(rand() % (nchunk * (CHUNK / RANDSZ))) * RANDSZ;
+    t0 = now();
+    ffpwrite(fd, buf, RANDSZ, off);
+    lat[i] = now() - t0;
+  }
+  ffsync(fd);
+  report("rand_write", nops, nops, "op/s", now() - t);
+
+  ffclose(fd);
+  ffunlink("rw");
+}
+
+// stat() path, the way ls does.
+static int pstat(char *path, struct stat *st) {
+  int fd, r;
+
+  if ((fd = ffopen(path, O_RDONLY)) < 0)
+    return -1;
+  r = ffstat(fd, st);
+  ffclose(fd);
+  return r;
+}
+
+// Time stat() of each entry of directory path, as ls does.
+static void benchls(char *path) {
+  char name[MAXPATH];
+  struct dirent de;
+  struct stat st;
+  int fd, n = 0;
+  double t, t0;
+
+  if ((fd = ffopen(path, O_RDONLY)) < 0)
+    fail("open dir");
+  t = now();
+  while (ffread(fd, &de, sizeof(de)) == sizeof(de)) {
+    if (de.inum == 0)
+      continue;
+    snprintf(name, sizeof(name), "%s/%.*s", path, DIRSIZ, de.name);
+    t0 = now();
+    if (pstat(name, &st) < 0)
+      fail("stat");
+    lat[n++] = now() - t0;
+  }
+  ffclose(fd);
+  report("ls", n, n, "ent/s", now() - t);
+}
+
+// Create, list and unlink nfile empty files in one directory.
+static void benchmeta(int nfile) {
+  char name[MAXPATH];
+  int fd, i;
+  double t, t0;
+
+  if (ffmkdir("meta") < 0)
+    fail("mkdir");
+  t = now();
+  for (i = 0; i < nfile; i++) {
+    snprintf(name, sizeof(name), "meta/f%d", i);
+    t0 = now();
+    if ((fd = ffopen(name, O_CREATE | O_RDWR)) < 0)
+      fail("create");
+    ffclose(fd);
+    lat[i] = now() - t0;
+  }
+  report("create", nfile, nfile, "op/s", now() - t);
+
+  benchls("meta");
+
+  t = now();
+  for (i = 0; i < nfile; i++) {
+    snprintf(name, sizeof(name), "meta/f%d", i);
+    t0 = now();
+    if (ffunlink(name) < 0)
+      fail("unlink");
+    lat[i] = now() - t0;
+  }
+  report("unlink", nfile, nfile, "op/s", now() - t);
+  ffunlink("meta");
+}
+
+// Put in p the path of a file at depth depth: depth - 1 directories
+// n, then f.
+static void npath(char *p, int depth) {
+  for (*p = 0; depth > 1; depth--)
+    strcat(p, "n/");
+  strcat(p, "f");
+}
+
+// Time opening a file at depths 1, 2, 4, ... MAXDEPTH.
+static void benchnamei(void) {
+  char path[MAXPATH], bname[32];
+  int fd, d, depth, i;
+  double t, t0;
+
+  for (depth = 1, d = 1; depth <= MAXDEPTH; depth *= 2) {
+    for (; d < depth; d++) {
+      npath(path, d + 1);
+      path[strlen(path) - 2] = 0; // the directory
+      if (ffmkdir(path) < 0)
+        fail("mkdir");
+    }
+    npath(path, depth);
+    if ((fd = ffopen(path, O_CREATE | O_RDWR)) < 0)
+      fail("create");
+    ffclose(fd);
+
+    t = now();
+    for (i = 0; i < NLOOKUP; i++) {
+      t0 = now();
+      if ((fd = ffopen(path, O_RDONLY)) < 0)
+        fail("open");
+      ffclose(fd);
+      lat[i] = now() - t0;
+    }
+    snprintf(bname, sizeof(bname), "namei_depth_%d", depth);
+    report(bname, NLOOKUP, NLOOKUP, "op/s", now() - t);
+  }
+
+  // remove the tree, deepest first
+  for (d = MAXDEPTH; d >= 1; d--) {
+    npath(path, d);
+    ffunlink(path);
+    if (d > 1) {
+      path[strlen(path) - 2] = 0;
+      ffunlink(path);
+    }
+  }
+}
+
+// Time small writes that each commit a transaction.
+static void benchcommit(void) {
+  int fd, i;
+  double t, t0;
+
+  if ((fd = ffopen("commit", O_CREATE | O_RDWR)) < 0)
+    fail("create");
+  curfs->syncwrite = 1;
+  t = now();
+  for (i = 0; i < NCOMMIT; i++) {
+    t0 = now();
+    if (ffpwrite(fd, buf, 64, (int64)(i % 64) * 64) != 64)
+      fail("write");
+    lat[i] = now() - t0;
+  }
+  report("commit", NCOMMIT, NCOMMIT, "op/s", now() - t);
+  curfs->syncwrite = 0;
+  ffclose(fd);
+  ffunlink("commit");
+}
+
+// Write the results as JSON to path.
+static void writejson(char *path, char *mode) {
+  FILE *f;
+  int i;
+
+  if ((f = fopen(path, "w")) == NULL) {
+    printf("fsbench: can't write %s\n", path);
+    exit(1);
+  }
+  fprintf(f, "{\n  \"bsize\": %u,\n  \"datamode\": \"%s\",\n  \"results\": [\n",
+          BSIZE, mode);
+  for (i = 0; i < nresult; i++)
+    fprintf(f,
+            "    {\"name\": \"%s\", \"ops\": %d, \"rate\": %.1f, "
+            "\"unit\": \"%s\", \"p50_us\": %.2f, \"p99_us\": %.2f, "
+            "\"p999_us\": %.2f}%s\n",
+            results[i].name, results[i].nops, results[i].rate,
+            results[i].unit, results[i].p50, results[i].p99, results[i].p999,
+            i + 1 < nresult ? "," : "");
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+static void usage(void) {
+  printf("Usage: fsbench [-o data=ordered] [-j out.json] fs.img [MiB] "
+         "[random ops] [files]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, mb = 64, nops = 20000, nfile = 2000, datamode = DATA_JOURNAL;
+  char *json = 0;
+
+  while ((opt = getopt(argc, argv, "o:j:")) != -1) {
+    if (opt == 'o' && !strcmp(optarg, "data=ordered"))
+      datamode = DATA_ORDERED;
+    else if (opt == 'j')
+      json = optarg;
+    else
+      usage();
+  }
+  if (optind >= argc)
+    usage();
+  if (optind + 1 < argc)
+    mb = atoi(argv[optind + 1]);
+  if (optind + 2 < argc)
+    nops = atoi(argv[optind + 2]);
+  if (optind + 3 < argc)
+    nfile = atoi(argv[optind + 3]);
+  if (mb <= 0 || nops <= 0 || nfile <= 0)
+    usage();
+
+  if (secfs_mount(argv[optind], datamode, 0, 0) == 0) {
+    printf("fsbench: can't mount %s\n", argv[optind]);
+    exit(1);
+  }
+
+  opt = mb * (1024 * 1024 / CHUNK);
+  opt = opt > nops ? opt : nops;
+  opt = opt > nfile ? opt : nfile;
+  opt = opt > NLOOKUP ? opt : NLOOKUP;
+  opt = opt > NCOMMIT ? opt : NCOMMIT;
+  if ((lat = malloc(opt * sizeof(double))) == 0) {
+    printf("fsbench: out of memory\n");
+    exit(1);
+  }
+
+  printf("bsize %u, data=%s\n", BSIZE,
+         datamode == DATA_ORDERED ? "ordered" : "journal");
+  benchrw(mb, nops);
+  benchmeta(nfile);
+  benchnamei();
+  benchcommit();
+
+  if (json)
+    writejson(json, datamode == DATA_ORDERED ? "ordered" : "journal");
+  free(lat);
+  return 0;
+}
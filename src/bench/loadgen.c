@@ -0,0 +1,271 @@
+// Load generator for secfsd (server/secfsd.c): 1, 2, 4 ... clients,
+// each with a connection and a file of its own, keep depth requests in
+// flight each (4 KiB reads and writes at random, and mkdir/unlink
+// pairs), and it reports the throughput and latency of each round.
+// make bench-server runs it.
+#include "../defs.h"
+#include "../fcntl.h"
+#include "../server/proto.h"
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILESZ (256 * 1024) // bytes of each client's file
+#define IOSZ 4096           // bytes per read or write
+#define MAXDEPTH 32         // replies stay within the socket buffers
+#define MAXLAT (1 << 20)    // latencies kept per client
+
+// A client of a round.
+struct client {
+  int id, sock, fd;
+  uint64 rnd;
+  int nops;
+  double *lat; // of its first MAXLAT requests (s)
+};
+
+static char *path = SSOCK;
+static int port, depth = 8, meta = 10, writes = 30;
+static double secs = 2;
+static double stopat; // when the round ends
+
+static void usage(void) {
+  printf("Usage: loadgen [-s socket | -p port] [-c maxclients] [-t secs] "
+         "[-d depth] [-w write%%] [-m mkdir%%]\n");
+  exit(1);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64 xorshift(struct client *c) {
+  c->rnd ^= c->rnd << 13;
+  c->rnd ^= c->rnd >> 7;
+  c->rnd ^= c->rnd << 17;
+  return c->rnd;
+}
+
+static int dblcmp(const void *a, const void *b) {
+  double x = *(double *)a, y = *(double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void fail(const char *what) {
+  printf("loadgen: %s failed\n", what);
+  exit(1);
+}
+
+static int dial(void) {
+  struct sockaddr_un un;
+  struct sockaddr_in in;
+  int s, one = 1;
+
+  if (port) {
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (s < 0 || connect(s, (struct sockaddr *)&in, sizeof(in)) < 0)
+      fail("connect");
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  } else {
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", path);
+    if (s < 0 || connect(s, (struct sockaddr *)&un, sizeof(un)) < 0)
+      fail("connect");
+  }
+  return s;
+}
+
+static void sendall(int s, void *p, int n) {
+  int k;
+
+  for (; n > 0; n -= k, p = (char *)p + k)
+    if ((k = send(s, p, n, MSG_NOSIGNAL)) <= 0)
+      fail("send");
+}
+
+static void recvall(int s, void *p, int n) {
+  int k;
+
+  for (; n > 0; n -= k, p = (char *)p + k)
+    if ((k = recv(s, p, n, 0)) <= 0)
+      fail("recv");
+}
+
+// Send a request: op on fd at off, for n bytes back, with len bytes
+// of payload p.
+static void req(struct client *c, int op, int fd, int64 off, uint n,
+                const void *p, uint len, uint tag) {
+  struct sreq q;
+
+  memset(&q, 0, sizeof(q));
+  q.op = op;
+  q.fd = fd;
+  q.off = off;
+  q.n = n;
+  q.len = len;
+  q.tag = tag;
+  sendall(c->sock, &q, sizeof(q));
+  if (len)
+    sendall(c->sock, (void *)p, len);
+}
+
+// Receive a reply, its data into p. Returns what the call returned.
+static int64 rep(struct client *c, void *p, uint *tag) {
+  struct srep r;
+
+  recvall(c->sock, &r, sizeof(r));
+  if (r.len > SMAXIO)
+    fail("reply");
+  recvall(c->sock, p, r.len);
+  if (tag)
+    *tag = r.tag;
+  return r.ret;
+}
+
+// Send a request and wait for its reply.
+static int64 call(struct client *c, int op, int fd, int64 off, uint n,
+                  const void *p, uint len, void *data) {
+  req(c, op, fd, off, n, p, len, 0);
+  return rep(c, data, 0);
+}
+
+static void *run(void *arg) {
+  struct client *c = arg;
+  static char zero[FILESZ];
+  char name[32], buf[IOSZ];
+  double sent[MAXDEPTH];
+  uint seq = 0, tag, inflight = 0, k = 0;
+  int r, rmdir = 0;
+
+  c->sock = dial();
+  snprintf(name, sizeof(name), "lg%d", c->id);
+  if ((c->fd = call(c, S_OPEN, -1, O_CREATE | O_RDWR, 0, name,
+                    strlen(name) + 1, 0)) < 0)
+    fail("open");
+  if (call(c, S_PWRITE, c->fd, 0, 0, zero, FILESZ, 0) != FILESZ)
+    fail("write");
+  memset(buf, c->id, sizeof(buf));
+
+  while (1) {
+    while (inflight < depth && now() < stopat) {
+      r = xorshift(c) % 100;
+      sent[seq % depth] = now();
+      if (rmdir || r < meta) {
+        // a mkdir, then the unlink of the directory
+        if (!rmdir)
+          snprintf(name, sizeof(name), "lgd%d_%u", c->id, k++);
+        req(c, rmdir ? S_UNLINK : S_MKDIR, -1, 0, 0, name, strlen(name) + 1,
+            seq++);
+        rmdir = !rmdir;
+      } else if (r < meta + writes) {
+        req(c, S_PWRITE, c->fd, xorshift(c) % (FILESZ / IOSZ) * IOSZ, 0, buf,
+            IOSZ, seq++);
+      } else {
+        req(c, S_PREAD, c->fd, xorshift(c) % (FILESZ / IOSZ) * IOSZ, IOSZ, 0,
+            0, seq++);
+      }
+      inflight++;
+    }
+    if (inflight == 0)
+      break;
+    rep(c, buf, &tag);
+    if (c->nops < MAXLAT)
+      c->lat[c->nops] = now() - sent[tag % depth];
+    c->nops++;
+    inflight--;
+  }
+
+  if (rmdir)
+    call(c, S_UNLINK, -1, 0, 0, name, strlen(name) + 1, 0);
+  call(c, S_CLOSE, c->fd, 0, 0, 0, 0, 0);
+  snprintf(name, sizeof(name), "lg%d", c->id);
+  call(c, S_UNLINK, -1, 0, 0, name, strlen(name) + 1, 0);
+  close(c->sock);
+  return 0;
+}
+
+// Run a round of n clients.
+static void runround(int n) {
+  struct client *c;
+  pthread_t *th;
+  double *lat, t;
+  int i, j, nops = 0, nlat = 0;
+
+  if ((c = calloc(n, sizeof(*c))) == 0 || (th = malloc(n * sizeof(*th))) == 0)
+    fail("malloc");
+  for (i = 0; i < n; i++) {
+    c[i].id = i;
+    c[i].rnd = 88172645463325252ULL + i;
+    if ((c[i].lat = malloc(MAXLAT * sizeof(double))) == 0)
+      fail("malloc");
+  }
+  t = now();
+  stopat = t + secs;
+  for (i = 0; i < n; i++)
+    pthread_create(&th[i], 0, run, &c[i]);
+  for (i = 0; i < n; i++)
+    pthread_join(th[i], 0);
+  t = now() - t;
+
+  for (i = 0; i < n; i++) {
+    nops += c[i].nops;
+    nlat += c[i].nops < MAXLAT ? c[i].nops : MAXLAT;
+  }
+  if ((lat = malloc((nlat + 1) * sizeof(double))) == 0)
+    fail("malloc");
+  for (i = 0, nlat = 0; i < n; i++) {
+    for (j = 0; j < c[i].nops && j < MAXLAT; j++)
+      lat[nlat++] = c[i].lat[j];
+    free(c[i].lat);
+  }
+  qsort(lat, nlat, sizeof(double), dblcmp);
+  printf("clients %3d  %8d ops %10.1f op/s  p50 %9.1f us  p99 %9.1f us  "
+         "p999 %9.1f us\n",
+         n, nops, nops / t, lat[(int)(nlat * 0.5)] * 1e6,
+         lat[(int)(nlat * 0.99)] * 1e6, lat[(int)(nlat * 0.999)] * 1e6);
+  free(lat);
+  free(c);
+  free(th);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, n, maxc = 32;
+
+  while ((opt = getopt(argc, argv, "s:p:c:t:d:w:m:")) != -1) {
+    if (opt == 's')
+      path = optarg;
+    else if (opt == 'p' && (port = atoi(optarg)) > 0 && port < 65536)
+      ;
+    else if (opt == 'c' && (maxc = atoi(optarg)) > 0 && maxc < NOFILE)
+      ;
+    else if (opt == 't' && (secs = atof(optarg)) > 0)
+      ;
+    else if (opt == 'd' && (depth = atoi(optarg)) > 0 && depth <= MAXDEPTH)
+      ;
+    else if (opt == 'w' && (writes = atoi(optarg)) >= 0)
+      ;
+    else if (opt == 'm' && (meta = atoi(optarg)) >= 0)
+      ;
+    else
+      usage();
+  }
+  if (optind != argc || meta + writes > 100)
+    usage();
+
+  printf("depth %d, %d%% writes, %d%% mkdir/unlink, %d B reads and writes\n",
+         depth, writes, meta, IOSZ);
+  for (n = 1; n <= maxc; n *= 2)
+    runround(n);
+  return 0;
+}
@@ -0,0 +1,323 @@
+// Trace replay: runs the calls of a trace recorded with secfs -t
+// (trace.c) again on an image, single- or multi-threaded, at the
+// recorded pace or as fast as it can, and reports a latency histogram
+// of each kind of call next to the recorded latencies.
+#include "../defs.h"
+#include "../fcntl.h"
+#include "../file.h"
+#include "../trace.h"
+#include <time.h>
+#include <unistd.h>
+
+#define NBUCKET 24 // latency buckets: < 1us, then [2^(i-1), 2^i) us
+#define MAXTFD 256 // traced fds followed
+
+// A traced call and its replay.
+struct call {
+  struct tracerec r;
+  char *path, *path2;
+  int src;       // call that returned the fd it uses, or -1
+  int dep;       // call that must be replayed first, or -1
+  int rfd;       // fd the replay got, if it returns one
+  uint lat;      // replayed duration (ns)
+  volatile int done;
+};
+
+static struct call *calls;
+static int ncall;
+static uint maxlen;   // largest read or write
+static int nthread = 1;
+static int realtime;  // keep the recorded pace
+static double start;  // when the replay began
+static int nmismatch; // calls that failed when the traced one did not,
+                      // or the other way
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int usesfd(int op) {
+  return op >= TR_CLOSE && op <= TR_DUP;
+}
+
+// Read the trace in path into calls.
+static void load(char *path) {
+  struct tracehdr h;
+  struct call *c;
+  FILE *f;
+  int max = 0;
+
+  if ((f = fopen(path, "rb")) == NULL || fread(&h, sizeof(h), 1, f) != 1 ||
+      h.magic != TRACEMAGIC || h.version != 1) {
+    printf("replay: %s is not a trace\n", path);
+    exit(1);
+  }
+  for (;;) {
+    if (ncall == max) {
+      max = max ? max * 2 : 4096;
+      if ((calls = realloc(calls, max * sizeof(*calls))) == 0) {
+        printf("replay: out of memory\n");
+        exit(1);
+      }
+    }
+    c = &calls[ncall];
+    memset(c, 0, sizeof(*c));
+    if (fread(&c->r, sizeof(c->r), 1, f) != 1)
+      break;
+    if (c->r.op == 0 || c->r.op >= NTRACEOP) {
+      printf("replay: bad call %d in trace\n", ncall);
+      exit(1);
+    }
+    if (c->r.plen > 0) {
+      if ((c->path = calloc(c->r.plen + 1, 1)) == 0 ||
+          fread(c->path, 1, c->r.plen, f) != c->r.plen) {
+        printf("replay: trace cut short\n");
+        exit(1);
+      }
+      c->path2 = c->path + strlen(c->path) + 1; // "" if just one
+    }
+    if (c->r.op >= TR_READ && c->r.op <= TR_WRITEV && c->r.len > maxlen)
+      maxlen = c->r.len;
+    ncall++;
+  }
+  fclose(f);
+}
+
+// Work out which call returned the fd each call uses, and which must
+// be replayed before it: that one, or for a close, the last call
+// using the fd.
+static void deps(void) {
+  int fdsrc[MAXTFD], lastuse[MAXTFD], i, fd;
+  struct call *c;
+
+  for (fd = 0; fd < MAXTFD; fd++)
+    fdsrc[fd] = lastuse[fd] = -1;
+  for (i = 0; i < ncall; i++) {
+    c = &calls[i];
+    c->src = c->dep = -1;
+    fd = c->r.fd;
+    if (usesfd(c->r.op) && fd >= 0 && fd < MAXTFD) {
+      c->src = fdsrc[fd];
+      c->dep = c->r.op == TR_CLOSE ? lastuse[fd] : c->src;
+      lastuse[fd] = i;
+      if (c->r.op == TR_CLOSE && c->r.ret == 0)
+        fdsrc[fd] = lastuse[fd] = -1;
+    }
+    fd = c->r.ret;
+    if ((c->r.op == TR_OPEN || c->r.op == TR_DUP) && fd >= 0 && fd < MAXTFD)
+      fdsrc[fd] = lastuse[fd] = i;
+  }
+}
+
+// Run call c, with buffer buf, and return what it returned.
+static int64 run(struct call *c, char *buf) {
+  int fd = c->src >= 0 ? calls[c->src].rfd : -1;
+  struct iovec iov;
+  struct stat st;
+
+  iov.iov_base = buf;
+  iov.iov_len = c->r.len;
+  switch (c->r.op) {
+  case TR_OPEN:
+    return c->rfd = ffopen(c->path, c->r.off);
+  case TR_CLOSE:
+    return ffclose(fd);
+  case TR_READ:
+    return ffread(fd, buf, c->r.len);
+  case TR_WRITE:
+    return ffwrite(fd, buf, c->r.len);
+  case TR_PREAD:
+    return ffpread(fd, buf, c->r.len, c->r.off);
+  case TR_PWRITE:
+    return ffpwrite(fd, buf, c->r.len, c->r.off);
+  case TR_READV:
+    return ffreadv(fd, &iov, 1);
+  case TR_WRITEV:
+    return ffwritev(fd, &iov, 1);
+  case TR_SYNC:
+    return ffsync(fd);
+  case TR_STAT:
+    return ffstat(fd, &st);
+  case TR_SEEK:
+    return ffseek(fd, c->r.off, 0);
+  case TR_DUP:
+    return c->rfd = ffdup(fd);
+  case TR_LINK:
+    return fflink(c->path, c->path2);
+  case TR_CLONE:
+    return ffclone(c->path, c->path2);
+  case TR_UNLINK:
+    return ffunlink(c->path);
+  case TR_MKDIR:
+    return ffmkdir(c->path);
+  case TR_MKNOD:
+    return ffmknod(c->path, c->r.off, c->r.len);
+  case TR_CHDIR:
+    return ffchdir(c->path);
+  }
+  return -1;
+}
+
+// Replay the calls of the traced threads with tid % nthread == k.
+static void *replayer(void *arg) {
+  int k = (long)arg, i;
+  struct call *c;
+  double t, wait;
+  char *buf;
+  int64 r;
+
+  if ((buf = malloc(maxlen + 1)) == 0) {
+    printf("replay: out of memory\n");
+    exit(1);
+  }
+  memset(buf, 'r', maxlen + 1);
+  for (i = 0; i < ncall; i++) {
+    c = &calls[i];
+    if (c->r.tid % nthread != k)
+      continue;
+    if (nthread > 1 && c->dep >= 0 && !calls[c->dep].done) {
+      pthread_mutex_lock(&lock);
+      while (!calls[c->dep].done)
+        pthread_cond_wait(&donecond, &lock);
+      pthread_mutex_unlock(&lock);
+    }
+    if (realtime && (wait = start + c->r.ts / 1e9 - now()) > 0)
+      usleep(wait * 1e6);
+
+    t = now();
+    r = run(c, buf);
+    c->lat = (now() - t) * 1e9;
+    if ((r < 0) != (c->r.ret < 0))
+      __sync_fetch_and_add(&nmismatch, 1);
+
+    if (nthread > 1) {
+      pthread_mutex_lock(&lock);
+      c->done = 1;
+      pthread_cond_broadcast(&donecond);
+      pthread_mutex_unlock(&lock);
+    }
+  }
+  free(buf);
+  return 0;
+}
+
+static int uintcmp(const void *a, const void *b) {
+  uint x = *(uint *)a, y = *(uint *)b;
+  return x < y ? -1 : x > y;
+}
+
+// The q quantile of sorted v[0..n-1] in us.
+static double pct(uint *v, int n, double q) {
+  int i = (int)(q * n + 0.999999) - 1;
+
+  return v[i < 0 ? 0 : i >= n ? n - 1 : i] / 1e3;
+}
+
+static int bucket(uint ns) {
+  int b = 0;
+
+  for (ns /= 1000; ns > 0 && b < NBUCKET - 1; ns >>= 1)
+    b++;
+  return b;
+}
+
+// Print the latencies of the calls to op, recorded and replayed.
+static void report(int op) {
+  uint *tr, *rp, hist[NBUCKET], top = 0;
+  int i, n = 0, w;
+
+  if ((tr = malloc(ncall * sizeof(uint))) == 0 ||
+      (rp = malloc(ncall * sizeof(uint))) == 0) {
+    printf("replay: out of memory\n");
+    exit(1);
+  }
+  memset(hist, 0, sizeof(hist));
+  for (i = 0; i < ncall; i++) {
+    if (calls[i].r.op != op)
+      continue;
+    tr[n] = calls[i].r.dur;
+    rp[n++] = calls[i].lat;
+    hist[bucket(calls[i].lat)]++;
+  }
+  if (n > 0) {
+    qsort(tr, n, sizeof(uint), uintcmp);
+    qsort(rp, n, sizeof(uint), uintcmp);
+    printf("%-7s %8d calls  traced p50 %8.1f p99 %8.1f us  "
+           "replayed p50 %8.1f p99 %8.1f p999 %8.1f max %9.1f us\n",
+           tracename[op], n, pct(tr, n, 0.5), pct(tr, n, 0.99),
+           pct(rp, n, 0.5), pct(rp, n, 0.99), pct(rp, n, 0.999),
+           rp[n - 1] / 1e3);
+    for (i = 0; i < NBUCKET; i++)
+      top = hist[i] > top ? hist[i] : top;
+    for (i = 0; i < NBUCKET; i++) {
+      if (hist[i] == 0)
+        continue;
+      if (i == 0)
+        printf("  %20s ", "< 1us");
+      else
+        printf("  [%6uus, %6uus) ", 1u << (i - 1), 1u << i);
+      printf("%8u ", hist[i]);
+      for (w = (hist[i] * 40 + top - 1) / top; w > 0; w--)
+        putchar('#');
+      putchar('\n');
+    }
+  }
+  free(tr);
+  free(rp);
+}
+
+static void usage(void) {
+  printf("Usage: replay [-o data=ordered] [-j nthreads] [-r] trace fs.img\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, i, datamode = DATA_JOURNAL;
+  pthread_t *th;
+  double t;
+
+  while ((opt = getopt(argc, argv, "o:j:r")) != -1) {
+    if (opt == 'o' && !strcmp(optarg, "data=ordered"))
+      datamode = DATA_ORDERED;
+    else if (opt == 'j' && (nthread = atoi(optarg)) > 0)
+      continue;
+    else if (opt == 'r')
+      realtime = 1;
+    else
+      usage();
+  }
+  if (optind + 2 != argc)
+    usage();
+
+  load(argv[optind]);
+  deps();
+  if (secfs_mount(argv[optind + 1], datamode, 0, 0) == 0) {
+    printf("replay: can't mount %s\n", argv[optind + 1]);
+    exit(1);
+  }
+
+  if ((th = malloc(nthread * sizeof(pthread_t))) == 0) {
+    printf("replay: out of memory\n");
+    exit(1);
+  }
+  start = t = now();
+  for (i = 0; i < nthread; i++)
+    pthread_create(&th[i], 0, replayer, (void *)(long)i);
+  for (i = 0; i < nthread; i++)
+    pthread_join(th[i], 0);
+  pflushall();
+  t = now() - t;
+
+  printf("%d calls in %.3f s (%.0f calls/s), %d thread(s), %s; "
+         "%d did not fail or succeed as traced\n",
+         ncall, t, ncall / t, nthread, realtime ? "traced pace" : "max speed",
+         nmismatch);
+  for (i = 1; i < NTRACEOP; i++)
+    report(i);
+  return 0;
+}
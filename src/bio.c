@@ -1,67 +1,101 @@
 #include "buf.h"
 #include "sleeplock.h"
 #include "spinlock.h"
+#include "stats.h"
 
-// bufs cache
-struct {
+#define NBUCKET 127 // hash buckets for cached block lookup
+#define BHASH(dev, blkno) (((dev) * 31 + (blkno)) % NBUCKET)
+
+// bufs cache, one per mount
+struct bcache {
   struct spinlock lock;
   struct buf buf[NBUF];
+  struct buf *hash[NBUCKET]; // cached blocks, chained through hnext
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
   // head.next is most recent, head.prev is least.
   struct buf head;
-} bcache;
+};
 
-// init bufs cache
+// init bufs cache of the calling thread's mount
 void binit(void) {
+  struct bcache *bc;
   struct buf *b;
 
-  init_spinlock(&bcache.lock, "bcache");
+  if ((bc = calloc(1, sizeof(*bc))) == 0) {
+    printf("panic: binit: out of memory");
+    exit(1);
+  }
+  curfs->bcache = bc;
+  init_spinlock(&bc->lock, "bcache");
 
   // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  bc->head.prev = &bc->head;
+  bc->head.next = &bc->head;
 
-  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+  for (b = bc->buf; b < bc->buf + NBUF; b++) {
     init_sleeplock(&b->lock, "buffer");
 
     // get b's link
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+    b->next = bc->head.next;
+    b->prev = &bc->head;
 
     // update original head.next and head
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bc->head.next->prev = b;
+    bc->head.next = b;
   }
 }
 
-static struct buf *bget(uint dev, uint blkno) {
+// Remove b from its hash bucket.
+// Caller must hold bc->lock.
+static void bunhash(struct bcache *bc, struct buf *b) {
+  struct buf **pp;
+
+  for (pp = &bc->hash[BHASH(b->dev, b->blkno)]; *pp; pp = &(*pp)->hnext) {
+    if (*pp == b) {
+      *pp = b->hnext;
+      break;
+    }
+  }
+}
+
+// Return a locked buffer for block blkno of dev, valid only if it
+// was cached. Callers other than bread fill it themselves.
+struct buf *bget(uint dev, uint blkno) {
+  struct bcache *bc = DEVFS(dev)->bcache;
   struct buf *b;
 
-  acquire_spinlock(&bcache.lock);
+  acquire_spinlock(&bc->lock);
 
   // Is the block already cached?
-  // search the most recently used buffer
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+  for (b = bc->hash[BHASH(dev, blkno)]; b; b = b->hnext) {
     if (b->dev == dev && b->blkno == blkno) {
       b->refcnt++;
-      release_spinlock(&bcache.lock);
-      acquire_sleeplock(&b->lock);
+      release_spinlock(&bc->lock);
+      statadd(ST_BHIT, 1);
+      histadd(H_BGETWAIT, acquire_sleeplock_wait(&b->lock), blkno);
       return b;
     }
   }
 
   // Not cached.
   // Recycle the least recently used (LRU) unused buffer.
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
+  for (b = bc->head.prev; b != &bc->head; b = b->prev) {
     if (b->refcnt == 0) {
+      statadd(ST_BMISS, 1);
+      if (b->dev) {
+        bunhash(bc, b);
+        statadd(ST_BEVICT, 1);
+      }
       b->dev = dev;
       b->blkno = blkno;
       b->valid = 0;
       b->refcnt = 1;
-      release_spinlock(&bcache.lock);
-      acquire_sleeplock(&b->lock);
+      b->hnext = bc->hash[BHASH(dev, blkno)];
+      bc->hash[BHASH(dev, blkno)] = b;
+      release_spinlock(&bc->lock);
+      histadd(H_BGETWAIT, acquire_sleeplock_wait(&b->lock), blkno);
       return b;
     }
   }
@@ -83,6 +117,18 @@ struct buf *bread(uint dev, uint blkno) {
   return b;
 }
 
+// Return a locked buffer for a block whose old contents do not
+// matter (e.g. just allocated), zero-filled without reading the disk.
+struct buf *bnew(uint dev, uint blkno) {
+  struct buf *b;
+
+  b = bget(dev, blkno);
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+
+  return b;
+}
+
 void bwrite(struct buf *b) {
   if (!hold_sleeplock(&b->lock)) {
     printf("panic: bwrite\n");
@@ -95,6 +141,8 @@ void bwrite(struct buf *b) {
 // Release a locked buffer.
 // Move to the head of the most-recently-used list.
 void brelse(struct buf *b) {
+  struct bcache *bc = DEVFS(b->dev)->bcache;
+
   if (!hold_sleeplock(&b->lock)) {
     printf("panic: brelse\n");
     exit(1);
@@ -102,7 +150,7 @@ void brelse(struct buf *b) {
 
   release_sleeplock(&b->lock);
 
-  acquire_spinlock(&bcache.lock);
+  acquire_spinlock(&bc->lock);
 
   b->refcnt--;
   if (b->refcnt == 0) {
@@ -111,24 +159,80 @@ void brelse(struct buf *b) {
     b->next->prev = b->prev;
     b->prev->next = b->next;
 
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+    b->next = bc->head.next;
+    b->prev = &bc->head;
 
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bc->head.next->prev = b;
+    bc->head.next = b;
   }
 
-  release_spinlock(&bcache.lock);
+  release_spinlock(&bc->lock);
 }
 
 void bpin(struct buf *b) {
-  acquire_spinlock(&bcache.lock);
+  struct bcache *bc = DEVFS(b->dev)->bcache;
+
+  acquire_spinlock(&bc->lock);
   b->refcnt++;
-  release_spinlock(&bcache.lock);
+  release_spinlock(&bc->lock);
 }
 
 void bunpin(struct buf *b) {
-  acquire_spinlock(&bcache.lock);
+  struct bcache *bc = DEVFS(b->dev)->bcache;
+
+  acquire_spinlock(&bc->lock);
   b->refcnt--;
-  release_spinlock(&bcache.lock);
+  release_spinlock(&bc->lock);
+}
+
+// Forget the cached blocks of dev, after its block size has changed.
+// None of them may be in use.
+void binval(uint dev) {
+  struct bcache *bc = DEVFS(dev)->bcache;
+  struct buf *b;
+
+  acquire_spinlock(&bc->lock);
+  for (b = bc->buf; b < bc->buf + NBUF; b++) {
+    if (b->dev != dev)
+      continue;
+    if (b->refcnt != 0) {
+      printf("panic: binval: buffer in use");
+      exit(1);
+    }
+    bunhash(bc, b);
+    b->dev = 0;
+    b->valid = 0;
+  }
+  release_spinlock(&bc->lock);
+}
+
+// Forget the cached block blkno of dev, if any, e.g. because the
+// block was freed and what was cached for it is stale.
+void bforget(uint dev, uint blkno) {
+  struct bcache *bc = DEVFS(dev)->bcache;
+  struct buf *b;
+
+  acquire_spinlock(&bc->lock);
+  for (b = bc->hash[BHASH(dev, blkno)]; b; b = b->hnext) {
+    if (b->dev == dev && b->blkno == blkno) {
+      if (b->refcnt != 0) {
+        printf("panic: bforget: buffer in use");
+        exit(1);
+      }
+      bunhash(bc, b);
+      b->dev = 0;
+      b->valid = 0;
+      break;
+    }
+  }
+  release_spinlock(&bc->lock);
+}
+
+// Free the bufs cache of the calling thread's mount, after the last
+// commit. None of its buffers may be in use.
+void bdone(void) {
+  binval(curfs->dev);
+  binval(curfs->dev | CDEV);
+  free(curfs->bcache);
+  curfs->bcache = 0;
 }
@@ -16,7 +16,8 @@ struct buf {
   uint refcnt;      // Is any inode refer to the buf?
   struct buf *prev; // used for LRU reuse
   struct buf *next; // used to find if a buf is existing
-  char data[BSIZE]; // the data of the buf
+  struct buf *hnext; // next buf in the same hash bucket
+  char data[MAXBSIZE]; // the data of the buf, room for any block size
 };
 
 #endif
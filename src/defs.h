@@ -5,25 +5,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 typedef unsigned char uchar;
 typedef unsigned short ushort;
 typedef unsigned int uint;
 typedef unsigned long long uint64;
+typedef long long int64;
 
-#define ROOTDEV 1            // device no of file system root disk
-#define BSIZE 1024           // block size
-#define MAXOPBLKS 10         // max number of blocks by once write operation
-#define NBUF (MAXOPBLKS * 3) // buf num in buffer cache
-#define NLOG (MAXOPBLKS * 3) // log num in on-disk log
+#define ROOTDEV 1            // device no of the first image mounted
+#define NMOUNT 8             // images mounted at once, by device no
+#define CDEV 0x80000000      // device no bit of decompressed clusters (fs.c)
+#ifndef BSIZE
+#define BSIZE (curfs->bsize) // block size, from the super block
+#endif
+#define DEFBSIZE 1024        // block size of images made without mkfs -b
+#define MAXBSIZE 65536       // largest block size
+#define MAXOPBLKS 30         // max number of blocks by once write operation
+#define NLOG 250             // log num in on-disk log (header fits a block)
+#define MAXLOGOP (NLOG - 1 - MAXOPBLKS) // max blocks reserved by one big write
+#define NBUF (NLOG + MAXOPBLKS * 3)     // buf num in buffer cache
 
-#define NOFILE 16     // open files per process
-#define NFILE 100     // open files per system
-#define NINODE 50     // maximum number of active i-nodes
-#define NINODEBLK 200 // num of inode blocks on disk
+#define NOFILE 64     // fds per mount: size of its ofile table
+#define NFILE 100     // struct files per mount, which fds (dup) share
+#define NINODE 128    // maximum number of active i-nodes
+#define NINODEBLK 200 // default num of inodes on disk
 #define FSSIZE 200000 // size of the file system in blocks(For big File)
 #define MAXPATH 128   // maximum file path name
 
+#define DATA_JOURNAL 0 // file data goes through the log with metadata
+#define DATA_ORDERED 1 // file data is written in place before metadata commits
+
+#define NPAGEBYTES (4096 * 1024) // max file data cached before write back
+#define FLUSHSEC 5   // seconds between background write backs
+
 #define T_DIR 1    // Directory
 #define T_FILE 2   // File
 #define T_DEVICE 3 // Device
@@ -33,17 +48,46 @@ struct stat;
 struct inode;
 struct superblock;
 
+// A mounted image (mount.c). Each part of the file system keeps its
+// state for the image in a struct of its own, hung here.
+struct secfs {
+  uint dev;                   // device no, index in mounts[]
+  uint bsize;                 // block size, from the super block
+  int syncwrite;              // write file data at once (secfs -o sync)
+  int fscompress;             // file data is compressed in clusters
+  int keyed;                  // the image is encrypted
+  struct superblock *super;   // the super block (fs.c)
+  struct disk *disk;          // virtio_disk.c
+  struct bcache *bcache;      // bio.c
+  struct log *log;            // log.c
+  struct fsstate *fs;         // fs.c
+  struct ftable *files;       // file.c
+  struct pcache *pages;       // pcache.c
+  struct file *ofile[NOFILE]; // open files (filecall.c)
+  struct inode *cwd;          // current directory (filecall.c)
+  char *path;                 // of the image file
+};
+
+extern struct secfs *mounts[NMOUNT];
+extern __thread struct secfs *curfs; // the mount the thread works on
+#define DEVFS(dev) (mounts[(dev) & ~CDEV])
+
 // bio.c
 void binit(void);
+void bdone(void);
+struct buf *bget(uint, uint);
 struct buf *bread(uint, uint);
+struct buf *bnew(uint, uint);
 void brelse(struct buf *);
 void bwrite(struct buf *);
 void bpin(struct buf *);
 void bunpin(struct buf *);
+void binval(uint);
+void bforget(uint, uint);
 
 // fs.c
-int readi(struct inode *ip, void *dst, uint off, uint n);
-int writei(struct inode *ip, void *src, uint off, uint n);
+int readi(struct inode *ip, void *dst, uint64 off, uint n);
+int writei(struct inode *ip, void *src, uint64 off, uint n);
 void iinit();
 void init_cwd();
 void ilock(struct inode *ip);
@@ -58,49 +102,145 @@ struct inode *dirlookup(struct inode *dp, char *name, uint *poff);
 void iunlockput(struct inode *ip);
 void iupdate(struct inode *ip);
 void itrunc(struct inode *ip);
+struct inode *idetach(struct inode *ip);
 struct inode *ialloc(uint dev, short type);
 int dirlink(struct inode *dp, char *name, uint inum);
-void fsinit(int dev);
+uint writeifit(struct inode *ip, uint64 off, uint n, int nblks, int *cost);
+int delaywritei(struct inode *ip, void *src, uint64 off, uint n);
+void iflush(struct inode *ip);
+void fsinit(int dev, int datamode);
+void fsdone(void);
+int ireadonly(struct inode *ip);
+int snapcreate(char *name);
+int snapdelete(char *name);
+int iclone(struct inode *ip, struct inode *np);
+
+// aes.c
+#define XTSKEYLEN 32 // key bytes: the data key, then the tweak key
+#define AES_PORTABLE 0
+#define AES_NI 1
+#define AES_VAES 2
+#define AES_VAES512 3
+extern int aesimpl;
+extern int xtskeyed;
+void xts_setkey(const uchar *key);
+int xts_loadkey(const char *path, uchar *key);
+void xts_encrypt(uint64 unit, const char *src, char *dst, int n);
+void xts_decrypt(uint64 unit, const char *src, char *dst, int n);
+
+// lz4.c
+int lz4_compress(const char *src, int n, char *dst, int cap);
+int lz4_decompress(const char *src, int n, char *dst, int cap);
+
+// pcache.c
+struct page;
+void pcacheinit(void);
+void pcachedone(void);
+struct page *plookup(struct inode *ip, uint lbn);
+struct page *pget(struct inode *ip, uint lbn, int *isnew);
+void pfree(struct page *pg);
+void pdrop(struct inode *ip);
+int ppages(struct inode *ip, struct page ***ppgs);
+int pfull(void);
+void pkick(void);
+void pflushall(void);
 
 // log.c
-void initlog(int, struct superblock *);
+void initlog(int, struct superblock *, int);
+void logdone(void);
 void log_write(struct buf *);
+int log_ordered(void);
+void log_free(uint b);
+int log_freed(uint b);
 void begin_op(void);
+void begin_opn(int nblks);
+void begin_opx(void);
+void log_restart(int nblks);
+void begin_batch(void);
+void end_batch(void);
 void end_op(void);
 
 void fileinit(void);
+void filedone(void);
 struct file *filedup(struct file *f);
 int fileread(struct file *f, void *addr, int n);
 int filewrite(struct file *f, void *addr, int n);
+int filepread(struct file *f, void *addr, int n, int64 off);
+int filepwrite(struct file *f, void *addr, int n, int64 off);
+int filereadv(struct file *f, struct iovec *iov, int iovcnt, int64 off);
+int filewritev(struct file *f, struct iovec *iov, int iovcnt, int64 off);
 void fileclose(struct file *f);
+int filesync(struct file *f);
 int filestat(struct file *f, void *addr);
 struct file *filealloc(void);
 
 // disk
-void virtio_disk_init(void);
+void virtio_disk_init(FILE *img);
+void virtio_disk_done(void);
 void virtio_disk_rw(struct buf *b, int write);
+void virtio_disk_crypt(uint start);
+
+// stats.c
+void statget(uint64 *v);
+void statreset(void);
+uint64 statnsec(void);
+void histget(int h, uint64 *b);
+uint64 histpct(const uint64 *b, double q);
+void evlog(int on);
+void evdump(FILE *f);
+
+// mount.c
+struct secfs;
+struct secfs *secfs_mount(const char *path, int datamode, int sync,
+                          const char *keyfile);
+int secfs_unmount(struct secfs *fs);
+void secfs_use(struct secfs *fs);
+
+// trace.c
+int traceopen(const char *path);
+void traceclose(void);
+int tracemount(void);
+void traceunmount(void);
+uint64 tracestart(void);
+void traceop(uint64 t, int op, int fd, const char *path, const char *path2,
+             int64 off, int64 len, int64 ret);
 
 // filecall.c
 int ffdup(int fd);
 int ffread(int fd, void *p, int n);
 int ffwrite(int fd, void *p, int n);
+int ffpread(int fd, void *p, int n, int64 off);
+int ffpwrite(int fd, void *p, int n, int64 off);
+int ffreadv(int fd, struct iovec *iov, int iovcnt);
+int ffwritev(int fd, struct iovec *iov, int iovcnt);
 int ffclose(int fd);
+int ffsync(int fd);
 int ffstat(int fd, struct stat *st);
 int fflink(const char *pold, const char *pnew);
+int ffclone(const char *pold, const char *pnew);
 int ffunlink(const char *ppath);
 int ffopen(const char *ppath, int omode);
 int ffmkdir(const char *ppath);
 int ffmknod(const char *ppath, int major, int minor);
 int ffchdir(const char *ppath);
-int ffseek(int fd, int offset, int base);
+int64 ffseek(int fd, int64 offset, int64 base);
 
 // interface
 int ls(char *path);
-int mkdir(char *args[], int arg_cnt);
+int ustat(const char *n, struct stat *st);
+int fmkdir(char *args[], int arg_cnt);
 int rm(char *args[], int arg_cnt);
 int touch(char *args[], int arg_cnt);
 int cat(char *args[], int arg_cnt);
 int fimport(char *args[], int arg_cnt);
+int fexport(char *args[], int arg_cnt);
 int testseek(char *args[], int arg_cnt);
+int snap(char *args[], int arg_cnt);
+int fclone(char *args[], int arg_cnt);
+int stats(char *args[], int arg_cnt);
+
+// interface/host.c
+int hostcreate(const char *path);
+int hostmkdir(const char *path);
 
 #endif
@@ -1,35 +1,55 @@
 #include "file.h"
 #include "spinlock.h"
 
-// Global file table
-struct {
+// get min var
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// File table, one per mount
+struct ftable {
   struct spinlock lock;
   struct file file[NFILE];
-} ftable;
+};
 
 // Init file table
-void fileinit(void) { init_spinlock(&ftable.lock, "ftable"); }
+void fileinit(void) {
+  struct ftable *ft;
+
+  if ((ft = curfs->files = calloc(1, sizeof(struct ftable))) == 0) {
+    printf("panic: fileinit: out of memory");
+    exit(1);
+  }
+  init_spinlock(&ft->lock, "ftable");
+}
+
+// Free the file table, once no file is open.
+void filedone(void) {
+  free(curfs->files);
+  curfs->files = 0;
+}
 
 // Allocate a file structure.
 struct file *filealloc(void) {
+  struct ftable *ft = curfs->files;
   struct file *f;
-  acquire_spinlock(&ftable.lock);
+  acquire_spinlock(&ft->lock);
 
-  for (f = ftable.file; f < ftable.file + NFILE; f++) {
+  for (f = ft->file; f < ft->file + NFILE; f++) {
     if (f->ref == 0) {
       f->ref = 1;
-      release_spinlock(&ftable.lock);
+      release_spinlock(&ft->lock);
       return f;
     }
   }
 
-  release_spinlock(&ftable.lock);
+  release_spinlock(&ft->lock);
   return 0;
 }
 
 // Increase ref count for file f.
 struct file *filedup(struct file *f) {
-  acquire_spinlock(&ftable.lock);
+  struct ftable *ft = curfs->files;
+
+  acquire_spinlock(&ft->lock);
 
   if (f->ref < 1) {
     printf("panic: filedup");
@@ -38,14 +58,15 @@ struct file *filedup(struct file *f) {
 
   f->ref++;
 
-  release_spinlock(&ftable.lock);
+  release_spinlock(&ft->lock);
   return f;
 }
 
 // Close file f.  (Decrease ref count, close when reaches 0.)
 void fileclose(struct file *f) {
+  struct ftable *ft = curfs->files;
   struct file ff;
-  acquire_spinlock(&ftable.lock);
+  acquire_spinlock(&ft->lock);
 
   if (f->ref < 1) {
     printf("panic: fileclose");
@@ -54,17 +75,19 @@ void fileclose(struct file *f) {
 
   (f->ref)--;
   if (f->ref > 0) {
-    release_spinlock(&ftable.lock);
+    release_spinlock(&ft->lock);
     return;
   }
 
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
-  release_spinlock(&ftable.lock);
+  release_spinlock(&ft->lock);
 
   if (ff.type == FD_PIPE) { // TODO
   } else if (ff.type == FD_INODE || ff.type == FD_DEVICE) {
+    if (ff.type == FD_INODE)
+      iflush(ff.ip); // write back cached pages
     begin_op();
     iput(ff.ip);
     end_op();
@@ -74,6 +97,15 @@ void fileclose(struct file *f) {
   }
 }
 
+// Write back file f's cached pages.
+int filesync(struct file *f) {
+  if (f->type != FD_INODE)
+    return -1;
+
+  iflush(f->ip);
+  return 0;
+}
+
 // Get metadata about file f.
 // addr is a address, pointing to a struct stat.
 int filestat(struct file *f, void *addr) {
@@ -92,7 +124,28 @@ int filestat(struct file *f, void *addr) {
 
 // Read from file f to addr
 int fileread(struct file *f, void *addr, int n) {
-  int r = 0;
+  struct iovec iov = {addr, n};
+
+  return filereadv(f, &iov, 1, -1);
+}
+
+// Read from file f at offset off, leaving f->off untouched.
+int filepread(struct file *f, void *addr, int n, int64 off) {
+  struct iovec iov = {addr, n};
+
+  if (off < 0)
+    return -1;
+
+  return filereadv(f, &iov, 1, off);
+}
+
+// Scatter-read from file f into iov[0..iovcnt-1] under a single ilock().
+// If off is -1, read at f->off and advance it;
+// otherwise read at off and leave f->off untouched.
+// Returns the number of bytes read.
+int filereadv(struct file *f, struct iovec *iov, int iovcnt, int64 off) {
+  int i, r, tot = 0;
+  uint64 pos;
 
   if (f->readable == 0)
     return -1;
@@ -101,55 +154,150 @@ int fileread(struct file *f, void *addr, int n) {
   } else if (f->type == FD_DEVICE) { // TODO
   } else if (f->type == FD_INODE) {
     ilock(f->ip);
-    if ((r = readi(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
+    pos = off < 0 ? f->off : off;
+    for (i = 0; i < iovcnt; i++) {
+      if ((r = readi(f->ip, iov[i].iov_base, pos, iov[i].iov_len)) < 0) {
+        tot = -1;
+        break;
+      }
+      pos += r;
+      tot += r;
+      if (r < iov[i].iov_len) // end of file
+        break;
+    }
+    if (off < 0 && tot > 0)
+      f->off = pos;
     iunlock(f->ip);
   } else {
     printf("panic: fileread");
     exit(1);
   }
 
-  return r;
+  return tot;
 }
 
 // Write to file f.
 // addr is a user virtual address.
 int filewrite(struct file *f, void *addr, int n) {
-  int r, ret = 0;
+  struct iovec iov = {addr, n};
+
+  return filewritev(f, &iov, 1, -1);
+}
+
+// Write to file f at offset off, leaving f->off untouched.
+int filepwrite(struct file *f, void *addr, int n, int64 off) {
+  struct iovec iov = {addr, n};
+
+  if (off < 0)
+    return -1;
+
+  return filewritev(f, &iov, 1, off);
+}
+
+// Gather-write iov[0..iovcnt-1] to the page cache of regular file f.
+// No transaction is needed: blocks are allocated at write back.
+static int filecachev(struct file *f, struct iovec *iov, int iovcnt,
+                      int64 off) {
+  int i, r, tot = 0;
+  uint64 pos;
+
+  if (pfull()) {
+    // make room from our own file first, then wake the flusher
+    iflush(f->ip);
+    pkick();
+  }
+
+  ilock(f->ip);
+  pos = off < 0 ? f->off : off;
+  for (i = 0; i < iovcnt; i++) {
+    if ((r = delaywritei(f->ip, iov[i].iov_base, pos, iov[i].iov_len)) < 0)
+      break;
+    pos += r;
+    tot += r;
+  }
+  if (off < 0)
+    f->off = pos;
+  iunlock(f->ip);
+
+  return i == iovcnt ? tot : -1;
+}
+
+// Gather-write iov[0..iovcnt-1] to file f.
+// If off is -1, write at f->off and advance it;
+// otherwise write at off and leave f->off untouched.
+// Returns the number of bytes requested, or -1 on error.
+int filewritev(struct file *f, struct iovec *iov, int iovcnt, int64 off) {
+  int i, n, m, r, ret = 0;
+  uint64 pos;
+  uint skip;
 
   if (f->writable == 0)
     return -1;
 
+  for (i = 0, n = 0; i < iovcnt; i++)
+    n += iov[i].iov_len;
+
   if (f->type == FD_PIPE) {          // TODO
   } else if (f->type == FD_DEVICE) { // TODO
+  } else if (f->type == FD_INODE && f->ip->type == T_FILE &&
+             (!curfs->syncwrite || curfs->fscompress)) {
+    // compressed clusters are only written from the page cache
+    ret = filecachev(f, iov, iovcnt, off);
+    if (curfs->syncwrite)
+      iflush(f->ip);
   } else if (f->type == FD_INODE) {
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLKS - 1 - 1 - 2) / 2) * BSIZE;
-    int i = 0;
-    while (i < n) {
-      int n1 = n - i;
-      if (n1 > max)
-        n1 = max;
-
-      begin_op();
+    // Size each transaction by the blocks the write will really dirty
+    // (data, indirect, bitmap and inode blocks), so one commit carries
+    // as much data as the log can hold instead of a few blocks.
+    // Each transaction is packed full, even across iov boundaries.
+    int done = 0, max, cost;
+    i = 0;    // current iov
+    skip = 0; // bytes of iov[i] already written
+    while (done < n) {
+      int n1 = 0;
+
       ilock(f->ip);
-      if ((r = writei(f->ip, (void *)((uint64)addr + i), f->off, n1)) > 0)
-        f->off += r;
+      pos = off < 0 ? f->off : off + done;
+      max = writeifit(f->ip, pos, n - done, MAXLOGOP, &cost);
+      iunlock(f->ip);
+      if (max == 0)
+        break;
+
+      begin_opn(cost);
+      ilock(f->ip);
+      pos = off < 0 ? f->off : off + done;
+      // the inode may have changed while it was unlocked
+      max = writeifit(f->ip, pos, max, cost, &cost);
+      r = m = 0;
+      while (n1 < max && i < iovcnt) {
+        m = min(iov[i].iov_len - skip, max - n1);
+        if (m > 0) {
+          r = writei(f->ip, (char *)iov[i].iov_base + skip, pos, m);
+          if (r > 0) {
+            pos += r;
+            n1 += r;
+            skip += r;
+          }
+          if (r != m)
+            break;
+        }
+        if (skip == iov[i].iov_len) {
+          i++;
+          skip = 0;
+        }
+      }
+      if (off < 0)
+        f->off = pos;
       iunlock(f->ip);
       end_op();
 
-      if (r != n1) {
+      done += n1;
+      if (r != m) {
         // error from writei
         break;
       }
-      i += r;
     }
-    ret = (i == n ? n : -1);
+    ret = (done == n ? n : -1);
   } else {
     printf("panic: filewrite");
     exit(1);
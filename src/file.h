@@ -18,7 +18,7 @@ struct file {
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
-  uint off;          // FD_INODE
+  uint64 off;        // FD_INODE
   short major;       // FD_DEVICE
 };
 
@@ -26,6 +26,7 @@ struct file {
 struct inode {
   uint dev;  // dev no
   uint inum; // inode no
+  int snap;  // 0 for the live file system, else snapshot slot + 1
   int ref;   // reference counter
   struct sleeplock lock;
   // protect everything below the lock(valid to addrs)
@@ -35,8 +36,12 @@ struct inode {
   short nlink;             // numbers of links to the disk inode
   short major;             // major device no
   short minor;             // minor device no
-  uint size;               // file size(bytes)
-  uint addrs[NDIRECT + 1 + 1]; // data block addresses
+  uint64 size;             // file size(bytes)
+  uint64 dsize;            // file size on disk, without cached pages
+  uint addrs[NADDRS];      // data block addresses
+
+  struct page *pages; // cached pages not yet written back
+  int npage;          // num of cached pages
 };
 
 struct stat {
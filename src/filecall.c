@@ -1,30 +1,30 @@
 #include "defs.h"
 #include "fcntl.h"
 #include "file.h"
-
-extern struct file *ofile[NOFILE]; // Open files
-extern struct inode *cwd;
+#include "trace.h"
+#include <limits.h>
 
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
+// Threads of a mount may open files at once, so a free slot is taken
+// with a compare-and-swap.
 static int fdalloc(struct file *f) {
+  struct file **ofile = curfs->ofile;
   int fd;
 
   for (fd = 0; fd < NOFILE; fd++) {
-    if (ofile[fd] == 0) {
-      ofile[fd] = f;
+    if (ofile[fd] == 0 && __sync_bool_compare_and_swap(&ofile[fd], 0, f))
       return fd;
-    }
   }
 
   return -1;
 }
 
 // copy same struct file, but with different fd
-int ffdup(int fd) {
+static int dodup(int fd) {
   struct file *f;
 
-  if (fd < 0 || fd >= NOFILE || (f = ofile[fd]) == 0)
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0)
     return -1;
 
   if ((fd = fdalloc(f)) < 0)
@@ -34,47 +34,117 @@ int ffdup(int fd) {
   return fd;
 }
 
-int ffread(int fd, void *p, int n) {
+static int doread(int fd, void *p, int n) {
   struct file *f;
 
-  if (fd < 0 || fd >= NOFILE || (f = ofile[fd]) == 0 || n < 0)
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0 || n < 0)
     return -1;
 
   return fileread(f, p, n);
 }
 
-int ffwrite(int fd, void *p, int n) {
+static int dowrite(int fd, void *p, int n) {
   struct file *f;
 
-  if (fd < 0 || fd >= NOFILE || (f = ofile[fd]) == 0 || n < 0)
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0 || n < 0)
     return -1;
 
   return filewrite(f, p, n);
 }
 
-int ffclose(int fd) {
+// Read n bytes at offset off without moving the file offset,
+// so several threads can share one fd.
+static int dopread(int fd, void *p, int n, int64 off) {
   struct file *f;
 
-  if (fd < 0 || fd >= NOFILE || (f = ofile[fd]) == 0)
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0 || n < 0 || off < 0)
+    return -1;
+
+  return filepread(f, p, n, off);
+}
+
+// Write n bytes at offset off without moving the file offset.
+static int dopwrite(int fd, void *p, int n, int64 off) {
+  struct file *f;
+
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0 || n < 0 || off < 0)
+    return -1;
+
+  return filepwrite(f, p, n, off);
+}
+
+// Check that the iovcnt buffers in iov add up to at most INT_MAX bytes.
+static int iovcheck(struct iovec *iov, int iovcnt) {
+  int i;
+  size_t n = 0;
+
+  if (iovcnt < 0 || (iovcnt > 0 && iov == 0))
     return -1;
 
-  ofile[fd] = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > INT_MAX - n)
+      return -1;
+    n += iov[i].iov_len;
+  }
+
+  return 0;
+}
+
+static int doreadv(int fd, struct iovec *iov, int iovcnt) {
+  struct file *f;
+
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0 ||
+      iovcheck(iov, iovcnt) < 0)
+    return -1;
+
+  return filereadv(f, iov, iovcnt, -1);
+}
+
+static int dowritev(int fd, struct iovec *iov, int iovcnt) {
+  struct file *f;
+
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0 ||
+      iovcheck(iov, iovcnt) < 0)
+    return -1;
+
+  return filewritev(f, iov, iovcnt, -1);
+}
+
+static int doclose(int fd) {
+  struct file *f;
+
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0)
+    return -1;
+
+  // another thread may be closing fd too: only one takes f
+  if (!__sync_bool_compare_and_swap(&curfs->ofile[fd], f, 0))
+    return -1;
   fileclose(f);
 
   return 0;
 }
 
-int ffstat(int fd, struct stat *st) {
+// Write back fd's cached data, so it survives a crash.
+static int dosync(int fd) {
+  struct file *f;
+
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0)
+    return -1;
+
+  return filesync(f);
+}
+
+static int dostat(int fd, struct stat *st) {
   struct file *f;
 
-  if (fd < 0 || fd >= NOFILE || (f = ofile[fd]) == 0)
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0)
     return -1;
 
   return filestat(f, st);
 }
 
 // Create the path new as a link to the same inode as old.
-int fflink(const char *pold, const char *pnew) {
+static int dolink(const char *pold, const char *pnew) {
   char name[DIRSIZ], new[MAXPATH], old[MAXPATH];
   struct inode *dp, *ip;
 
@@ -88,7 +158,7 @@ int fflink(const char *pold, const char *pnew) {
   }
 
   ilock(ip);
-  if (ip->type == T_DIR) {
+  if (ip->type == T_DIR || ireadonly(ip)) {
     iunlockput(ip);
     end_op();
     return -1;
@@ -101,7 +171,7 @@ int fflink(const char *pold, const char *pnew) {
   if ((dp = nameiparent(new, name)) == 0)
     goto bad;
   ilock(dp);
-  if (dp->dev != ip->dev || dirlink(dp, name, ip->inum) < 0) {
+  if (dp->dev != ip->dev || ireadonly(dp) || dirlink(dp, name, ip->inum) < 0) {
     iunlockput(dp);
     goto bad;
   }
@@ -138,7 +208,7 @@ static int isdirempty(struct inode *dp) {
   return 1;
 }
 
-int ffunlink(const char *ppath) {
+static int dounlink(const char *ppath) {
   struct inode *ip, *dp;
   struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
@@ -154,14 +224,19 @@ int ffunlink(const char *ppath) {
 
   ilock(dp);
 
-  // Cannot unlink "." or "..".
-  if (namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
+  // Cannot unlink "." or "..", or in a snapshot.
+  if (namecmp(name, ".") == 0 || namecmp(name, "..") == 0 || ireadonly(dp))
     goto bad;
 
   if ((ip = dirlookup(dp, name, &off)) == 0)
     goto bad;
   ilock(ip);
 
+  if (ireadonly(ip)) { // /.snap
+    iunlockput(ip);
+    goto bad;
+  }
+
   if (ip->nlink < 1) {
     printf("panic: unlink: nlink < 1");
     exit(1);
@@ -216,6 +291,11 @@ static struct inode *create(char *path, short type, short major, short minor) {
     return 0;
   }
 
+  if (ireadonly(dp)) {
+    iunlockput(dp);
+    return 0;
+  }
+
   if ((ip = ialloc(dp->dev, type)) == 0) {
     printf("panic: create: ialloc");
     exit(1);
@@ -247,11 +327,11 @@ static struct inode *create(char *path, short type, short major, short minor) {
   return ip;
 }
 
-int ffopen(const char *ppath, int omode) {
+static int doopen(const char *ppath, int omode) {
   char path[MAXPATH];
   int fd;
   struct file *f;
-  struct inode *ip;
+  struct inode *ip, *tip = 0;
   int n;
 
   strncpy(path, ppath, MAXPATH);
@@ -277,7 +357,8 @@ int ffopen(const char *ppath, int omode) {
     }
   }
 
-  if (ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)) {
+  if ((ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)) ||
+      (omode != O_RDONLY && ireadonly(ip))) {
     iunlockput(ip);
     end_op();
     return -1;
@@ -303,16 +384,92 @@ int ffopen(const char *ppath, int omode) {
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
 
   if ((omode & O_TRUNC) && ip->type == T_FILE) {
-    itrunc(ip);
+    tip = idetach(ip);
   }
 
   iunlock(ip);
   end_op();
 
+  // free the old blocks outside ip->lock
+  if (tip) {
+    begin_op();
+    iput(tip);
+    end_op();
+  }
+
   return fd;
 }
 
-int ffmkdir(const char *ppath) {
+// Create the path new as a copy of the file old that shares its
+// blocks until one of them writes them, in constant time. If it
+// cannot, a new that it created is removed again.
+static int doclone(const char *pold, const char *pnew) {
+  char new[MAXPATH], old[MAXPATH];
+  struct inode *ip, *np;
+  int r = -1, made;
+
+  strncpy(old, pold, MAXPATH);
+  strncpy(new, pnew, MAXPATH);
+
+  begin_op();
+  if ((ip = namei(old)) == 0) {
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  if (iclone(ip, 0) < 0) {
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+  iunlock(ip);
+  if ((np = namei(new)) != 0)
+    iput(np);
+  made = np == 0;
+  if ((np = create(new, T_FILE, 0, 0)) == 0) {
+    iput(ip);
+    end_op();
+    return -1;
+  }
+  iunlock(np);
+  end_op();
+
+  // old's cached data must be in its blocks; iflush() leaves those of
+  // a file unlinked meanwhile, which then cannot be cloned.
+  for (;;) {
+    iflush(ip);
+    begin_op();
+    // two clones the other way round lock the same inodes
+    if (np == ip || ip->inum < np->inum) {
+      ilock(ip);
+      if (np != ip)
+        ilock(np);
+    } else {
+      ilock(np);
+      ilock(ip);
+    }
+    if (ip->npage == 0 || ip->nlink == 0)
+      break;
+    if (np != ip)
+      iunlock(np);
+    iunlock(ip);
+    end_op();
+  }
+  if (ip->nlink > 0)
+    r = iclone(ip, np);
+  if (np != ip)
+    iunlock(np);
+  iunlock(ip);
+  iput(np);
+  iput(ip);
+  end_op();
+
+  if (r < 0 && made)
+    dounlink(new);
+  return r;
+}
+
+static int domkdir(const char *ppath) {
   char path[MAXPATH];
   struct inode *ip;
 
@@ -328,7 +485,7 @@ int ffmkdir(const char *ppath) {
   return 0;
 }
 
-int ffmknod(const char *ppath, int major, int minor) {
+static int domknod(const char *ppath, int major, int minor) {
   struct inode *ip;
   char path[MAXPATH];
 
@@ -345,12 +502,12 @@ int ffmknod(const char *ppath, int major, int minor) {
   return 0;
 }
 
-int ffseek(int fd, int offset, int base) {
+static int64 doseek(int fd, int64 offset, int64 base) {
   struct file *f;
-  if (fd < 0 || fd >= NOFILE || (f = ofile[fd]) == 0)
+  if (fd < 0 || fd >= NOFILE || (f = curfs->ofile[fd]) == 0)
     return -1;
 
-  if (base < 0 || offset + base < 0 || offset + base > f->ip->size)
+  if (base < 0 || offset + base < 0 || offset + base > (int64)f->ip->size)
     return -1;
 
   f->off = offset + base;
@@ -358,7 +515,7 @@ int ffseek(int fd, int offset, int base) {
   return offset + base;
 }
 
-int ffchdir(const char *ppath) {
+static int dochdir(const char *ppath) {
   char path[MAXPATH];
   struct inode *ip;
 
@@ -376,8 +533,264 @@ int ffchdir(const char *ppath) {
     return -1;
   }
   iunlock(ip);
-  iput(cwd);
+  iput(curfs->cwd);
   end_op();
-  cwd = ip;
+  curfs->cwd = ip;
   return 0;
 }
+
+/* The calls, recorded when tracing (trace.c) */
+// The calls work on the calling thread's mount (secfs_use()). A thread
+// that never chose one gets the first image still mounted; the calls
+// fail if there is none.
+static int nomount(void) {
+  if (curfs == 0)
+    secfs_use(0);
+  return curfs == 0;
+}
+
+// Total bytes of the iovcnt buffers in iov, for the trace.
+static int64 iovlen(struct iovec *iov, int iovcnt) {
+  int64 n = 0;
+  int i;
+
+  for (i = 0; iov && i < iovcnt; i++)
+    n += iov[i].iov_len;
+  return n;
+}
+
+int ffdup(int fd) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dodup(fd);
+
+  traceop(t, TR_DUP, fd, 0, 0, -1, -1, r);
+  return r;
+}
+
+int ffread(int fd, void *p, int n) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = doread(fd, p, n);
+
+  traceop(t, TR_READ, fd, 0, 0, -1, n, r);
+  return r;
+}
+
+int ffwrite(int fd, void *p, int n) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dowrite(fd, p, n);
+
+  traceop(t, TR_WRITE, fd, 0, 0, -1, n, r);
+  return r;
+}
+
+int ffpread(int fd, void *p, int n, int64 off) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dopread(fd, p, n, off);
+
+  traceop(t, TR_PREAD, fd, 0, 0, off, n, r);
+  return r;
+}
+
+int ffpwrite(int fd, void *p, int n, int64 off) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dopwrite(fd, p, n, off);
+
+  traceop(t, TR_PWRITE, fd, 0, 0, off, n, r);
+  return r;
+}
+
+int ffreadv(int fd, struct iovec *iov, int iovcnt) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = doreadv(fd, iov, iovcnt);
+
+  if (t)
+    traceop(t, TR_READV, fd, 0, 0, -1, iovlen(iov, iovcnt), r);
+  return r;
+}
+
+int ffwritev(int fd, struct iovec *iov, int iovcnt) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dowritev(fd, iov, iovcnt);
+
+  if (t)
+    traceop(t, TR_WRITEV, fd, 0, 0, -1, iovlen(iov, iovcnt), r);
+  return r;
+}
+
+int ffclose(int fd) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = doclose(fd);
+
+  traceop(t, TR_CLOSE, fd, 0, 0, -1, -1, r);
+  return r;
+}
+
+int ffsync(int fd) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dosync(fd);
+
+  traceop(t, TR_SYNC, fd, 0, 0, -1, -1, r);
+  return r;
+}
+
+int ffstat(int fd, struct stat *st) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dostat(fd, st);
+
+  traceop(t, TR_STAT, fd, 0, 0, -1, -1, r);
+  return r;
+}
+
+int fflink(const char *pold, const char *pnew) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dolink(pold, pnew);
+
+  traceop(t, TR_LINK, -1, pold, pnew, -1, -1, r);
+  return r;
+}
+
+int ffunlink(const char *ppath) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dounlink(ppath);
+
+  traceop(t, TR_UNLINK, -1, ppath, 0, -1, -1, r);
+  return r;
+}
+
+int ffopen(const char *ppath, int omode) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = doopen(ppath, omode);
+
+  traceop(t, TR_OPEN, -1, ppath, 0, omode, -1, r);
+  return r;
+}
+
+int ffclone(const char *pold, const char *pnew) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = doclone(pold, pnew);
+
+  traceop(t, TR_CLONE, -1, pold, pnew, -1, -1, r);
+  return r;
+}
+
+int ffmkdir(const char *ppath) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = domkdir(ppath);
+
+  traceop(t, TR_MKDIR, -1, ppath, 0, -1, -1, r);
+  return r;
+}
+
+int ffmknod(const char *ppath, int major, int minor) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = domknod(ppath, major, minor);
+
+  traceop(t, TR_MKNOD, -1, ppath, 0, major, minor, r);
+  return r;
+}
+
+int64 ffseek(int fd, int64 offset, int64 base) {
+  uint64 t;
+  int64 r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = doseek(fd, offset, base);
+
+  traceop(t, TR_SEEK, fd, 0, 0, offset + base, -1, r);
+  return r;
+}
+
+int ffchdir(const char *ppath) {
+  uint64 t;
+  int r;
+
+  if (nomount())
+    return -1;
+  t = tracestart();
+  r = dochdir(ppath);
+
+  traceop(t, TR_CHDIR, -1, ppath, 0, -1, -1, r);
+  return r;
+}
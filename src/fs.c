@@ -2,75 +2,216 @@
 #include "buf.h"
 #include "defs.h"
 #include "file.h"
+#include "page.h"
 #include "sleeplock.h"
 #include "spinlock.h"
+#include "stats.h"
 #include <stdlib.h>
+#include <time.h>
 
 // get min var
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
-static uint bmap(struct inode *ip, uint bn);
-// there should be one superblock per disk device,
-// but here we run with only one device
-struct superblock sb;
-struct inode *cwd;
+// What bmapown() moves off shared blocks.
+#define OWN_PATH 0 // the indirect blocks above the block
+#define OWN_NEW 1  // and the block, which the caller writes all of
+#define OWN_KEEP 2 // and the block, with its content
 
-struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
-} itable;
+static uint bmap(struct inode *ip, uint bn);
+static uint bmapget(struct inode *ip, uint bn);
+static struct inode *iget(uint dev, uint inum, int snap);
+static void orphan_init(uint dev);
+static void bmapput(struct inode *ip, uint bn, uint addr);
+static uint bmapown(struct inode *ip, uint bn, int how);
+static struct buf *bmapread(struct inode *ip, uint bn, uint *boff);
+static void ddwrite(struct inode *ip, uint bn, char *data);
+static void snapsave(uint dev, struct buf *bp, uint i);
+static int snappin(uint dev, uint i, uchar *pin);
+static int snapshared(uint dev, uint b);
+static void snapinit(uint dev);
+// The file system of a mount, one super block per device.
+struct fsstate {
+  struct superblock sb;
+
+  // Inode geometry, set by fsinit() from the superblock flags.
+  uint ndirect;   // direct blocks in an inode
+  int nlevel;     // levels of indirect blocks
+  uint64 maxfile; // max file size in blocks
+  uint nclblk;    // blocks in a cluster (FS_COMPRESS)
+  int fsdedup;    // file blocks are shared by content (FS_DEDUP)
+  int fssnap;     // snapshots can be taken (FS_SNAP)
+  int fsref;      // file blocks have refcounts
+
+  // The snapshot table; nsnap counts the SNAP_LIVE ones. Only changed
+  // by an exclusive operation (begin_opx()), so it stays the same
+  // during any other.
+  struct snapent snaps[NSNAP];
+  int nsnap;
+  // serializes snapcreate() and snapdelete()
+  pthread_mutex_t snaplock;
+
+  struct {
+    struct spinlock lock;
+    struct inode inode[NINODE];
+  } itable;
+
+  // the orphan reclaimer
+  pthread_t reclaimer;
+  pthread_mutex_t reclaim_lock;
+  pthread_mutex_t reclaim_mutex;
+  pthread_cond_t reclaim_cond;
+  int reclaim_kicked;
+  int reclaim_stop; // fsdone() is stopping the reclaimer
+
+  uint allochint; // block after the last one ballocrun() allocated
+  uint inodehint; // the last inode ialloc() allocated
+  uint copyhint;  // copy area block after the last one snapalloc() took
+};
+
+// Buffers holding decompressed clusters are cached under dev | CDEV
+// and the first block of the compressed data.
 
 // Read the super block.
 static void readsb(int dev, struct superblock *sb) {
   struct buf *bp;
 
-  bp = bread(dev, 1);
-  memcpy(sb, bp->data, sizeof(*sb));
+  bp = bread(dev, SBBLOCK);
+  memcpy(sb, bp->data + SBOFF % BSIZE, sizeof(*sb));
   brelse(bp);
 }
 
-// Init fs
-void fsinit(int dev) {
-  readsb(dev, &sb);
-  if (sb.magic != FSMAGIC) {
+// Init fs, after iinit().
+// datamode selects how file data is journaled (DATA_JOURNAL or DATA_ORDERED).
+void fsinit(int dev, int datamode) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+
+  readsb(dev, &fs->sb);
+  if (fs->sb.magic != FSMAGIC) {
     printf("panic: invalid file system");
     exit(1);
   }
 
-  initlog(dev, &sb);
-}
+  // blocks so far were read as DEFBSIZE bytes
+  if (fs->sb.bsize != 0 && fs->sb.bsize != BSIZE) {
+    if (fs->sb.bsize < DEFBSIZE || fs->sb.bsize > MAXBSIZE ||
+        (fs->sb.bsize & (fs->sb.bsize - 1)) != 0) {
+      printf("panic: invalid block size");
+      exit(1);
+    }
+    curfs->bsize = fs->sb.bsize;
+    binval(dev);
+  }
+
+  if (fs->sb.flags & FS_64BIT) {
+    fs->ndirect = NDIRECT64;
+    fs->nlevel = 3;
+    fs->maxfile = MAXFILE64;
+  } else {
+    fs->maxfile = min(MAXFILE, 0xFFFFFFFF / BSIZE); // 32-bit file size
+  }
+  fs->maxfile = min(fs->maxfile, 0xFFFFFFFF); // 32-bit block no in a file
 
-void init_cwd() {
-  cwd = namei("/");
-  printf("root block %d\n", cwd->inum);
+  if (fs->sb.flags & FS_COMPRESS) {
+    if (CLUSTER / BSIZE < 2) {
+      printf("panic: block size too big for compression");
+      exit(1);
+    }
+    DEVFS(dev)->fscompress = 1;
+    fs->nclblk = CLUSTER / BSIZE;
+  }
+  fs->fsdedup = (fs->sb.flags & FS_DEDUP) != 0;
+  fs->fssnap = (fs->sb.flags & FS_SNAP) != 0;
+  fs->fsref = (fs->sb.flags & (FS_DEDUP | FS_REFLINK)) != 0;
+
+  if (fs->sb.flags & FS_ENCRYPT) {
+    char check[sizeof(fs->sb.keycheck)];
+    if (!xtskeyed) {
+      printf("panic: encrypted file system, no key");
+      exit(1);
+    }
+    memset(check, 0, sizeof(check));
+    xts_encrypt(KEYCHECK, check, check, sizeof(check));
+    if (memcmp(check, fs->sb.keycheck, sizeof(check)) != 0) {
+      printf("panic: wrong key");
+      exit(1);
+    }
+    virtio_disk_crypt(fs->sb.logstart);
+  }
+
+  initlog(dev, &fs->sb, datamode);
+  if (fs->fssnap)
+    snapinit(dev); // before orphans: they may free blocks snapshots keep
+  orphan_init(dev);
 }
 
+void init_cwd() { curfs->cwd = namei("/"); }
+
 // Blocks Operation
 // Zero a block.
 static void bbzero(int dev, int bno) {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  bp = bnew(dev, bno);
   log_write(bp);
   brelse(bp);
 }
 
-// Allocate a zeroed disk block.
-static uint balloc(uint dev) {
-  int b, bi, m;
+// Allocate a run of up to n contiguous free disk blocks, without
+// zeroing them. Returns the first block and sets *got to the run length.
+// The scan starts where the last allocation left off and skips
+// full bitmap bytes, so filling a big file is not quadratic.
+// A run for file data must not take blocks that the running
+// transaction freed: ordered mode writes them in place before commit.
+// Nor may any run take blocks that a snapshot still sees.
+static uint ballocrun(uint dev, uint n, int data, uint *got) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  uint hint = fs->allochint;
+  uint b, bi, k, m, nb;
   struct buf *bp;
+  uchar *use, *pin = 0;
 
-  bp = 0;
-  for (b = 0; b < sb.size; b += BPB) {
-    bp = bread(dev, BBLOCK(b, sb));
-    for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
+  if (fs->nsnap > 0 && (pin = malloc(BSIZE)) == 0) {
+    printf("panic: balloc: out of memory");
+    exit(1);
+  }
+  if (hint >= fs->sb.size)
+    hint = 0;
+  nb = (fs->sb.size + BPB - 1) / BPB; // num of bitmap blocks
+  // visit the hint's bitmap block twice: from the hint, then wrapped around
+  for (k = 0; k <= nb; k++) {
+    b = ((hint / BPB + k) % nb) * BPB;
+    bp = bread(dev, BBLOCK(b, fs->sb));
+    use = (uchar *)bp->data; // blocks in use
+    if (pin && snappin(dev, b / BPB, pin)) {
+      for (bi = 0; bi < BSIZE; bi++)
+        pin[bi] |= use[bi];
+      use = pin; // or kept by a snapshot
+    }
+    for (bi = k == 0 ? hint % BPB : 0; bi < BPB && b + bi < fs->sb.size; bi++) {
+      if (bi % 8 == 0 && use[bi / 8] == 0xFF) {
+        bi += 7; // all 8 blocks in use
+        continue;
+      }
       m = 1 << (bi % 8);
-      if ((bp->data[bi / 8] & m) == 0) { // Is block free?
-        bp->data[bi / 8] |= m;           // Mark block in use.
+      if ((use[bi / 8] & m) == 0) { // Is block free?
+        if (data && log_freed(b + bi))
+          continue;
+        snapsave(dev, bp, b / BPB);
+        // Mark blocks in use while they stay free, within this bitmap block.
+        for (*got = 0;
+             *got < n && bi + *got < BPB && b + bi + *got < fs->sb.size;
+             (*got)++) {
+          m = 1 << ((bi + *got) % 8);
+          if ((use[(bi + *got) / 8] & m) ||
+              (data && log_freed(b + bi + *got)))
+            break;
+          bp->data[(bi + *got) / 8] |= m;
+        }
         log_write(bp);
         brelse(bp);
-        bbzero(dev, b + bi);
+        free(pin);
+        fs->allochint = b + bi + *got;
+        statadd(ST_BALLOC, *got);
         return b + bi;
       }
     }
@@ -81,46 +222,601 @@ static uint balloc(uint dev) {
   exit(1);
 }
 
-// Free a disk block.
-static void bfree(int dev, uint b) {
+// Allocate a zeroed disk block.
+// A file data block in ordered mode is not zeroed through the log:
+// the caller writes it in place.
+static uint balloc(uint dev, int data) {
+  uint b, got;
+
+  b = ballocrun(dev, 1, data, &got);
+  if (!data || !log_ordered())
+    bbzero(dev, b);
+  return b;
+}
+
+static int blkcmp(const void *a, const void *b) {
+  uint x = *(uint *)a, y = *(uint *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Deduplication */
+// Get the reference count of block b.
+static uint refget(uint dev, uint b) {
+  struct fsstate *fs = DEVFS(dev)->fs;
   struct buf *bp;
-  int bi, m;
+  uint c;
 
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if ((bp->data[bi / 8] & m) == 0) {
-    printf("panic: freeing free block");
-    exit(1);
+  bp = bread(dev, RBLOCK(b, fs->sb));
+  c = (uchar)bp->data[b % BSIZE];
+  brelse(bp);
+  return c;
+}
+
+// Set the reference count of block b.
+// Must be inside a transaction.
+static void refset(uint dev, uint b, uint c) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *bp;
+
+  bp = bread(dev, RBLOCK(b, fs->sb));
+  if ((uchar)bp->data[b % BSIZE] != c) {
+    bp->data[b % BSIZE] = c;
+    log_write(bp);
   }
+  brelse(bp);
+}
+
+// Add a reference to block b, in use: a count of 0 stands for one.
+// Must be inside a transaction.
+static void refinc(uint dev, uint b) {
+  uint c = refget(dev, b);
+
+  if (c < MAXREF)
+    refset(dev, b, c ? c + 1 : 2);
+}
+
+// Drop a reference to each of blocks b[0..n-1] (sorted). Returns the
+// number of them that nothing points at any more, moved to the front
+// of b. A block may be in b more than once.
+// Must be inside a transaction.
+static int ddunref(uint dev, uint *b, int n) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *bp = 0;
+  uchar *c;
+  int i, k;
+
+  for (i = k = 0; i < n; i++) {
+    if (bp == 0 || bp->blkno != RBLOCK(b[i], fs->sb)) {
+      if (bp)
+        brelse(bp);
+      bp = bread(dev, RBLOCK(b[i], fs->sb));
+    }
+    c = (uchar *)bp->data + b[i] % BSIZE;
+    if (*c == MAXREF)
+      continue; // lost count: kept for good
+    if (*c > 0) {
+      (*c)--;
+      log_write(bp);
+      if (*c > 0)
+        continue; // still shared
+    }
+    b[k++] = b[i];
+  }
+  if (bp)
+    brelse(bp);
+  return k;
+}
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static uint64 rotl64(uint64 x, int r) { return x << r | x >> (64 - r); }
+
+// Hash a block, four 64-bit lanes at a time (after xxHash64).
+static uint64 ddhash(const char *p) {
+  const uint64 *w = (const uint64 *)p;
+  uint64 v[4] = {PRIME1 + PRIME2, PRIME2, 0, -PRIME1}, h;
+  int i, j;
+
+  for (i = 0; i < BSIZE / sizeof(uint64); i += 4)
+    for (j = 0; j < 4; j++)
+      v[j] = rotl64(v[j] + w[i + j] * PRIME2, 31) * PRIME1;
+  h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+  for (j = 0; j < 4; j++)
+    h = (h ^ rotl64(v[j] * PRIME2, 31) * PRIME1) * PRIME1 + PRIME2;
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  return h;
+}
+
+// Return a block with content data and hash fp that can take one
+// more reference, or 0 if the index knows none.
+static uint ddlookup(uint dev, uint64 fp, char *data) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *bp, *dp;
+  struct ddent *e;
+  uint i, b, found = 0;
+
+  bp = bread(dev, fs->sb.idxstart + (fp >> 32) % fs->sb.nidx);
+  e = (struct ddent *)bp->data;
+  for (i = 0; i < DDPB && found == 0; i++) {
+    b = e[i].blkno;
+    if (b == 0 || e[i].tag != (uint)fp || b >= fs->sb.size)
+      continue;
+    // the entry may be stale: the block freed or rewritten since;
+    // and clones may add references, so leave them room
+    if (refget(dev, b) - 1 >= MAXREF - 2)
+      continue;
+    dp = bread(dev, b);
+    if (memcmp(dp->data, data, BSIZE) == 0)
+      found = b;
+    brelse(dp);
+  }
+  brelse(bp);
+  return found;
+}
 
-  bp->data[bi / 8] &= ~m;
+// Record that block b has content hash fp, replacing an entry for the
+// same hash, else taking a free one, else evicting one.
+// Must be inside a transaction.
+static void ddinsert(uint dev, uint64 fp, uint b) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *bp;
+  struct ddent *e;
+  uint i, j = (uint)fp % DDPB;
+
+  bp = bread(dev, fs->sb.idxstart + (fp >> 32) % fs->sb.nidx);
+  e = (struct ddent *)bp->data;
+  for (i = 0; i < DDPB; i++) {
+    if (e[i].blkno != 0 && e[i].tag == (uint)fp) {
+      j = i;
+      break;
+    }
+    if (e[i].blkno == 0)
+      j = i;
+  }
+  e[j].tag = fp;
+  e[j].blkno = b;
   log_write(bp);
   brelse(bp);
 }
+
+// Free disk blocks b[0..n-1]. They are sorted first, so each
+// bitmap block is read and logged once, not once per block.
+// A block with refcounts that is shared only loses a reference.
+// With snapshots, a block may have been freed already: by a truncation
+// that could not zero its pointer in a block a snapshot shares, and
+// went on after a crash.
+static void bfreen(int dev, uint *b, int n) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *bp;
+  int i, bi, m;
+
+  qsort(b, n, sizeof(uint), blkcmp);
+  if (fs->fsref)
+    n = ddunref(dev, b, n);
+  for (i = 0; i < n;) {
+    bp = bread(dev, BBLOCK(b[i], fs->sb));
+    snapsave(dev, bp, b[i] / BPB);
+    do {
+      bi = b[i] % BPB;
+      m = 1 << (bi % 8);
+      if ((bp->data[bi / 8] & m) == 0) {
+        if (snapshared(dev, b[i]))
+          continue;
+        printf("panic: freeing free block");
+        exit(1);
+      }
+      bp->data[bi / 8] &= ~m;
+      log_free(b[i]);
+      statadd(ST_BFREE, 1);
+      if (DEVFS(dev)->fscompress)
+        bforget(dev | CDEV, b[i]); // it may start a compressed cluster
+    } while (++i < n && BBLOCK(b[i], fs->sb) == BBLOCK(b[i - 1], fs->sb));
+    log_write(bp);
+    brelse(bp);
+  }
+}
+
+/* Snapshots */
+// Save table index of the block holding inode inum.
+static uint isave(struct fsstate *fs, uint inum) {
+  return fs->sb.size / BPB + 1 + inum / IPB;
+}
+
+// Return the copy that snapshot slot k sees for save table entry i,
+// or 0 if it sees the live block.
+static uint snapcopy(uint dev, uint i, int k) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *sp;
+  uint c;
+
+  sp = bread(dev, SAVEBLOCK(i, fs->sb));
+  c = ((struct snapsave *)sp->data)[i % SPB].copy[k];
+  brelse(sp);
+  return c;
+}
+
+// Allocate a block of the copy area for a copy n snapshots see.
+// Must be inside a transaction.
+static uint snapalloc(uint dev, uint n) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  uint hint = fs->copyhint;
+  uint j, b;
+
+  for (j = 0; j < fs->sb.ncopy; j++) {
+    b = fs->sb.copystart + (hint + j) % fs->sb.ncopy;
+    if (refget(dev, b) == 0) {
+      refset(dev, b, n);
+      fs->copyhint = b - fs->sb.copystart + 1;
+      return b;
+    }
+  }
+
+  printf("panic: snapalloc: out of copies");
+  exit(1);
+}
+
+// Save bitmap or inode block bp, save table entry i, for the snapshots
+// that see it live, before the caller changes it: all of them share
+// one copy.
+// Must be inside a transaction; the caller holds bp.
+static void snapsave(uint dev, struct buf *bp, uint i) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *sp, *cp;
+  struct snapsave *e;
+  uint c;
+  int k, n = 0;
+
+  if (fs->nsnap == 0)
+    return;
+  sp = bread(dev, SAVEBLOCK(i, fs->sb));
+  e = (struct snapsave *)sp->data + i % SPB;
+  for (k = 0; k < NSNAP; k++)
+    n += fs->snaps[k].state == SNAP_LIVE && e->copy[k] == 0;
+  if (n > 0) {
+    c = snapalloc(dev, n);
+    cp = bnew(dev, c);
+    memmove(cp->data, bp->data, BSIZE);
+    log_write(cp);
+    brelse(cp);
+    for (k = 0; k < NSNAP; k++)
+      if (fs->snaps[k].state == SNAP_LIVE && e->copy[k] == 0)
+        e->copy[k] = c;
+    log_write(sp);
+  }
+  brelse(sp);
+}
+
+// Set in pin the blocks of bitmap block i that snapshots with a copy
+// of it keep; the others see the live bitmap block.
+// Returns 0, with pin unset, if there are none.
+// The caller holds the bitmap block.
+static int snappin(uint dev, uint i, uchar *pin) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *sp, *cp;
+  struct snapsave e;
+  int j, k, n = 0;
+
+  sp = bread(dev, SAVEBLOCK(i, fs->sb));
+  e = ((struct snapsave *)sp->data)[i % SPB];
+  brelse(sp);
+  for (k = 0; k < NSNAP; k++) {
+    if (fs->snaps[k].state != SNAP_LIVE || e.copy[k] == 0)
+      continue;
+    for (j = 0; j < k && e.copy[j] != e.copy[k]; j++)
+      ;
+    if (j < k)
+      continue; // seen already
+    cp = bread(dev, e.copy[k]);
+    for (j = 0; j < BSIZE; j++)
+      pin[j] = (n ? pin[j] : 0) | cp->data[j];
+    brelse(cp);
+    n++;
+  }
+  return n;
+}
+
+// Does a snapshot see block b, which the live file system uses (or
+// used, in a truncation that went on after a crash)? Then it must not
+// be written over.
+static int snapshared(uint dev, uint b) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *sp, *cp;
+  struct snapsave e;
+  int k, set;
+
+  if (fs->nsnap == 0)
+    return 0;
+  sp = bread(dev, SAVEBLOCK(b / BPB, fs->sb));
+  e = ((struct snapsave *)sp->data)[b / BPB % SPB];
+  brelse(sp);
+  for (k = 0; k < NSNAP; k++) {
+    if (fs->snaps[k].state != SNAP_LIVE)
+      continue;
+    if (e.copy[k] == 0)
+      return 1; // its bitmap block is the live one, which has b
+    cp = bread(dev, e.copy[k]);
+    set = cp->data[b % BPB / 8] & (1 << (b % 8));
+    brelse(cp);
+    if (set)
+      return 1;
+  }
+  return 0;
+}
+
+// Write the snapshot table.
+// Must be inside a transaction.
+static void snapwrite(uint dev) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *bp;
+
+  bp = bread(dev, fs->sb.snapstart);
+  memmove(bp->data, fs->snaps, sizeof(fs->snaps));
+  log_write(bp);
+  brelse(bp);
+}
+
+// Return the slot of snapshot name, or -1.
+static int snapfind(char *name) {
+  struct fsstate *fs = curfs->fs;
+  int k;
+
+  for (k = 0; k < NSNAP; k++)
+    if (fs->snaps[k].state == SNAP_LIVE &&
+        namecmp(name, fs->snaps[k].name) == 0)
+      return k;
+  return -1;
+}
+
+// Drop the copies of snapshot slot k, which nothing sees any more,
+// in transactions of bounded size, then free the slot. A crash on the
+// way leaves it SNAP_DELETING, and fsinit() goes on with it.
+static void snapreap(uint dev, int k) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *sp;
+  struct snapsave *e;
+  uint i, c, n = isave(fs, fs->sb.ninodes - 1) + 1;
+  int nw = 0;
+
+  begin_op();
+  for (i = 0; i < n; i++) {
+    sp = bread(dev, SAVEBLOCK(i, fs->sb));
+    e = (struct snapsave *)sp->data + i % SPB;
+    if ((c = e->copy[k]) != 0) {
+      e->copy[k] = 0;
+      log_write(sp);
+      refset(dev, c, refget(dev, c) - 1);
+      nw += 2; // the save table and the refcount block
+    }
+    brelse(sp);
+    if (nw >= MAXOPBLKS - 3) {
+      log_restart(MAXOPBLKS);
+      nw = 0;
+    }
+  }
+  memset(&fs->snaps[k], 0, sizeof(fs->snaps[k]));
+  snapwrite(dev);
+  end_op();
+}
+
+// Load the snapshot table, and finish deleting the snapshots a crash
+// left half deleted.
+static void snapinit(uint dev) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *bp;
+  int k;
+
+  bp = bread(dev, fs->sb.snapstart);
+  memmove(fs->snaps, bp->data, sizeof(fs->snaps));
+  brelse(bp);
+  for (k = 0; k < NSNAP; k++) {
+    if (fs->snaps[k].state == SNAP_LIVE)
+      fs->nsnap++;
+    else if (fs->snaps[k].state == SNAP_DELETING)
+      snapreap(dev, k);
+  }
+}
+
+/* Orphan list */
+// An unlinked inode goes on the orphan list in the superblock when its
+// last reference is dropped, and the reclaimer thread frees its blocks
+// in the background. If we crash first, fsinit() finds it there and
+// finishes the job.
+
+// Add inode inum to the orphan list, if it is not there yet.
+// Returns -1 if the list is full.
+// Must be inside a transaction.
+static int orphan_add(uint dev, uint inum) {
+  struct buf *bp;
+  struct superblock *dsb;
+  int i;
+
+  bp = bread(dev, SBBLOCK);
+  dsb = (struct superblock *)(bp->data + SBOFF % BSIZE);
+  for (i = 0; i < dsb->norphan && dsb->orphan[i] != inum; i++)
+    ;
+  if (i == dsb->norphan) {
+    if (i == NORPHAN) {
+      brelse(bp);
+      return -1;
+    }
+    dsb->orphan[dsb->norphan++] = inum;
+    log_write(bp);
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Remove inode inum from the orphan list, if it is there.
+// Must be inside a transaction.
+static void orphan_del(uint dev, uint inum) {
+  struct buf *bp;
+  struct superblock *dsb;
+  int i;
+
+  bp = bread(dev, SBBLOCK);
+  dsb = (struct superblock *)(bp->data + SBOFF % BSIZE);
+  for (i = 0; i < dsb->norphan; i++) {
+    if (dsb->orphan[i] == inum) {
+      dsb->orphan[i] = dsb->orphan[--dsb->norphan];
+      log_write(bp);
+      break;
+    }
+  }
+  brelse(bp);
+}
+
+// Free the blocks and the inode of orphan inum, unless someone
+// still holds a reference: their iput() kicks the reclaimer again.
+static void reclaim(uint dev, uint inum) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct inode *ip;
+  int busy;
+
+  begin_op();
+  ip = iget(dev, inum, 0);
+  acquire_spinlock(&fs->itable.lock);
+  busy = ip->ref > 1;
+  release_spinlock(&fs->itable.lock);
+  if (!busy) {
+    ilock(ip);
+    if (ip->nlink == 0) {
+      itrunc(ip); // in transactions of bounded size
+      ip->type = 0;
+      iupdate(ip);
+      ip->valid = 0;
+    }
+    orphan_del(dev, inum);
+    iunlock(ip);
+  }
+  iput(ip);
+  end_op();
+}
+
+// Free every inode on the orphan list.
+// Returns with the list empty, except for inodes still in use.
+// Caller must hold reclaim_lock.
+static void reclaimall(uint dev) {
+  struct superblock osb;
+  int i;
+
+  // the log may have held a newer copy of the list
+  readsb(dev, &osb);
+  for (i = 0; i < osb.norphan; i++)
+    reclaim(dev, osb.orphan[i]);
+}
+
+static void orphan_reclaim(uint dev) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+
+  pthread_mutex_lock(&fs->reclaim_lock);
+  reclaimall(dev);
+  pthread_mutex_unlock(&fs->reclaim_lock);
+}
+
+// Wake the reclaimer: there are orphans to free.
+static void orphan_kick(void) {
+  struct fsstate *fs = curfs->fs;
+
+  pthread_mutex_lock(&fs->reclaim_mutex);
+  fs->reclaim_kicked = 1;
+  pthread_cond_signal(&fs->reclaim_cond);
+  pthread_mutex_unlock(&fs->reclaim_mutex);
+}
+
+// Free orphans of mount arg in the background, so that unlinking or
+// closing a big file does not wait for its blocks to be freed.
+static void *reclaimer(void *arg) {
+  struct fsstate *fs;
+  int stop;
+
+  curfs = arg;
+  fs = curfs->fs;
+  for (;;) {
+    pthread_mutex_lock(&fs->reclaim_mutex);
+    while (!fs->reclaim_kicked && !fs->reclaim_stop)
+      pthread_cond_wait(&fs->reclaim_cond, &fs->reclaim_mutex);
+    fs->reclaim_kicked = 0;
+    stop = fs->reclaim_stop;
+    pthread_mutex_unlock(&fs->reclaim_mutex);
+    if (stop)
+      break;
+
+    orphan_reclaim(curfs->dev);
+  }
+
+  return 0;
+}
+
+// Free the orphans left by a crash, then start the reclaimer.
+static void orphan_init(uint dev) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+
+  orphan_reclaim(dev);
+  if (pthread_create(&fs->reclaimer, 0, reclaimer, curfs) != 0) {
+    printf("panic: orphan_init: reclaimer");
+    exit(1);
+  }
+}
+
+// Release the current directory, stop the reclaimer and free all
+// orphans now, then free the file system of the calling thread's
+// mount. No file may be open and no page cached.
+void fsdone(void) {
+  struct fsstate *fs = curfs->fs;
+
+  begin_op();
+  iput(curfs->cwd);
+  end_op();
+  curfs->cwd = 0;
+
+  pthread_mutex_lock(&fs->reclaim_mutex);
+  fs->reclaim_stop = 1;
+  pthread_cond_signal(&fs->reclaim_cond);
+  pthread_mutex_unlock(&fs->reclaim_mutex);
+  pthread_join(fs->reclaimer, 0);
+  orphan_reclaim(curfs->dev);
+
+  pthread_mutex_destroy(&fs->snaplock);
+  pthread_mutex_destroy(&fs->reclaim_lock);
+  pthread_mutex_destroy(&fs->reclaim_mutex);
+  pthread_cond_destroy(&fs->reclaim_cond);
+  free(curfs->fs);
+  curfs->fs = 0;
+  curfs->super = 0;
+}
+
 /* Inode Operation */
-static struct inode *iget(uint dev, uint inum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by giving it type type.
 // Returns an unlocked but allocated and referenced inode.
+// The scan starts after the last inode allocated and wraps around, so
+// creating many files is not quadratic.
 struct inode *ialloc(uint dev, short type) {
-  int inum;
+  struct fsstate *fs = DEVFS(dev)->fs;
+  uint hint = fs->inodehint;
+  int i, inum;
   struct buf *bp;
   struct dinode *dip;
 
   // inum 0 is reserved by convention
-  for (inum = 1; inum < sb.ninodes; inum++) {
-    bp = bread(dev, IBLOCK(inum, sb));
+  for (i = 1; i < fs->sb.ninodes; i++) {
+    inum = (hint + i - 1) % (fs->sb.ninodes - 1) + 1;
+    bp = bread(dev, IBLOCK(inum, fs->sb));
     dip = (struct dinode *)bp->data + inum % IPB;
     // find a free inode
     if (dip->type == 0) {
+      snapsave(dev, bp, isave(fs, inum));
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       // mark it allocated on the disk
       log_write(bp);
       brelse(bp);
-      return iget(dev, inum);
+      fs->inodehint = inum;
+      return iget(dev, inum, 0);
     }
 
     brelse(bp);
@@ -131,12 +827,27 @@ struct inode *ialloc(uint dev, short type) {
 }
 
 // Init itable and inodes
+// Set up the file system of the calling thread's mount, starting with
+// its inode table; fsinit() reads the rest from the super block.
 void iinit() {
+  struct fsstate *fs;
   int i = 0;
 
-  init_spinlock(&itable.lock, "itable");
+  if ((fs = curfs->fs = calloc(1, sizeof(struct fsstate))) == 0) {
+    printf("panic: iinit: out of memory");
+    exit(1);
+  }
+  curfs->super = &fs->sb;
+  fs->ndirect = NDIRECT;
+  fs->nlevel = 2;
+  pthread_mutex_init(&fs->snaplock, 0);
+  pthread_mutex_init(&fs->reclaim_lock, 0);
+  pthread_mutex_init(&fs->reclaim_mutex, 0);
+  pthread_cond_init(&fs->reclaim_cond, 0);
+
+  init_spinlock(&fs->itable.lock, "itable");
   for (i = 0; i < NINODE; i++) {
-    init_sleeplock(&itable.inode[i].lock, "inode");
+    init_sleeplock(&fs->itable.inode[i].lock, "inode");
   }
 }
 
@@ -144,83 +855,321 @@ void iinit() {
 // Must be called after every change to an ip->xxx field that lives on disk.
 // Caller must hold ip->lock.
 void iupdate(struct inode *ip) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
   struct buf *bp;
   struct dinode *dip;
+  struct dinode64 *dip64;
+
+  if (ip->snap) {
+    printf("panic: iupdate: snapshot");
+    exit(1);
+  }
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  bp = bread(ip->dev, IBLOCK(ip->inum, fs->sb));
+  snapsave(ip->dev, bp, isave(fs, ip->inum));
   dip = (struct dinode *)bp->data + ip->inum % IPB;
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
-  dip->size = ip->size;
-
-  memcpy(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  // cached pages are not on disk yet: store dsize
+  if (fs->sb.flags & FS_64BIT) {
+    dip64 = (struct dinode64 *)dip;
+    dip64->size = ip->dsize;
+    memcpy(dip64->addrs, ip->addrs, sizeof(dip64->addrs));
+  } else {
+    dip->size = ip->dsize;
+    memcpy(dip->addrs, ip->addrs, sizeof(dip->addrs));
+  }
   log_write(bp);
   brelse(bp);
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void itrunc(struct inode *ip) {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+#define TRUNCBLKS MAXLOGOP // log blocks for each transaction of a truncation
+#define TRUNCMETA (2 + NLEVEL + SNAPSAVE) // other blocks it may log
+                                          // between checks: inode (and
+                                          // saving it), superblock and a
+                                          // path of indirect blocks
 
-  // discard content in direct blocks
-  for (i = 0; i < NDIRECT; i++) {
-    if (ip->addrs[i]) {
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+// A truncation in progress.
+struct trunc {
+  struct inode *ip;
+  uint *b;    // blocks to free with the running transaction
+  int n;
+  int max;
+  uchar *bm;  // bitmap (and refcount) blocks they are in, one byte each
+  int nbm;    // log blocks freeing in them takes
+  int nind;   // indirect blocks zeroed by the running transaction
+  uint ind[NLEVEL]; // last one zeroed at each level
+  int budget; // log blocks the running transaction may take
+};
+
+// Size of trunc.bm.
+static uint tnmeta(void) {
+  struct fsstate *fs = curfs->fs;
+
+  return fs->sb.size / BPB + 1 + (fs->fsref ? fs->sb.size / BSIZE + 1 : 0);
+}
+
+// Put in k the indexes in trunc.bm of the blocks freeing b logs:
+// its bitmap block and its refcount block, if blocks have refcounts.
+static int tmeta(uint b, uint *k) {
+  struct fsstate *fs = curfs->fs;
+
+  k[0] = b / BPB;
+  if (!fs->fsref)
+    return 1;
+  k[1] = fs->sb.size / BPB + 1 + b / BSIZE;
+  return 2;
+}
+
+// Log blocks that freeing in trunc.bm block k takes: a bitmap block
+// may have to be saved for snapshots first.
+static int tweight(uint k) {
+  struct fsstate *fs = curfs->fs;
+
+  return fs->nsnap > 0 && k <= fs->sb.size / BPB ? 1 + SNAPSAVE : 1;
+}
+
+// Queue block b to be freed with the running transaction.
+static void tqueue(struct trunc *t, uint b) {
+  uint k[2];
+  int j, m;
+
+  if (t->n == t->max) {
+    t->max = t->max ? t->max * 2 : NINDIRECT * 4;
+    if ((t->b = realloc(t->b, t->max * sizeof(uint))) == 0) {
+      printf("panic: itrunc: out of memory");
+      exit(1);
+    }
+  }
+  t->b[t->n++] = b;
+  for (j = 0, m = tmeta(b, k); j < m; j++) {
+    if (!t->bm[k[j]]) {
+      t->bm[k[j]] = 1;
+      t->nbm += tweight(k[j]);
     }
   }
+}
 
-  // discard content in indirect blocks
-  if (ip->addrs[NDIRECT]) {
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint *)bp->data;
-    for (j = 0; j < NINDIRECT; j++) {
-      if (a[j])
-        bfree(ip->dev, a[j]);
-      else
-        break;
+// Free the queued blocks and commit them with the inode, then go on
+// in a new transaction. The disk must not point at a queued block.
+// Before the first commit the inode goes on the orphan list.
+static void tnext(struct trunc *t) {
+  if (orphan_add(t->ip->dev, t->ip->inum) < 0)
+    printf("itrunc: orphan list full, a crash may leak blocks\n");
+  bfreen(t->ip->dev, t->b, t->n);
+  t->n = 0;
+  memset(t->bm, 0, tnmeta());
+  t->nbm = 0;
+  t->nind = 0;
+  memset(t->ind, 0, sizeof(t->ind));
+  iupdate(t->ip);
+  log_restart(TRUNCBLKS);
+  t->budget = TRUNCBLKS;
+}
+
+// Can blocks b[0..n-1] be freed with the running transaction?
+// Each bitmap block that is not logged yet costs a log block.
+static int tfits(struct trunc *t, uint *b, int n) {
+  uint k[2];
+  int i, j, m, c = 0;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0, m = tmeta(b[i], k); j < m; j++) {
+      if (!t->bm[k[j]]) {
+        t->bm[k[j]] = 2; // counted, but not queued
+        c += tweight(k[j]);
+      }
     }
+  }
+  for (i = 0; i < n; i++)
+    for (j = 0, m = tmeta(b[i], k); j < m; j++)
+      if (t->bm[k[j]] == 2)
+        t->bm[k[j]] = 0;
 
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
-  }
-
-  // discard content in doubly indirect blocks
-  if(ip->addrs[NDIRECT+1]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
-    a = (uint*)bp->data;
-    for(j = 0; j < 256; j++){
-      if(a[j]){
-        struct buf *bbp = bread(ip->dev, a[j]);
-        uint* b = (uint*)bbp->data;
-        for(int k=0; k < 256; k++){
-          if(b[k])
-            bfree(ip->dev, b[k]);
-        }
-        brelse(bbp);
-        bfree(ip->dev, a[j]);
+  return t->nbm + c + t->nind <= t->budget - TRUNCMETA;
+}
+
+// Queue block b, which nothing on disk points at once the caller
+// zeroes its pointer, starting a new transaction first if need be.
+static void tfree(struct trunc *t, uint b) {
+  while (!tfits(t, &b, 1))
+    tnext(t);
+  tqueue(t, b);
+}
+
+// Queue the blocks under indirect block addr, which has level levels
+// of indirect blocks below the inode (1 for a block listing data
+// blocks), last first, then addr itself; the caller zeroes the
+// pointer to addr. If they do not fit in one transaction, the ones
+// freed first are zeroed in addr, so the disk never points at a
+// free block; unless a snapshot shares addr, which then keeps them.
+// If another file shares addr, addr only loses a reference.
+static void truncind(struct trunc *t, uint addr, int level) {
+  struct fsstate *fs = DEVFS(t->ip->dev)->fs;
+  uint *a, *e;
+  int *ix, i, j, k, m, shared;
+  struct buf *bp;
+
+  if (fs->fsref && refget(t->ip->dev, addr) > 1) {
+    tfree(t, addr);
+    return;
+  }
+
+  // too big for the stack with large blocks
+  if ((a = malloc(3 * BSIZE + sizeof(uint))) == 0) {
+    printf("panic: itrunc: out of memory");
+    exit(1);
+  }
+  e = a + NINDIRECT;               // blocks to free, last first
+  ix = (int *)(e + NINDIRECT + 1); // and where they are in a
+
+  // work on a copy: no buffer may stay locked across a commit
+  bp = bread(t->ip->dev, addr);
+  memmove(a, bp->data, BSIZE);
+  brelse(bp);
+  shared = snapshared(t->ip->dev, addr);
+
+  if (level > 1) {
+    for (j = NINDIRECT - 1; j >= 0; j--) {
+      if (a[j] == 0)
+        continue;
+      truncind(t, a[j], level - 1);
+      if (shared)
+        continue;
+      bp = bread(t->ip->dev, addr);
+      ((uint *)bp->data)[j] = 0;
+      log_write(bp);
+      brelse(bp);
+      if (t->ind[level - 1] != addr) {
+        t->ind[level - 1] = addr;
+        t->nind++;
       }
     }
+    tfree(t, addr);
+    free(a);
+    return;
+  }
+
+  for (j = NINDIRECT - 1, k = 0; j >= 0; j--) {
+    if (a[j] && a[j] != CMARK) {
+      ix[k] = j;
+      e[k++] = a[j];
+    }
+  }
+  e[k] = addr;
+
+  for (i = 0; !tfits(t, e + i, k - i + 1);) {
+    if (t->n > 0 || t->budget < TRUNCBLKS) {
+      tnext(t);
+      continue;
+    }
+    // too many for one transaction: free a part of them
+    for (m = 1; tfits(t, e + i, m + 1); m++)
+      ;
+    bp = bread(t->ip->dev, addr);
+    for (; m > 0; m--, i++) {
+      tqueue(t, e[i]);
+      if (!shared)
+        ((uint *)bp->data)[ix[i]] = 0;
+    }
+    if (!shared)
+      log_write(bp);
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT+1]);
-    ip->addrs[NDIRECT+1] = 0;
+    tnext(t);
+  }
+
+  for (; i <= k; i++)
+    tqueue(t, e[i]);
+  free(a);
+}
+
+// Truncate inode (discard contents).
+// Blocks are freed from the end in bulk, a bitmap block at a time.
+// A big file takes several transactions: the caller's first, so the
+// caller must hold ip->lock, be inside a transaction that has logged
+// no more than half of MAXOPBLKS, and be the only user of ip.
+void itrunc(struct inode *ip) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  struct trunc t;
+  int i;
+
+  pdrop(ip);
+
+  memset(&t, 0, sizeof(t));
+  t.ip = ip;
+  t.budget = MAXOPBLKS / 2; // what is left of the caller's reservation
+  if ((t.bm = calloc(tnmeta(), 1)) == 0) {
+    printf("panic: itrunc: out of memory");
+    exit(1);
   }
 
-  ip->size = 0;
+  // discard content behind the indirect blocks, deepest first
+  for (i = fs->nlevel; i >= 1; i--) {
+    if (ip->addrs[fs->ndirect + i - 1]) {
+      truncind(&t, ip->addrs[fs->ndirect + i - 1], i);
+      ip->addrs[fs->ndirect + i - 1] = 0;
+    }
+  }
+
+  // discard content in direct blocks
+  for (i = fs->ndirect - 1; i >= 0; i--) {
+    if (ip->addrs[i] && ip->addrs[i] != CMARK)
+      tfree(&t, ip->addrs[i]);
+    ip->addrs[i] = 0;
+  }
+
+  bfreen(ip->dev, t.b, t.n);
+  free(t.b);
+  free(t.bm);
+
+  ip->size = ip->dsize = 0;
   iupdate(ip);
 }
 
+// Truncate ip in constant time: its blocks move to a new unlinked
+// inode on the orphan list, which the caller frees with iput() after
+// it has released ip and ended its operation. A big truncation then
+// never holds ip->lock across the commits it takes.
+// Returns 0 if ip has no blocks.
+// Caller must hold ip->lock and be inside a transaction.
+struct inode *idetach(struct inode *ip) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  struct inode *tip;
+  int i;
+
+  pdrop(ip);
+  for (i = 0; i < fs->ndirect + fs->nlevel && ip->addrs[i] == 0; i++)
+    ;
+  if (i == fs->ndirect + fs->nlevel) {
+    ip->size = ip->dsize = 0;
+    iupdate(ip);
+    return 0;
+  }
+
+  tip = ialloc(ip->dev, T_FILE);
+  ilock(tip);
+  tip->nlink = 0;
+  tip->size = tip->dsize = ip->dsize;
+  memmove(tip->addrs, ip->addrs, sizeof(ip->addrs));
+  iupdate(tip);
+  iunlock(tip);
+  if (orphan_add(tip->dev, tip->inum) < 0)
+    printf("idetach: orphan list full, a crash may leak blocks\n");
+
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->size = ip->dsize = 0;
+  iupdate(ip);
+  return tip;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // Returns the number of bytes successfully read.
-int readi(struct inode *ip, void *dst, uint off, uint n) {
-  uint tot, m;
+int readi(struct inode *ip, void *dst, uint64 off, uint n) {
+  uint tot, m, boff;
+  struct page *pg;
   struct buf *bp;
 
   if (off > ip->size || off + n < off)
@@ -230,9 +1179,16 @@ int readi(struct inode *ip, void *dst, uint off, uint n) {
     n = ip->size - off;
 
   for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-    bp = bread(ip->dev, bmap(ip, off / BSIZE));
     m = min(n - tot, BSIZE - off % BSIZE);
-    if (memcpy(dst, bp->data + (off % BSIZE), m) == NULL) {
+    if (ip->npage > 0 && (pg = plookup(ip, off / BSIZE)) != 0) {
+      memcpy(dst, pg->data + (off % BSIZE), m); // not written back yet
+      continue;
+    }
+    if ((bp = bmapread(ip, off / BSIZE, &boff)) == 0) {
+      memset(dst, 0, m); // never written
+      continue;
+    }
+    if (memcpy(dst, bp->data + boff + (off % BSIZE), m) == NULL) {
       brelse(bp);
       tot = -1;
       break;
@@ -247,28 +1203,58 @@ int readi(struct inode *ip, void *dst, uint off, uint n) {
 // Returns the number of bytes successfully written.
 // If the return value is less than the requested n,
 // there was an error of some kind.
-int writei(struct inode *ip, void *src, uint off, uint n) {
-  uint tot, m;
+// In ordered mode file data is written in place, not logged.
+// With FS_DEDUP whole blocks of file data go through ddwrite().
+int writei(struct inode *ip, void *src, uint64 off, uint n) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint tot, m, addr;
   struct buf *bp;
+  int inplace = ip->type == T_FILE && log_ordered();
+  char *blk = 0;
 
   if (off > ip->size || off + n < off)
     return -1;
-  if (off + n > MAXFILE * BSIZE)
+  if (off + n > fs->maxfile * BSIZE)
+    return -1;
+  if (fs->fsdedup && ip->type == T_FILE && (blk = malloc(BSIZE)) == 0)
     return -1;
 
   for (tot = 0; tot < n; tot += m, off += m, src += m) {
-    bp = bread(ip->dev, bmap(ip, off / BSIZE));
     m = min(n - tot, BSIZE - off % BSIZE);
+    if (blk) {
+      // the block as it will be, then share it or write it
+      if (m < BSIZE && (addr = bmapget(ip, off / BSIZE)) != 0) {
+        bp = bread(ip->dev, addr);
+        memmove(blk, bp->data, BSIZE);
+        brelse(bp);
+      } else {
+        memset(blk, 0, BSIZE);
+      }
+      memmove(blk + off % BSIZE, src, m);
+      ddwrite(ip, off / BSIZE, blk);
+      continue;
+    }
+    addr = bmapown(ip, off / BSIZE, m < BSIZE ? OWN_KEEP : OWN_NEW);
+    if (addr == 0 && inplace)
+      bp = bnew(ip->dev, bmap(ip, off / BSIZE)); // no stale bytes
+    else
+      bp = bread(ip->dev, addr ? addr : bmap(ip, off / BSIZE));
     if (memcpy(bp->data + (off % BSIZE), src, m) == NULL) {
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if (inplace)
+      bwrite(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
+  free(blk);
 
   if (off > ip->size)
     ip->size = off;
+  if (off > ip->dsize)
+    ip->dsize = off;
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new block to
@@ -288,20 +1274,23 @@ void stati(struct inode *ip, struct stat *st) {
   st->size = ip->size;
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy.
+// Find the inode with number inum on device dev, in snapshot slot
+// snap - 1 if snap is not 0, and return the in-memory copy.
 // Does not lock the inode and does not read it from disk.
-static struct inode *iget(uint dev, uint inum) {
+static struct inode *iget(uint dev, uint inum, int snap) {
+  struct fsstate *fs = DEVFS(dev)->fs;
   struct inode *ip, *empty;
 
-  acquire_spinlock(&itable.lock);
+  acquire_spinlock(&fs->itable.lock);
 
   empty = 0;
-  for (ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++) {
+  for (ip = &fs->itable.inode[0]; ip < &fs->itable.inode[NINODE]; ip++) {
     // the inode is already in the table
-    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
+    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum &&
+        ip->snap == snap) {
       ip->ref++;
-      release_spinlock(&itable.lock);
+      release_spinlock(&fs->itable.lock);
+      statadd(ST_IHIT, 1);
       return ip;
     }
 
@@ -320,42 +1309,58 @@ static struct inode *iget(uint dev, uint inum) {
   ip = empty;
   ip->dev = dev;
   ip->inum = inum;
+  ip->snap = snap;
   ip->ref = 1;
   ip->valid = 0;
-  release_spinlock(&itable.lock);
+  release_spinlock(&fs->itable.lock);
+  statadd(ST_IMISS, 1);
 
   return ip;
 }
 
 // Drop a ref to an in-memory inode.
 // If it was the last ref, the inode table entry can be recycled.
-// If it was the last ref and the inode has no links to it, free the inode (and
-// its content) on disk. All calls to iput() must be inside a transaction in
-// case it has to free the inode.
+// If it was the last ref and the inode has no links to it, put it on the
+// orphan list; the reclaimer frees the inode (and its content) on disk.
+// All calls to iput() must be inside a transaction in case it has to
+// free the inode.
 void iput(struct inode *ip) {
-  acquire_spinlock(&itable.lock);
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  int kick = 0;
 
-  if (ip->ref == 1 && ip->valid && ip->nlink == 0) {
+  acquire_spinlock(&fs->itable.lock);
+
+  if (ip->ref == 1 && ip->valid && ip->nlink == 0 && ip->snap == 0) {
     // inode has no links and no other references: truncate and free.
+    // That is left to the reclaimer, unless the orphan list is full.
 
     // ip->ref == 1 means no other process can have ip locked,
     // so this acquiresleep() won't block (or deadlock).
     acquire_sleeplock(&ip->lock);
 
-    release_spinlock(&itable.lock);
+    release_spinlock(&fs->itable.lock);
 
-    itrunc(ip);
-    ip->type = 0;
-    iupdate(ip);
+    if (orphan_add(ip->dev, ip->inum) == 0) {
+      pdrop(ip);
+      kick = 1;
+    } else {
+      itrunc(ip);
+      ip->type = 0;
+      iupdate(ip);
+    }
     ip->valid = 0;
 
     release_sleeplock(&ip->lock);
 
-    acquire_spinlock(&itable.lock);
+    acquire_spinlock(&fs->itable.lock);
   }
 
   ip->ref--;
-  release_spinlock(&itable.lock);
+  release_spinlock(&fs->itable.lock);
+
+  // only now that ip is free for the reclaimer to take
+  if (kick)
+    orphan_kick();
 }
 
 void iunlockput(struct inode *ip) {
@@ -366,35 +1371,52 @@ void iunlockput(struct inode *ip) {
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode *idup(struct inode *ip) {
-  acquire_spinlock(&itable.lock);
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+
+  acquire_spinlock(&fs->itable.lock);
   ip->ref++;
-  release_spinlock(&itable.lock);
+  release_spinlock(&fs->itable.lock);
   return ip;
 }
 
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void ilock(struct inode *ip) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
   struct buf *bp;
   struct dinode *dip;
+  struct dinode64 *dip64;
+  uint c;
 
   if (ip == 0 || ip->ref < 1) {
     printf("panic: ilock: invalid inode");
     exit(1);
   }
 
-  acquire_sleeplock(&ip->lock);
+  histadd(H_ILOCKWAIT, acquire_sleeplock_wait(&ip->lock), ip->inum);
 
   if (ip->valid == 0) {
-    // read from disk
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    // read from disk, or from the copy a snapshot sees
+    bp = bread(ip->dev, IBLOCK(ip->inum, fs->sb));
+    if (ip->snap &&
+        (c = snapcopy(ip->dev, isave(fs, ip->inum), ip->snap - 1)) != 0) {
+      brelse(bp);
+      bp = bread(ip->dev, c);
+    }
     dip = (struct dinode *)bp->data + ip->inum % IPB;
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
-    ip->size = dip->size;
-    memcpy(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    if (fs->sb.flags & FS_64BIT) {
+      dip64 = (struct dinode64 *)dip;
+      ip->size = ip->dsize = dip64->size;
+      memset(ip->addrs, 0, sizeof(ip->addrs));
+      memcpy(ip->addrs, dip64->addrs, sizeof(dip64->addrs));
+    } else {
+      ip->size = ip->dsize = dip->size;
+      memcpy(ip->addrs, dip->addrs, sizeof(dip->addrs));
+    }
     brelse(bp);
     ip->valid = 1;
 
@@ -418,68 +1440,727 @@ void iunlock(struct inode *ip) {
 
 /* Inode content */
 // The content (data) associated with each inode is stored in blocks on the
-// disk. The first NDIRECT block numbers are listed in ip->addrs[]. The next
-// NINDIRECT blocks are listed in block ip->addrs[NDIRECT].
+// disk. The first ndirect block numbers are listed in ip->addrs[]. The next
+// NINDIRECT blocks are listed in block ip->addrs[ndirect], the next
+// NININDIRECT behind the doubly indirect block ip->addrs[ndirect+1], and
+// on a FS_64BIT file system NINDIRECT^3 more behind the triply indirect
+// block ip->addrs[ndirect+2].
+
+// Find the tree that block bn of a file is in: returns its level of
+// indirect blocks (0 for a direct block, -1 if out of range), makes
+// *bn the index in that tree and sets *span to the tree's block count.
+static int bmaplevel(uint *bn, uint64 *span) {
+  struct fsstate *fs = curfs->fs;
+  int level;
+
+  if (*bn < fs->ndirect)
+    return 0;
+  *bn -= fs->ndirect;
+
+  for (level = 1, *span = NINDIRECT; level <= fs->nlevel;
+       level++, *span *= NINDIRECT) {
+    if (*bn < *span)
+      return level;
+    *bn -= *span;
+  }
+
+  return -1;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint bmap(struct inode *ip, uint bn) {
-  uint addr, *a;
+  uint addr;
+
+  if ((addr = bmapget(ip, bn)) == 0) {
+    addr = balloc(ip->dev, ip->type == T_FILE);
+    bmapput(ip, bn, addr);
+  }
+
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip,
+// or 0 if no block is allocated there yet.
+static uint bmapget(struct inode *ip, uint bn) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint addr;
+  uint64 span;
+  int level;
   struct buf *bp;
 
-  // block no in direct blocks(bn start from 0)
-  if (bn < NDIRECT) {
-    if ((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+  if ((level = bmaplevel(&bn, &span)) <= 0)
+    return level == 0 ? ip->addrs[bn] : 0;
 
-    return addr;
+  // walk down the indirect blocks
+  addr = ip->addrs[fs->ndirect + level - 1];
+  while (addr && span > 1) {
+    span /= NINDIRECT;
+    bp = bread(ip->dev, addr);
+    addr = ((uint *)bp->data)[bn / span];
+    brelse(bp);
+    bn %= span;
   }
 
-  // block no in indirect blocks
-  // minus NDIRECT (count for indirect block no)
-  bn -= NDIRECT;
+  return addr;
+}
 
-  if (bn < NINDIRECT) {
-    // Load indirect block, allocating if necessary.
-    if ((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
+// Set entry bn of indirect block addr to baddr.
+static void bmapset(uint dev, uint addr, uint bn, uint baddr) {
+  struct buf *bp;
+
+  bp = bread(dev, addr);
+  ((uint *)bp->data)[bn] = baddr;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Make block addr the nth block of inode ip,
+// allocating the indirect blocks on the way if necessary.
+static void bmapput(struct inode *ip, uint bn, uint addr) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint ind, *a;
+  uint64 span;
+  int level;
+  struct buf *bp;
+
+  bmapown(ip, bn, OWN_PATH);
+  if ((level = bmaplevel(&bn, &span)) < 0) {
+    printf("panic: bmap: out of range");
+    exit(1);
+  }
+
+  // block no in direct blocks(bn start from 0)
+  if (level == 0) {
+    ip->addrs[bn] = addr;
+    return;
+  }
+
+  // Load the top indirect block, allocating if necessary.
+  if (ip->addrs[fs->ndirect + level - 1] == 0)
+    ip->addrs[fs->ndirect + level - 1] = balloc(ip->dev, 0);
+  ind = ip->addrs[fs->ndirect + level - 1];
+
+  // then the ones below it, down to the block listing bn
+  while (span > NINDIRECT) {
+    span /= NINDIRECT;
+    bp = bread(ip->dev, ind);
     a = (uint *)bp->data;
-    if ((addr = a[bn]) == 0) {
-      a[bn] = addr = balloc(ip->dev);
+    if ((ind = a[bn / span]) == 0) {
+      a[bn / span] = ind = balloc(ip->dev, 0);
       log_write(bp);
     }
+    brelse(bp);
+    bn %= span;
+  }
+
+  bmapset(ip->dev, ind, bn, addr);
+}
+
+// Do snapshots or other files see block b too?
+static int bshared(uint dev, uint b) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+
+  return (fs->fsref && refget(dev, b) > 1) || snapshared(dev, b);
+}
 
+// Move block b of ip, which is shared, to a new block, with its
+// content if keep is set, and return the new block. ind tells if it
+// is an indirect block: if other files share it, the blocks it lists
+// get a reference from the copy. The old block is freed, and the
+// snapshot keeps it, or it loses a reference.
+// Must be inside a transaction.
+static uint bcow(struct inode *ip, uint b, int ind, int keep) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  int data = !ind && ip->type == T_FILE, i;
+  uint nb, got;
+  struct buf *bp, *np;
+
+  nb = ballocrun(ip->dev, 1, data, &got);
+  if (keep) {
+    bp = bread(ip->dev, b);
+    np = bnew(ip->dev, nb);
+    memmove(np->data, bp->data, BSIZE);
     brelse(bp);
-    return addr;
+    if (ind && fs->fsref && refget(ip->dev, b) > 1)
+      for (i = 0; i < NINDIRECT; i++)
+        if (((uint *)np->data)[i])
+          refinc(ip->dev, ((uint *)np->data)[i]);
+    if (data && log_ordered())
+      bwrite(np);
+    else
+      log_write(np);
+    brelse(np);
   }
-  bn -= NINDIRECT;
+  bfreen(ip->dev, &b, 1);
+  return nb;
+}
 
-  if(bn < NININDIRECT){
-    // Load first indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT+1]) == 0)
-      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
+// Return the disk block address of the nth block in inode ip, like
+// bmapget(), once the blocks on its path that snapshots or other
+// files share have moved to new blocks of ip's own: the indirect
+// blocks (OWN_PATH), and the block too, without its old content if
+// the caller writes it all (OWN_NEW) or with it (OWN_KEEP). Updates
+// ip->addrs; the caller calls iupdate().
+// Caller must hold ip->lock and be inside a transaction.
+static uint bmapown(struct inode *ip, uint bn, int how) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint addr, ind = 0, i;
+  uint64 span = 1;
+  int level, data;
+  struct buf *bp;
 
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn/256]) == 0){
-      a[bn/256] = addr = balloc(ip->dev);
-      log_write(bp);
+  if (fs->nsnap == 0 && !fs->fsref)
+    return how == OWN_PATH ? 0 : bmapget(ip, bn);
+  if ((level = bmaplevel(&bn, &span)) < 0)
+    return 0;
+
+  i = level == 0 ? bn : fs->ndirect + level - 1;
+  for (addr = ip->addrs[i]; addr != 0;) {
+    data = span == 1;
+    if (data && how == OWN_PATH)
+      break;
+    if (bshared(ip->dev, addr)) {
+      addr = bcow(ip, addr, !data, !data || how == OWN_KEEP);
+      if (ind)
+        bmapset(ip->dev, ind, i, addr);
+      else
+        ip->addrs[i] = addr;
     }
+    if (data)
+      break;
+    // down to the next level
+    span /= NINDIRECT;
+    ind = addr;
+    i = bn / span;
+    bn %= span;
+    bp = bread(ip->dev, ind);
+    addr = ((uint *)bp->data)[i];
     brelse(bp);
+  }
 
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn%256]) == 0){
-      a[bn%256] = addr = balloc(ip->dev);
-      log_write(bp);
+  return addr;
+}
+
+// Does ip keep its data in clusters that may be compressed?
+static int ccompressed(struct inode *ip) {
+  return DEVFS(ip->dev)->fscompress && ip->type == T_FILE;
+}
+
+// Decompress the cluster of ip that starts at block first into bp.
+static void cunpack(struct inode *ip, uint first, struct buf *bp) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  struct buf *zb;
+  uint i, addr, len;
+  char *z;
+
+  if ((z = malloc(CLUSTER)) == 0) {
+    printf("panic: cunpack: out of memory");
+    exit(1);
+  }
+  for (i = 1; i < fs->nclblk && (addr = bmapget(ip, first + i)) != 0; i++) {
+    zb = bread(ip->dev, addr);
+    memcpy(z + (i - 1) * BSIZE, zb->data, BSIZE);
+    brelse(zb);
+  }
+  memcpy(&len, z, sizeof(len));
+  if (i == 1 || len > (i - 1) * BSIZE - sizeof(len) ||
+      lz4_decompress(z + sizeof(len), len, bp->data, CLUSTER) != CLUSTER) {
+    printf("panic: corrupt compressed cluster");
+    exit(1);
+  }
+  bp->valid = 1;
+  free(z);
+}
+
+// Return a locked buffer with the data of block bn of ip, which
+// starts at byte *boff in it, or 0 if bn is a hole.
+// A block of a compressed cluster comes with the whole cluster,
+// decompressed once and then cached until its blocks are freed.
+// Caller must hold ip->lock.
+static struct buf *bmapread(struct inode *ip, uint bn, uint *boff) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  struct buf *bp;
+  uint addr, first;
+
+  *boff = 0;
+  if (ccompressed(ip)) {
+    first = bn / fs->nclblk * fs->nclblk;
+    if (bmapget(ip, first) == CMARK) {
+      bp = bget(ip->dev | CDEV, bmapget(ip, first + 1));
+      if (!bp->valid)
+        cunpack(ip, first, bp);
+      *boff = (bn - first) * BSIZE;
+      return bp;
+    }
+  }
+
+  if ((addr = bmapget(ip, bn)) == 0)
+    return 0;
+  return bread(ip->dev, addr);
+}
+
+// Number of refcount blocks a reference to each block that indirect
+// block addr lists dirties, or more.
+static int indrefs(uint dev, uint addr) {
+  struct fsstate *fs = DEVFS(dev)->fs;
+  struct buf *bp;
+  uint *a, last = 0;
+  int i, n = 0;
+
+  bp = bread(dev, addr);
+  a = (uint *)bp->data;
+  for (i = 0; i < NINDIRECT; i++) {
+    if (a[i] && (n == 0 || RBLOCK(a[i], fs->sb) != last)) {
+      last = RBLOCK(a[i], fs->sb);
+      n++;
+    }
+  }
+  brelse(bp);
+  return n;
+}
+
+// Log blocks that writing a run of file blocks will dirty.
+struct wcost {
+  int blks;    // log blocks so far, starting with the inode
+  uint nalloc; // blocks to allocate (or free) so far
+  uint ind[NLEVEL][NLEVEL]; // last indirect block counted, by tree and
+                            // depth in the tree
+  uint cl;     // last cluster counted (FS_COMPRESS)
+};
+
+static void wcostinit(struct wcost *wc) {
+  struct fsstate *fs = curfs->fs;
+
+  memset(wc, 0, sizeof(*wc));
+  wc->blks = 1 + (fs->nsnap > 0 ? SNAPSAVE : 0); // the inode, maybe saved
+  memset(wc->ind, 0xff, sizeof(wc->ind));
+  wc->cl = 0xFFFFFFFF;
+}
+
+// Add the cost of writing block bn of ip to wc, as a new block if
+// fresh, unless that would take it over nblks log blocks.
+// Returns 1 if the block was added.
+// Counts one log block per data block (none when data is written in
+// place), the indirect blocks that gain entries, and the bitmap blocks
+// that allocations may touch. Blocks are added in ascending order.
+// With snapshots any block on the way may be shared: it moves to a new
+// block and the old one is freed, and a bitmap block may be saved.
+// With refcounts, a block another file shares moves too, and loses a
+// reference; the blocks a moved indirect block lists gain one.
+// Caller must hold ip->lock.
+static int wcostblk(struct inode *ip, struct wcost *wc, uint bn, int nblks,
+                    int fresh) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint nbmap = fs->sb.size / BPB + 1;
+  uint lbn, addr;
+  uint64 span;
+  int c, d, level, a = 0, old, dd = fs->fsdedup && ip->type == T_FILE;
+  int sn = fs->nsnap > 0, shared = 0;
+  struct buf *bp;
+
+  if (bn >= fs->maxfile)
+    return 0;
+
+  c = !(ip->type == T_FILE && log_ordered()); // the data block itself
+  old = !fresh && bmapget(ip, bn) != 0;
+  if (dd) {
+    // an index block and a refcount block; a block written over may
+    // be shared, so its pointer moves to a new block and it loses a
+    // reference (a refcount and a bitmap block)
+    c += 1 + 1 + (old ? 2 : 0);
+  }
+  if (!old || dd || sn || fs->fsref) {
+    a += !old || dd ? 1 : sn ? 2 : 0;
+    lbn = bn;
+    level = bmaplevel(&lbn, &span);
+    addr = ip->addrs[level > 0 ? fs->ndirect + level - 1 : lbn];
+    // each indirect block on the way gains an entry (or is allocated)
+    for (d = 0; d < level; d++, span /= NINDIRECT) {
+      if (fs->fsref && addr && !shared)
+        shared = refget(ip->dev, addr) > 1;
+      if (wc->ind[level - 1][d] != lbn / span) {
+        wc->ind[level - 1][d] = lbn / span;
+        c++;
+        if (sn)
+          a += 2;
+        else
+          a += (!old || dd) &&
+               (d > 0 || ip->addrs[fs->ndirect + level - 1] == 0);
+        if (shared && addr) {
+          c += 1 + indrefs(ip->dev, addr);
+          a++;
+        }
+      }
+      if (addr) {
+        bp = bread(ip->dev, addr);
+        addr = ((uint *)bp->data)[lbn % span / (span / NINDIRECT)];
+        brelse(bp);
+      }
+    }
+    // a data block another file shares moves (ddwrite() counted above)
+    if (fs->fsref && !dd && old && (shared || refget(ip->dev, addr) > 1)) {
+      c++;
+      a++;
+    }
+  }
+
+  // allocations may land in any bitmap block, at worst one each
+  c += (min(wc->nalloc + a, nbmap) - min(wc->nalloc, nbmap)) *
+       (sn ? 1 + SNAPSAVE : 1);
+  if (wc->blks + c > nblks)
+    return 0;
+  wc->blks += c;
+  wc->nalloc += a;
+  return 1;
+}
+
+// Add the cost of writing block bn of ip to wc, like wcostblk().
+// A cluster that may be compressed is written whole to new blocks,
+// and its old blocks are freed, so it is counted once, that way.
+// Caller must hold ip->lock.
+static int wcostadd(struct inode *ip, struct wcost *wc, uint bn, int nblks) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint nbmap = fs->sb.size / BPB + 1;
+  uint cl, i;
+  struct wcost save;
+  int c;
+
+  if (!ccompressed(ip) ||
+      (uint64)(bn / fs->nclblk + 1) * fs->nclblk > fs->maxfile)
+    return wcostblk(ip, wc, bn, nblks, 0);
+
+  cl = bn / fs->nclblk;
+  if (cl == wc->cl)
+    return 1;
+  save = *wc;
+  for (i = cl * fs->nclblk; i < (cl + 1) * fs->nclblk; i++) {
+    if (!wcostblk(ip, wc, i, nblks, 1)) {
+      *wc = save;
+      return 0;
+    }
+  }
+  // the old blocks
+  c = min(wc->nalloc + fs->nclblk, nbmap) - min(wc->nalloc, nbmap);
+  if (wc->blks + c > nblks) {
+    *wc = save;
+    return 0;
+  }
+  wc->blks += c;
+  wc->nalloc += fs->nclblk;
+  wc->cl = cl;
+  return 1;
+}
+
+// Work out how many of the n bytes at off writei() can write while
+// dirtying at most nblks log blocks, and return that byte count.
+// *cost gets the number of log blocks that write will dirty.
+// Caller must hold ip->lock.
+uint writeifit(struct inode *ip, uint64 off, uint n, int nblks, int *cost) {
+  uint tot, m;
+  struct wcost wc;
+
+  wcostinit(&wc);
+  for (tot = 0; tot < n; tot += m, off += m) {
+    m = min(n - tot, BSIZE - off % BSIZE);
+    if (!wcostadd(ip, &wc, off / BSIZE, nblks))
+      break;
+  }
+
+  *cost = wc.blks;
+  return tot;
+}
+
+// Write data to inode through the page cache.
+// The data blocks are allocated later, when iflush() writes the pages,
+// so small appends end up in one contiguous run and a file that is
+// removed before then never reaches the disk.
+// Caller must hold ip->lock.
+// Returns the number of bytes written, or -1.
+int delaywritei(struct inode *ip, void *src, uint64 off, uint n) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint tot, m, boff;
+  struct page *pg;
+  struct buf *bp;
+  int isnew;
+
+  if (off > ip->size || off + n < off)
+    return -1;
+  if (off + n > fs->maxfile * BSIZE)
+    return -1;
+
+  for (tot = 0; tot < n; tot += m, off += m, src += m) {
+    m = min(n - tot, BSIZE - off % BSIZE);
+    pg = pget(ip, off / BSIZE, &isnew);
+    if (isnew && m < BSIZE && (bp = bmapread(ip, off / BSIZE, &boff)) != 0) {
+      // partial write over data already on disk
+      memcpy(pg->data, bp->data + boff, BSIZE);
+      brelse(bp);
+    }
+    memcpy(pg->data + off % BSIZE, src, m);
+  }
+
+  if (off > ip->size)
+    ip->size = off;
+
+  return tot;
+}
+
+// Write a block of file data to disk block addr:
+// in place in ordered mode, through the log otherwise.
+static void writeblk(uint dev, uint addr, char *data) {
+  struct buf *bp;
+
+  bp = bnew(dev, addr);
+  memcpy(bp->data, data, BSIZE);
+  if (log_ordered())
+    bwrite(bp);
+  else
+    log_write(bp);
+  brelse(bp);
+}
+
+// Write data as block bn of ip. If the fingerprint index knows a
+// block with the same content, that block gets one more reference
+// instead. A block that may be shared is never written over: the
+// data goes to a new block and the old one loses a reference.
+// Caller must hold ip->lock and be inside a transaction.
+static void ddwrite(struct inode *ip, uint bn, char *data) {
+  uint64 fp = ddhash(data);
+  uint old, b, got;
+
+  bmapown(ip, bn, OWN_PATH); // a clone may share the indirect blocks
+  old = bmapget(ip, bn);
+
+  if ((b = ddlookup(ip->dev, fp, data)) != 0) {
+    if (b == old)
+      return;
+    refset(ip->dev, b, refget(ip->dev, b) + 1);
+    bmapput(ip, bn, b);
+  } else if (old && refget(ip->dev, old) <= 1) {
+    writeblk(ip->dev, old, data);
+    refset(ip->dev, old, 1);
+    ddinsert(ip->dev, fp, old);
+    return;
+  } else {
+    b = ballocrun(ip->dev, 1, 1, &got);
+    writeblk(ip->dev, b, data);
+    refset(ip->dev, b, 1);
+    bmapput(ip, bn, b);
+    ddinsert(ip->dev, fp, b);
+  }
+  if (old)
+    bfreen(ip->dev, &old, 1);
+}
+
+// Write pages pgs[0..n-1] (sorted by block no) of ip to their disk
+// blocks, allocating blocks for runs of new pages contiguously.
+// Caller must hold ip->lock and be inside a transaction.
+static void writepages(struct inode *ip, struct page **pgs, int n) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint addr, got;
+  int i, j;
+
+  if (fs->fsdedup && ip->type == T_FILE) {
+    for (i = 0; i < n; i++)
+      ddwrite(ip, pgs[i]->lbn, pgs[i]->data);
+    return;
+  }
+
+  for (i = 0; i < n; i = j) {
+    if ((addr = bmapown(ip, pgs[i]->lbn, OWN_NEW)) != 0) {
+      writeblk(ip->dev, addr, pgs[i]->data);
+      j = i + 1;
+      continue;
+    }
+
+    // a run of consecutive pages without blocks
+    for (j = i + 1; j < n && pgs[j]->lbn == pgs[j - 1]->lbn + 1 &&
+                    bmapget(ip, pgs[j]->lbn) == 0;
+         j++)
+      ;
+    while (i < j) {
+      addr = ballocrun(ip->dev, j - i, 1, &got);
+      for (; got > 0; got--, i++, addr++) {
+        bmapput(ip, pgs[i]->lbn, addr);
+        writeblk(ip->dev, addr, pgs[i]->data);
+      }
+    }
+  }
+}
+
+// Set the address of block bn of ip, if it changes.
+static void cput(struct inode *ip, uint bn, uint addr) {
+  if (bmapget(ip, bn) != addr)
+    bmapput(ip, bn, addr);
+}
+
+// Write pages pgs[0..n-1] (sorted by block no) of one cluster of ip.
+// If the cluster compresses to fewer blocks than its data takes, it
+// goes to new blocks compressed and the old blocks are freed. If not,
+// a raw cluster is written in place, and one compressed before goes
+// back to raw blocks.
+// Caller must hold ip->lock and be inside a transaction.
+static void cflush(struct inode *ip, struct page **pgs, int n) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint first, i, j, k, nb, nraw, nold, addr, got, boff, len, *old;
+  int packed;
+  char *data, *z, *src;
+  struct buf *bp;
+
+  first = pgs[0]->lbn / fs->nclblk * fs->nclblk;
+  if ((uint64)first + fs->nclblk > fs->maxfile) {
+    writepages(ip, pgs, n); // a cluster cut short stays raw
+    return;
+  }
+  if ((data = malloc(2 * CLUSTER)) == 0 ||
+      (old = malloc(fs->nclblk * sizeof(uint))) == 0) {
+    printf("panic: cflush: out of memory");
+    exit(1);
+  }
+  z = data + CLUSTER;
+  packed = bmapget(ip, first) == CMARK;
+
+  // the cluster as it will be: the pages over the data on disk,
+  // and how many blocks it takes raw
+  for (i = j = nraw = 0; i < fs->nclblk; i++) {
+    if (j < n && pgs[j]->lbn == first + i) {
+      memcpy(data + i * BSIZE, pgs[j++]->data, BSIZE);
+      nraw++;
+    } else if ((bp = bmapread(ip, first + i, &boff)) != 0) {
+      memcpy(data + i * BSIZE, bp->data + boff, BSIZE);
+      brelse(bp);
+      nraw += !packed || (uint64)(first + i) * BSIZE < ip->size;
+    } else {
+      memset(data + i * BSIZE, 0, BSIZE);
+    }
+  }
+
+  len = 0;
+  if (nraw > 1) {
+    memset(z, 0, CLUSTER);
+    len = lz4_compress(data, CLUSTER, z + sizeof(len),
+                       (nraw - 1) * BSIZE - sizeof(len));
+  }
+  if (len == 0 && !packed) {
+    writepages(ip, pgs, n);
+    free(old);
+    free(data);
+    return;
+  }
+
+  for (i = nold = 0; i < fs->nclblk; i++)
+    if ((addr = bmapget(ip, first + i)) != 0 && addr != CMARK)
+      old[nold++] = addr;
+
+  if (len > 0) {
+    memcpy(z, &len, sizeof(len));
+    nb = (sizeof(len) + len + BSIZE - 1) / BSIZE;
+    cput(ip, first, CMARK);
+    k = 1;
+    src = z;
+  } else {
+    // data below the end of file, raw
+    nb = min((ip->size + BSIZE - 1) / BSIZE - first, fs->nclblk);
+    k = 0;
+    src = data;
+  }
+  for (i = 0; i < nb;) {
+    addr = ballocrun(ip->dev, nb - i, 1, &got);
+    for (; got > 0; got--, i++, addr++) {
+      writeblk(ip->dev, addr, src + i * BSIZE);
+      cput(ip, first + k + i, addr);
     }
+  }
+  for (i = k + nb; i < fs->nclblk; i++)
+    cput(ip, first + i, 0);
+  bfreen(ip->dev, old, nold);
+
+  if (len > 0) {
+    // no need to decompress it on the next read
+    bp = bget(ip->dev | CDEV, bmapget(ip, first + 1));
+    memcpy(bp->data, data, CLUSTER);
+    bp->valid = 1;
     brelse(bp);
-    return addr;
   }
 
-  printf("panic: bmap: out of range");
-  exit(1);
+  free(old);
+  free(data);
+}
+
+// Write pages pgs[0..n-1] (sorted by block no) of ip to disk, a
+// cluster at a time if they may be compressed, then drop them.
+// Caller must hold ip->lock and be inside a transaction.
+static void iflushpages(struct inode *ip, struct page **pgs, int n) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  uint64 end;
+  int i, j;
+
+  if (ccompressed(ip)) {
+    for (i = 0; i < n; i = j) {
+      for (j = i + 1;
+           j < n && pgs[j]->lbn / fs->nclblk == pgs[i]->lbn / fs->nclblk; j++)
+        ;
+      cflush(ip, pgs + i, j - i);
+    }
+  } else {
+    writepages(ip, pgs, n);
+  }
+
+  // everything below the last page written is on disk now
+  end = min(ip->size, (uint64)(pgs[n - 1]->lbn + 1) * BSIZE);
+  if (end > ip->dsize)
+    ip->dsize = end;
+  iupdate(ip);
+
+  for (i = 0; i < n; i++)
+    pfree(pgs[i]);
+}
+
+// Write ip's cached pages to disk, in as few transactions as the
+// log allows. Pages of a file with no links left are not written:
+// iput() discards them with the file.
+// Caller must hold a reference to ip, but not ip->lock,
+// and must not be inside a transaction.
+void iflush(struct inode *ip) {
+  struct page **pgs;
+  struct wcost wc;
+  int i, n, nblks;
+
+  for (;;) {
+    ilock(ip);
+    if (ip->npage == 0 || ip->nlink == 0) {
+      iunlock(ip);
+      return;
+    }
+    n = ppages(ip, &pgs);
+    wcostinit(&wc);
+    for (i = 0; i < n && wcostadd(ip, &wc, pgs[i]->lbn, MAXLOGOP); i++)
+      ;
+    free(pgs);
+    if (i == 0) {
+      // would never make progress
+      printf("panic: iflush: a page does not fit in a transaction");
+      exit(1);
+    }
+    iunlock(ip);
+
+    begin_opn(wc.blks);
+    ilock(ip);
+    // the pages may have changed while ip was unlocked
+    if (ip->npage > 0 && ip->nlink > 0) {
+      n = ppages(ip, &pgs);
+      nblks = wc.blks;
+      wcostinit(&wc);
+      for (i = 0; i < n && wcostadd(ip, &wc, pgs[i]->lbn, nblks); i++)
+        ;
+      if (i > 0)
+        iflushpages(ip, pgs, i);
+      free(pgs);
+    }
+    iunlock(ip);
+    end_op();
+  }
 }
 
 /* Directories */
@@ -488,8 +2169,10 @@ int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
+  struct fsstate *fs = DEVFS(dp->dev)->fs;
   uint off, inum;
   struct dirent de;
+  int k;
 
   if (dp->type != T_DIR) {
     printf("panic: dirlookup: not DIR");
@@ -507,12 +2190,20 @@ struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
 
     if (namecmp(name, de.name) == 0) {
       // entry matches path element
+      statadd(ST_DIRSCAN, off / sizeof(de) + 1);
       if (poff)
         *poff = off;
       inum = de.inum;
-      return iget(dp->dev, inum);
+      // /.snap/<name> is the root of snapshot name
+      if (fs->fssnap && dp->inum == fs->sb.snapdir && inum == ROOTINO &&
+          namecmp(name, "..") != 0) {
+        k = snapfind(name);
+        return k < 0 ? 0 : iget(dp->dev, ROOTINO, k + 1);
+      }
+      return iget(dp->dev, inum, dp->snap);
     }
   }
+  statadd(ST_DIRSCAN, off / sizeof(de));
 
   return 0;
 }
@@ -605,9 +2296,9 @@ static struct inode *namex(char *path, int nameiparent, char *name) {
   struct inode *ip, *next;
 
   if (*path == '/')
-    ip = iget(ROOTDEV, ROOTINO);
+    ip = iget(curfs->dev, ROOTINO, 0);
   else
-    ip = idup(cwd);
+    ip = idup(curfs->cwd);
 
   while ((path = skipelem(path, name)) != 0) {
     ilock(ip);
@@ -650,3 +2341,135 @@ struct inode *namei(char *path) {
 struct inode *nameiparent(char *path, char *name) {
   return namex(path, 1, name);
 }
+
+/* Cloning files */
+// Make np, an empty file, a copy of file ip that shares its blocks:
+// np gets ip's direct and top indirect blocks, and each of them one
+// more reference, so it takes constant time whatever the size. A
+// write to either file then moves the shared blocks it goes through
+// to new ones (bmapown()). With np 0, only tell if ip can be cloned.
+// ip's cached pages must be on disk. Returns 0, or -1 if the file
+// system has no refcounts, ip is in a snapshot or a block has as many
+// references as it can count.
+// Caller must hold both locks and be inside a transaction.
+int iclone(struct inode *ip, struct inode *np) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+  int i;
+
+  if (!fs->fsref || ip->type != T_FILE || ip->snap != 0)
+    return -1;
+  if (np == 0)
+    return 0;
+  if (np == ip || np->type != T_FILE || np->size != 0 || ip->npage != 0)
+    return -1;
+  for (i = 0; i < fs->ndirect + fs->nlevel; i++)
+    if (ip->addrs[i] && refget(ip->dev, ip->addrs[i]) >= MAXREF - 1)
+      return -1;
+
+  for (i = 0; i < fs->ndirect + fs->nlevel; i++) {
+    if (ip->addrs[i])
+      refinc(ip->dev, ip->addrs[i]);
+    np->addrs[i] = ip->addrs[i];
+  }
+  np->size = np->dsize = ip->dsize;
+  iupdate(np);
+  return 0;
+}
+
+/* Taking snapshots */
+// Is ip in a snapshot, or /.snap? Then it cannot be changed.
+int ireadonly(struct inode *ip) {
+  struct fsstate *fs = DEVFS(ip->dev)->fs;
+
+  return ip->snap != 0 || (fs->fssnap && ip->inum == fs->sb.snapdir);
+}
+
+// Take a snapshot of the whole file system, seen as /.snap/<name>.
+// It takes constant time: blocks are only saved for it when they
+// change. Returns 0, or -1 if the name is bad or taken or there are
+// NSNAP snapshots already.
+int snapcreate(char *name) {
+  struct fsstate *fs = curfs->fs;
+  struct inode *dp;
+  int k, r = -1;
+
+  if (!fs->fssnap || *name == 0 || strchr(name, '/') || strlen(name) > DIRSIZ ||
+      namecmp(name, ".") == 0 || namecmp(name, "..") == 0)
+    return -1;
+
+  pthread_mutex_lock(&fs->snaplock);
+  pflushall(); // cached file data goes in
+  begin_opx(); // no operation half done
+  for (k = 0; k < NSNAP && fs->snaps[k].state != SNAP_FREE; k++)
+    ;
+  if (k < NSNAP && snapfind(name) < 0) {
+    dp = iget(curfs->dev, fs->sb.snapdir, 0);
+    ilock(dp);
+    if (dirlink(dp, name, ROOTINO) == 0) {
+      strncpy(fs->snaps[k].name, name, DIRSIZ);
+      fs->snaps[k].ctime = time(0);
+      fs->snaps[k].state = SNAP_LIVE;
+      snapwrite(curfs->dev);
+      fs->nsnap++; // from the next operation on, blocks are saved for it
+      r = 0;
+    }
+    iunlockput(dp);
+  }
+  end_op();
+  pthread_mutex_unlock(&fs->snaplock);
+  return r;
+}
+
+// Delete snapshot name. The blocks only it kept are free again.
+// Returns -1 if there is no such snapshot or a file in it is in use.
+int snapdelete(char *name) {
+  struct fsstate *fs = curfs->fs;
+  struct inode *ip, *dp;
+  struct dirent de;
+  uint off;
+  int k, busy = 0;
+
+  pthread_mutex_lock(&fs->snaplock);
+  if ((k = snapfind(name)) < 0) {
+    pthread_mutex_unlock(&fs->snaplock);
+    return -1;
+  }
+
+  // No truncation may be half done: one that began while the snapshot
+  // shared its blocks did not zero the pointers to the blocks it freed,
+  // and could not go on after a crash once they are not shared.
+  pthread_mutex_lock(&fs->reclaim_lock);
+  reclaimall(curfs->dev);
+
+  begin_opx();
+  acquire_spinlock(&fs->itable.lock);
+  for (ip = &fs->itable.inode[0]; ip < &fs->itable.inode[NINODE]; ip++)
+    busy |= ip->ref > 0 && ip->snap == k + 1;
+  release_spinlock(&fs->itable.lock);
+  if (!busy) {
+    dp = iget(curfs->dev, fs->sb.snapdir, 0);
+    ilock(dp);
+    for (off = 0; off < dp->size; off += sizeof(de)) {
+      if (readi(dp, &de, off, sizeof(de)) != sizeof(de)) {
+        printf("panic: snapdelete: read");
+        exit(1);
+      }
+      if (de.inum != 0 && namecmp(name, de.name) == 0) {
+        memset(&de, 0, sizeof(de));
+        writei(dp, &de, off, sizeof(de));
+        break;
+      }
+    }
+    iunlockput(dp);
+    fs->snaps[k].state = SNAP_DELETING;
+    snapwrite(curfs->dev);
+    fs->nsnap--;
+  }
+  end_op();
+  pthread_mutex_unlock(&fs->reclaim_lock);
+
+  if (!busy)
+    snapreap(curfs->dev, k);
+  pthread_mutex_unlock(&fs->snaplock);
+  return busy ? -1 : 0;
+}
@@ -6,13 +6,63 @@
 
 #define ROOTINO 1                        // root i-number
 #define FSMAGIC 0x10203040               // SecFs Magic No
+#define SBOFF 1024 // byte offset of the super block, whatever the block size
+#define SBBLOCK (SBOFF / BSIZE) // block no holding the super block
 #define NDIRECT 11                       // direct block data no
 #define NINDIRECT (BSIZE / sizeof(uint)) // once indirect block data no
 #define NININDIRECT (NINDIRECT*NINDIRECT)// doubly indirect block data no
 #define MAXFILE (NDIRECT + NINDIRECT + NININDIRECT) // all data block no
+#define NDIRECT64 9                      // direct block data no (FS_64BIT)
+#define MAXFILE64                                                              \
+  (NDIRECT64 + NINDIRECT + NININDIRECT + (uint64)NININDIRECT * NINDIRECT)
+#define NADDRS (NDIRECT + 2) // block addresses in an inode, either format
+#define NLEVEL 3             // max levels of indirect blocks
+#define NORPHAN 64 // max inodes on the orphan list
+
+// Format variants, in superblock flags.
+#define FS_64BIT 0x1 // 64-bit file sizes and a triply indirect block
+#define FS_COMPRESS 0x2 // file data compressed in clusters
+#define FS_ENCRYPT 0x4  // blocks from the log on encrypted (AES-XTS)
+#define FS_DEDUP 0x8    // file blocks with the same content shared
+#define FS_SNAP 0x10    // read-only snapshots of the whole file system
+#define FS_REFLINK 0x20 // files cloned with their blocks shared
+
+// With FS_ENCRYPT, the super block keeps 16 zero bytes encrypted as
+// data unit KEYCHECK, to tell a wrong key.
+#define KEYCHECK ((uint64)-1)
+
+// With FS_DEDUP, a refcount table holds a byte per block: the number
+// of file blocks pointing at it, for blocks written since the image
+// was made (0 for all others, one reference). A freed block with more
+// than one reference only loses one. One that reaches MAXREF stays
+// there, and is never freed. A fingerprint index of hash buckets, a
+// block each, maps content hashes to blocks with a count; it is only
+// a hint, checked against the block's content.
+// FS_REFLINK has the refcount table alone. With either, a cloned file
+// shares its direct and top indirect blocks, each then counting one
+// more, and an indirect block shared that way shares the blocks it
+// lists.
+#define MAXREF 255
+struct ddent {
+  uint tag;   // low half of the content hash (the bucket is the high half)
+  uint blkno; // block with that content, when it was indexed
+};
+#define DDPB (BSIZE / sizeof(struct ddent)) // index entries per block
+
+// With FS_COMPRESS, file data is kept in clusters of CLUSTER bytes
+// (CLUSTER / BSIZE blocks, block size at most CLUSTER / 2). The first
+// address of a compressed cluster is CMARK, the next ones are the
+// blocks holding its compressed form: the byte length of the LZ4 data
+// followed by the data. The rest of its addresses are 0.
+#define CLUSTER 16384
+#define CMARK 0xFFFFFFFF
 
 // Disk layout:
-// [ boot block | super block | log | inode blocks | bit map | data blocks ]
+// [ boot block | super block | log | inode blocks | bit map |
+//   refcounts (FS_DEDUP, FS_SNAP, FS_REFLINK) |
+//   fingerprint index (FS_DEDUP) |
+//   snapshot table | save table | copies (FS_SNAP) | data blocks ]
+// With blocks bigger than 1 KiB the super block is inside the boot block.
 //
 // mkfs computes the super block and builds an initial file system.
 // The super block describes the disk layout:
@@ -25,6 +75,19 @@ struct superblock {
   uint logstart;   // block num of first log block
   uint inodestart; // block num of first inode block
   uint bmapstart;  // block num of first free map block
+  uint norphan;    // num of inodes on the orphan list
+  uint orphan[NORPHAN]; // unlinked inodes whose blocks are being freed
+  uint flags;      // format variants (FS_64BIT, FS_COMPRESS, ...)
+  uint bsize;      // block size (bytes), 0 for DEFBSIZE
+  uchar keycheck[16]; // FS_ENCRYPT: zeroes encrypted as unit KEYCHECK
+  uint refstart;   // FS_DEDUP, FS_SNAP, FS_REFLINK: first refcount block
+  uint idxstart;   // FS_DEDUP: block num of first fingerprint index block
+  uint nidx;       // FS_DEDUP: num of fingerprint index blocks
+  uint snapdir;    // FS_SNAP: inode num of /.snap
+  uint snapstart;  // FS_SNAP: block num of the snapshot table
+  uint savestart;  // FS_SNAP: block num of first save table block
+  uint copystart;  // FS_SNAP: block num of first copy
+  uint ncopy;      // FS_SNAP: num of copy blocks
 };
 
 // On-disk inode structure
@@ -37,6 +100,18 @@ struct dinode {
   uint addrs[NDIRECT + 1 + 1]; // data block addresses
 };
 
+// On-disk inode structure of a FS_64BIT file system, the same size:
+// two direct blocks make room for a 64-bit size and a triply
+// indirect block, so a file can grow past 4 GiB.
+struct dinode64 {
+  short type;
+  short nlink;
+  short major;
+  short minor;
+  uint64 size;
+  uint addrs[NDIRECT64 + 3];
+};
+
 // Inode num per block.
 #define IPB (BSIZE / sizeof(struct dinode))
 // Bitmap bit num per block
@@ -46,6 +121,10 @@ struct dinode {
 #define IBLOCK(i, sb) ((i) / IPB + sb.inodestart)
 // Block no of free map containing bit for data block b
 #define BBLOCK(b, sb) ((b) / BPB + sb.bmapstart)
+// Block no of refcount table containing the count for block b
+#define RBLOCK(b, sb) ((b) / BSIZE + sb.refstart)
+// Block no of save table containing entry i
+#define SAVEBLOCK(i, sb) ((i) / SPB + sb.savestart)
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
@@ -56,4 +135,31 @@ struct dirent {
   char name[DIRSIZ]; // name of file or dir
 };
 
+// With FS_SNAP, up to NSNAP snapshots show the file system as it was
+// when each was taken, under /.snap/<name>. The snapshot table block
+// holds their names. Bitmap and inode blocks are not copied when a
+// snapshot is taken: the first time one changes after that, its old
+// content is saved to the copy area, one copy for all the snapshots
+// that see it, with a count of them in the refcount table. The save
+// table tells, per bitmap block (index i) and inode block (index
+// size / BPB + 1 + inum / IPB), which copy each snapshot sees, or 0
+// if it sees the live block. A block set in some snapshot's bitmap is
+// never written over or reallocated: writes to it go to a new block.
+#define NSNAP 8
+#define SNAPDIR ".snap"
+#define SNAP_FREE 0
+#define SNAP_LIVE 1
+#define SNAP_DELETING 2 // its copies are being dropped
+struct snapent {
+  char name[DIRSIZ];
+  ushort state; // SNAP_FREE, SNAP_LIVE or SNAP_DELETING
+  uint ctime;   // when it was taken (seconds)
+};
+struct snapsave {
+  uint copy[NSNAP]; // copy each snapshot sees, 0 for the live block
+};
+#define SPB (BSIZE / sizeof(struct snapsave)) // save entries per block
+#define SNAPSAVE 3 // log blocks saving a block takes: the copy, its save
+                   // table block and its refcount block
+
 #endif
@@ -0,0 +1,883 @@
+// fsck: check an image that is not mounted, and with -y repair it.
+// The super block and the log come first; then worker threads read
+// the inode table in big runs and check each inode, and the indirect
+// blocks and directory blocks they point at, a level at a time: the
+// blocks of a level are sorted and read in runs of nearby blocks, so
+// the disk is read mostly in order whatever the tree looks like.
+// Last come the cross checks of what the walk found against the
+// bitmap, the refcount table, the link counts and the orphan list.
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BSIZE bsize // fsck checks one image, of the block size it has
+#include "../defs.h"
+#include "../fs.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define MAXTHREAD 16
+#define RUN (1024 * 1024)      // max bytes read at once
+#define RUNBLKS (RUN / BSIZE)  // max blocks read at once
+#define GAP (RUNBLKS / 8)      // unneeded blocks a run may read through
+#define MAXREPORT 100          // errors printed
+
+// Exit status, as e2fsck's.
+#define FSCK_OK 0
+#define FSCK_FIXED 1   // errors found, all repaired
+#define FSCK_ERRORS 4  // errors left
+#define FSCK_FAILED 8  // the image could not be checked
+
+// The log header (log.c).
+struct logheader {
+  int n;
+  int block[NLOG];
+};
+
+// A block the walk reads: an indirect block of inode inum, or a block
+// of directory inum (level 0).
+struct item {
+  uint bno;
+  uint inum;
+  uint64 fbn; // file block no of the first data block it covers
+  int level;
+};
+
+struct queue {
+  struct item *v;
+  uint n, max;
+};
+
+// Nearby blocks read at once: those of items v[i..j), in blocks
+// [first, first + n).
+struct run {
+  uint first, n;
+  uint i, j;
+};
+
+int fsfd;
+struct superblock sb;
+uint bsize = DEFBSIZE;
+int keyed, repair, nthread;
+uint ndirect = NDIRECT; // direct blocks in an inode
+int nlevel = 2;         // levels of indirect blocks
+uint64 maxfile;         // max file size in blocks
+uint nclblk;            // blocks per compressed cluster (FS_COMPRESS)
+int fsref;              // FS_DEDUP or FS_REFLINK: refcounts of data blocks
+uint datastart;         // first data block
+uint ninodeblk, nbmap, nref, nsave;
+
+char *itab;            // the inode blocks
+uchar *bmap;           // the bitmap blocks
+uchar *refs;           // the refcount blocks
+struct snapent snaps[NSNAP];
+struct snapsave *save; // the save table
+int nsnap;             // snapshots live or being deleted
+uchar snapseen[NSNAP]; // live snapshots with a name in /.snap
+
+uint *claims;  // per block, the pointers to it
+uint *nrefs;   // per inode, the directory entries naming it
+uint *parent;  // per directory, the directory with an entry for it
+uint *dotdot;  // per directory, what its ".." names
+uchar *onlist; // per inode, on the orphan list
+uchar *idirty; // per inode block, changed by a repair
+int bdirty, rdirty, sbdirty;
+
+// directory entries to clear: block no and entry index
+struct item *fixes;
+int nfixes, maxfixes;
+
+struct queue q[NLEVEL + 1]; // by level, directory blocks at 0
+struct run *runs;
+uint nruns;
+uint next; // next inode block or run for a worker to take
+int cur;   // level whose blocks are being checked
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int nerr, nfixed;
+
+static void usage(void) {
+  fprintf(stderr, "Usage: fsck [-y] [-j threads] [-k keyfile] fs.img\n");
+  exit(FSCK_FAILED);
+}
+
+static void fail(const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  printf("fsck: ");
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+  exit(FSCK_FAILED);
+}
+
+// Report an error, repaired if fixed is set.
+static void bad(int fixed, const char *fmt, ...) {
+  va_list ap;
+
+  pthread_mutex_lock(&lock);
+  if (nerr < MAXREPORT) {
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    printf(fixed ? ", fixed\n" : "\n");
+    va_end(ap);
+  } else if (nerr == MAXREPORT) {
+    printf("...\n");
+  }
+  nerr++;
+  nfixed += fixed;
+  pthread_mutex_unlock(&lock);
+}
+
+static void *alloc(size_t n) {
+  void *p;
+
+  if ((p = calloc(n ? n : 1, 1)) == 0)
+    fail("out of memory");
+  return p;
+}
+
+// Read n blocks from bno, as they are on disk.
+static void rraw(uint bno, uint n, char *buf) {
+  size_t len = (size_t)n * BSIZE, got;
+  ssize_t r;
+
+  for (got = 0; got < len; got += r)
+    if ((r = pread(fsfd, buf + got, len - got,
+                   (off_t)bno * BSIZE + got)) <= 0)
+      fail("can't read block %u", bno + (uint)(got / BSIZE));
+}
+
+// Decrypt block bno at p in place, if the image is encrypted.
+static void decrypt(uint bno, char *p) {
+  if (keyed && bno >= sb.logstart)
+    xts_decrypt(bno, p, p, BSIZE);
+}
+
+// Read n blocks from bno.
+static void rblks(uint bno, uint n, char *buf) {
+  uint i;
+
+  rraw(bno, n, buf);
+  for (i = 0; i < n; i++)
+    decrypt(bno + i, buf + (size_t)i * BSIZE);
+}
+
+// Write n blocks from bno.
+static void wblks(uint bno, uint n, char *buf) {
+  size_t len = (size_t)n * BSIZE, i;
+  char *p = buf;
+
+  if (keyed && bno + n > sb.logstart) {
+    p = alloc(len);
+    for (i = 0; i < len; i += BSIZE) {
+      if (bno + i / BSIZE >= sb.logstart)
+        xts_encrypt(bno + i / BSIZE, buf + i, p + i, BSIZE);
+      else
+        memcpy(p + i, buf + i, BSIZE);
+    }
+  }
+  if (pwrite(fsfd, p, len, (off_t)bno * BSIZE) != len)
+    fail("can't write block %u", bno);
+  if (p != buf)
+    free(p);
+}
+
+// Run fn in nthread threads, and wait for them.
+static void parallel(void *(*fn)(void *)) {
+  pthread_t tid[MAXTHREAD];
+  int i;
+
+  next = 0;
+  for (i = 0; i < nthread; i++)
+    pthread_create(&tid[i], 0, fn, 0);
+  for (i = 0; i < nthread; i++)
+    pthread_join(tid[i], 0);
+}
+
+static void push(struct queue *qu, uint bno, uint inum, uint64 fbn,
+                 int level) {
+  if (qu->n == qu->max) {
+    qu->max = qu->max ? qu->max * 2 : 256;
+    if ((qu->v = realloc(qu->v, qu->max * sizeof(struct item))) == 0)
+      fail("out of memory");
+  }
+  qu->v[qu->n].bno = bno;
+  qu->v[qu->n].inum = inum;
+  qu->v[qu->n].fbn = fbn;
+  qu->v[qu->n].level = level;
+  qu->n++;
+}
+
+// Add a worker's own queues to the shared ones.
+static void merge(struct queue *local) {
+  int l;
+  uint i;
+
+  pthread_mutex_lock(&lock);
+  for (l = 0; l <= NLEVEL; l++) {
+    for (i = 0; i < local[l].n; i++)
+      push(&q[l], local[l].v[i].bno, local[l].v[i].inum, local[l].v[i].fbn,
+           l);
+    free(local[l].v);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static int isset(uchar *map, uint b) { return map[b / 8] >> (b % 8) & 1; }
+
+static struct dinode *dinode(uint inum) {
+  return (struct dinode *)(itab + (size_t)(inum / IPB) * BSIZE) +
+         inum % IPB;
+}
+
+static uint *iaddrs(struct dinode *dip) {
+  if (sb.flags & FS_64BIT)
+    return ((struct dinode64 *)dip)->addrs;
+  return dip->addrs;
+}
+
+static uint64 isize(struct dinode *dip) {
+  if (sb.flags & FS_64BIT)
+    return ((struct dinode64 *)dip)->size;
+  return dip->size;
+}
+
+// Note that inode inum, whose block is being changed, needs writing.
+static void idirt(uint inum) { idirty[inum / IPB] = 1; }
+
+// Check pointer a of inode inum to data block fbn (level 0), or to an
+// indirect block of that level whose first data block is fbn, and
+// claim the block. A block is read once, by its first claim, however
+// many share it.
+static void ptr(uint inum, uint a, uint64 fbn, int level,
+                struct queue *local) {
+  struct dinode *dip = dinode(inum);
+
+  if (a == 0)
+    return;
+  if (a == CMARK && level == 0 && nclblk && dip->type == T_FILE) {
+    if (fbn % nclblk != 0)
+      bad(0, "inode %u: compressed cluster at block %llu", inum, fbn);
+    return;
+  }
+  if (a < datastart || a >= sb.size) {
+    bad(0, "inode %u: block %u out of range", inum, a);
+    return;
+  }
+  // a truncation that went on after a crash may have freed it already
+  // (fs.c's bfreen())
+  if ((sb.flags & FS_SNAP) && onlist[inum] && !isset(bmap, a))
+    return;
+  if (__sync_fetch_and_add(&claims[a], 1) > 0)
+    return;
+  if (level > 0 || dip->type == T_DIR)
+    push(&local[level], a, inum, fbn, level);
+}
+
+// Check inode inum, and claim the blocks it points at.
+static void icheck(uint inum, struct queue *local) {
+  struct dinode *dip = dinode(inum);
+  uint64 fbn, span;
+  uint *addrs;
+  int i, level;
+
+  if (dip->type == 0 || inum == 0)
+    return;
+  if (dip->type != T_DIR && dip->type != T_FILE && dip->type != T_DEVICE) {
+    bad(repair, "inode %u: type %d", inum, dip->type);
+    if (repair) {
+      memset(dip, 0, sizeof(*dip));
+      idirt(inum);
+    }
+    return;
+  }
+  if (isize(dip) > maxfile * BSIZE)
+    bad(0, "inode %u: size %llu too big", inum, isize(dip));
+
+  addrs = iaddrs(dip);
+  if (dip->type == T_DEVICE) {
+    for (i = 0; i < ndirect + nlevel && addrs[i] == 0; i++)
+      ;
+    if (i < ndirect + nlevel)
+      bad(0, "inode %u: device with blocks", inum);
+    return;
+  }
+  for (i = 0; i < ndirect; i++)
+    ptr(inum, addrs[i], i, 0, local);
+  fbn = ndirect;
+  for (level = 1, span = NINDIRECT; level <= nlevel; level++) {
+    ptr(inum, addrs[ndirect + level - 1], fbn, level, local);
+    fbn += span;
+    span *= NINDIRECT;
+  }
+}
+
+// Read the inode table, a run of blocks at a time, and check it.
+static void *iscan(void *arg) {
+  struct queue local[NLEVEL + 1];
+  uint b, n, inum;
+
+  memset(local, 0, sizeof(local));
+  while ((b = __sync_fetch_and_add(&next, RUNBLKS)) < ninodeblk) {
+    n = min(RUNBLKS, ninodeblk - b);
+    rblks(sb.inodestart + b, n, itab + (size_t)b * BSIZE);
+    for (inum = b * IPB; inum < (b + n) * IPB; inum++)
+      icheck(inum, local);
+  }
+  merge(local);
+  return 0;
+}
+
+// Check the pointers of indirect block it, at p.
+static void indcheck(struct item *it, uint *a, struct queue *local) {
+  uint64 span = 1;
+  int i;
+
+  for (i = 1; i < it->level; i++)
+    span *= NINDIRECT;
+  for (i = 0; i < NINDIRECT; i++)
+    ptr(it->inum, a[i], it->fbn + i * span, it->level - 1, local);
+}
+
+// Check the entries in directory block it, at de.
+static void dircheck(struct item *it, struct dirent *de) {
+  uint dir = it->inum, inum, old;
+  uint64 off, size = isize(dinode(dir));
+  int i, k, type;
+
+  for (i = 0; i < BSIZE / sizeof(*de); i++) {
+    off = it->fbn * BSIZE + i * sizeof(*de);
+    if (off >= size)
+      break;
+    if ((inum = de[i].inum) == 0)
+      continue;
+    type = inum < sb.ninodes ? dinode(inum)->type : 0;
+    if (type == 0) {
+      bad(repair, "directory %u: %.14s names free inode %u", dir, de[i].name,
+          inum);
+      if (repair) {
+        pthread_mutex_lock(&lock);
+        if (nfixes == maxfixes) {
+          maxfixes = maxfixes ? maxfixes * 2 : 64;
+          if ((fixes = realloc(fixes, maxfixes * sizeof(*fixes))) == 0)
+            fail("out of memory");
+        }
+        fixes[nfixes].bno = it->bno;
+        fixes[nfixes].fbn = i;
+        nfixes++;
+        pthread_mutex_unlock(&lock);
+      }
+      continue;
+    }
+    if (strncmp(de[i].name, ".", DIRSIZ) == 0) {
+      if (inum != dir)
+        bad(0, "directory %u: . names %u", dir, inum);
+      continue;
+    }
+    if (strncmp(de[i].name, "..", DIRSIZ) == 0) {
+      dotdot[dir] = inum;
+      if (inum != dir) // the root's is not counted
+        __sync_fetch_and_add(&nrefs[inum], 1);
+      continue;
+    }
+    if (de[i].name[0] == 0)
+      bad(0, "directory %u: entry %d for inode %u has no name", dir,
+          (int)(off / sizeof(*de)), inum);
+    // /.snap/<name> is snapshot name, not a link to the root
+    if ((sb.flags & FS_SNAP) && dir == sb.snapdir && inum == ROOTINO) {
+      for (k = 0; k < NSNAP; k++)
+        if (snaps[k].state == SNAP_LIVE &&
+            strncmp(snaps[k].name, de[i].name, DIRSIZ) == 0)
+          break;
+      if (k == NSNAP)
+        bad(0, "/.snap: %.14s is no snapshot", de[i].name);
+      else
+        snapseen[k] = 1;
+      continue;
+    }
+    __sync_fetch_and_add(&nrefs[inum], 1);
+    if (type == T_DIR &&
+        (old = __sync_val_compare_and_swap(&parent[inum], 0, dir)) != 0)
+      bad(0, "directory %u: in directories %u and %u", inum, old, dir);
+  }
+}
+
+// Read the blocks of the runs of level cur, and check them.
+static void *bscan(void *arg) {
+  struct queue local[NLEVEL + 1];
+  struct item *it;
+  struct run *r;
+  char *buf = alloc(RUN), *p;
+  uint k, i;
+
+  memset(local, 0, sizeof(local));
+  while ((k = __sync_fetch_and_add(&next, 1)) < nruns) {
+    r = &runs[k];
+    rraw(r->first, r->n, buf);
+    for (i = r->i; i < r->j; i++) {
+      it = &q[cur].v[i];
+      p = buf + (size_t)(it->bno - r->first) * BSIZE;
+      decrypt(it->bno, p);
+      if (it->level > 0)
+        indcheck(it, (uint *)p, local);
+      else
+        dircheck(it, (struct dirent *)p);
+    }
+  }
+  merge(local);
+  free(buf);
+  return 0;
+}
+
+static int itemcmp(const void *a, const void *b) {
+  uint x = ((struct item *)a)->bno, y = ((struct item *)b)->bno;
+  return x < y ? -1 : x > y;
+}
+
+// Read and check the blocks of level l, sorted, in runs of blocks
+// close to each other.
+static void level(int l) {
+  struct queue *qu = &q[l];
+  uint i, j;
+
+  cur = l;
+  qsort(qu->v, qu->n, sizeof(struct item), itemcmp);
+  runs = alloc(qu->n * sizeof(struct run));
+  for (nruns = 0, i = 0; i < qu->n; i = j, nruns++) {
+    for (j = i + 1; j < qu->n && qu->v[j].bno - qu->v[i].bno < RUNBLKS &&
+                    qu->v[j].bno - qu->v[j - 1].bno <= GAP;
+         j++)
+      ;
+    runs[nruns].first = qu->v[i].bno;
+    runs[nruns].n = qu->v[j - 1].bno - qu->v[i].bno + 1;
+    runs[nruns].i = i;
+    runs[nruns].j = j;
+  }
+  parallel(bscan);
+  free(runs);
+}
+
+// Read the super block, and check the disk layout it describes.
+static void readsb(const char *keyfile) {
+  uchar key[XTSKEYLEN];
+  char check[sizeof(sb.keycheck)];
+  uint n;
+  off_t len;
+
+  if (pread(fsfd, &sb, sizeof(sb), SBOFF) != sizeof(sb))
+    fail("can't read the super block");
+  if (sb.magic != FSMAGIC)
+    fail("bad magic %#x: not a file system", sb.magic);
+  if (sb.bsize != 0)
+    bsize = sb.bsize;
+  if (bsize < DEFBSIZE || bsize > MAXBSIZE || (bsize & (bsize - 1)) != 0)
+    fail("bad block size %u", bsize);
+  if (sb.flags & ~(FS_64BIT | FS_COMPRESS | FS_ENCRYPT | FS_DEDUP | FS_SNAP |
+                   FS_REFLINK))
+    fail("unknown format flags %#x", sb.flags);
+  if ((len = lseek(fsfd, 0, SEEK_END)) < (off_t)sb.size * BSIZE)
+    fail("image of %lld bytes, %u blocks of %u wanted", (long long)len,
+         sb.size, bsize);
+
+  if (sb.flags & FS_ENCRYPT) {
+    if (keyfile == 0)
+      fail("encrypted image: give its key with -k");
+    if (xts_loadkey(keyfile, key) < 0)
+      fail("can't read key %s", keyfile);
+    xts_setkey(key);
+    memset(check, 0, sizeof(check));
+    xts_encrypt(KEYCHECK, check, check, sizeof(check));
+    if (memcmp(check, sb.keycheck, sizeof(check)) != 0)
+      fail("wrong key");
+    keyed = 1;
+  }
+
+  if (sb.flags & FS_64BIT) {
+    ndirect = NDIRECT64;
+    nlevel = 3;
+    maxfile = MAXFILE64;
+  } else {
+    maxfile = min(MAXFILE, 0xFFFFFFFF / BSIZE); // 32-bit file size
+  }
+  maxfile = min(maxfile, 0xFFFFFFFF);
+  if (sb.flags & FS_COMPRESS) {
+    if (CLUSTER / BSIZE < 2)
+      fail("block size %u too big for compression", bsize);
+    nclblk = CLUSTER / BSIZE;
+  }
+  fsref = (sb.flags & (FS_DEDUP | FS_REFLINK)) != 0;
+
+  // the layout mkfs makes
+  ninodeblk = sb.ninodes / IPB;
+  nbmap = sb.size / BPB + 1;
+  if (sb.logstart != SBBLOCK + 1 || sb.nlog < NLOG ||
+      sb.inodestart != sb.logstart + sb.nlog || sb.ninodes % IPB != 0 ||
+      sb.ninodes <= ROOTINO || sb.bmapstart != sb.inodestart + ninodeblk)
+    fail("bad super block: log, inodes or bitmap misplaced");
+  n = sb.bmapstart + nbmap;
+  if (sb.flags & (FS_DEDUP | FS_SNAP | FS_REFLINK)) {
+    if (sb.refstart != n)
+      fail("bad super block: refcounts misplaced");
+    nref = sb.size / BSIZE + 1;
+    n += nref;
+  }
+  if (sb.flags & FS_DEDUP) {
+    if (sb.idxstart != n || sb.nidx != sb.size / DDPB + 1)
+      fail("bad super block: fingerprint index misplaced");
+    n += sb.nidx;
+  }
+  if (sb.flags & FS_SNAP) {
+    nsave = sb.size / BPB + 1 + ninodeblk;
+    if (sb.snapstart != n || sb.savestart != n + 1 ||
+        sb.copystart != sb.savestart + nsave / SPB + 1 ||
+        sb.ncopy != NSNAP * (nbmap + ninodeblk) || sb.snapdir <= ROOTINO ||
+        sb.snapdir >= sb.ninodes)
+      fail("bad super block: snapshot area misplaced");
+    n = sb.copystart + sb.ncopy;
+  }
+  if (n >= sb.size || sb.ndata != sb.size - n)
+    fail("bad super block: %u data blocks from %u, of %u", sb.ndata, n,
+         sb.size);
+  datastart = n;
+  if (sb.norphan > NORPHAN)
+    fail("bad super block: %u orphans", sb.norphan);
+}
+
+// Write the super block.
+static void writesb(void) {
+  char *buf = alloc(BSIZE);
+
+  rraw(SBBLOCK, 1, buf);
+  memcpy(buf + SBOFF % BSIZE, &sb, sizeof(sb));
+  wblks(SBBLOCK, 1, buf);
+  free(buf);
+}
+
+// Check the log. A committed transaction not yet installed is
+// installed with -y, as mounting the image would. Returns 0, or -1 if
+// the image cannot be checked as it is.
+static int checklog(void) {
+  struct logheader *lh;
+  char *buf = alloc(BSIZE), *blk = alloc(BSIZE);
+  int i, r = 0;
+
+  rblks(sb.logstart, 1, buf);
+  lh = (struct logheader *)buf;
+  if (lh->n == 0)
+    goto out;
+  for (i = 0; i < lh->n && lh->n < sb.nlog; i++)
+    if ((uint)lh->block[i] < SBBLOCK || (uint)lh->block[i] >= sb.size)
+      break;
+  if (lh->n < 0 || lh->n >= sb.nlog || i < lh->n) {
+    bad(repair, "log: bad header");
+    if (!repair)
+      r = -1;
+  } else if (!repair) {
+    printf("log: %d blocks committed, not installed\n", lh->n);
+    r = -1;
+    goto out;
+  } else {
+    printf("log: installing %d committed blocks\n", lh->n);
+    for (i = 0; i < lh->n; i++) {
+      rblks(sb.logstart + 1 + i, 1, blk);
+      wblks(lh->block[i], 1, blk);
+    }
+  }
+  if (repair) {
+    memset(buf, 0, BSIZE);
+    wblks(sb.logstart, 1, buf);
+  }
+out:
+  free(buf);
+  free(blk);
+  return r;
+}
+
+// Check the snapshot table and the save table, and count the
+// references to each copy into claims.
+static void checksnap(void) {
+  char *buf = alloc(BSIZE);
+  uint i, c;
+  int k;
+
+  rblks(sb.snapstart, 1, buf);
+  memcpy(snaps, buf, sizeof(snaps));
+  free(buf);
+  for (k = 0; k < NSNAP; k++) {
+    if (snaps[k].state > SNAP_DELETING)
+      bad(0, "snapshot %d: state %d", k, snaps[k].state);
+    else if (snaps[k].state != SNAP_FREE)
+      nsnap++;
+  }
+  for (i = 0; i < nsave; i++) {
+    for (k = 0; k < NSNAP; k++) {
+      if ((c = save[i].copy[k]) == 0)
+        continue;
+      if (snaps[k].state == SNAP_FREE)
+        bad(0, "save table: entry %u for snapshot %d, which is free", i, k);
+      else if (c < sb.copystart || c >= sb.copystart + sb.ncopy)
+        bad(0, "save table: entry %u: copy %u out of range", i, c);
+      else
+        claims[c]++;
+    }
+  }
+}
+
+// Check the link count of each inode against the directory entries
+// naming it, and the orphan list. An inode in no directory goes on the
+// orphan list with -y, for the next mount to free.
+static void checkinodes(void) {
+  struct dinode *dip;
+  uint inum, want;
+  int i, linked;
+
+  for (i = 0; i < sb.norphan; i++) {
+    inum = sb.orphan[i];
+    if (inum > ROOTINO && inum < sb.ninodes && dinode(inum)->type != 0 &&
+        !onlist[inum]) {
+      onlist[inum] = 1;
+      continue;
+    }
+    bad(repair, "orphan list: inode %u", inum);
+    if (repair) {
+      sb.orphan[i--] = sb.orphan[--sb.norphan];
+      sbdirty = 1;
+    }
+  }
+
+  if (dinode(ROOTINO)->type != T_DIR)
+    bad(0, "inode %u: the root, not a directory", ROOTINO);
+  if ((sb.flags & FS_SNAP) && dinode(sb.snapdir)->type != T_DIR)
+    bad(0, "inode %u: /.snap, not a directory", sb.snapdir);
+
+  for (inum = ROOTINO; inum < sb.ninodes; inum++) {
+    dip = dinode(inum);
+    if (dip->type == 0)
+      continue;
+    want = nrefs[inum] + (inum == ROOTINO); // the root has no parent
+    // a directory is in no directory if none names it, whatever the
+    // ".." of its subdirectories say
+    linked = dip->type == T_DIR ? inum == ROOTINO || parent[inum] != 0
+                                : want > 0;
+    if (dip->type == T_DIR && linked && dotdot[inum] == 0)
+      bad(0, "directory %u: no ..", inum);
+    else if (dip->type == T_DIR && linked &&
+             dotdot[inum] != (inum == ROOTINO ? ROOTINO : parent[inum]))
+      bad(0, "directory %u: .. names %u, in directory %u", inum,
+          dotdot[inum], parent[inum]);
+    if (!linked && dip->nlink == 0 && onlist[inum])
+      continue; // being freed
+    if (!linked) {
+      bad(repair && sb.norphan < NORPHAN, "inode %u: in no directory, nlink %d",
+          inum, dip->nlink);
+      if (repair && sb.norphan < NORPHAN) {
+        dip->nlink = 0;
+        idirt(inum);
+        if (!onlist[inum]) {
+          sb.orphan[sb.norphan++] = inum;
+          sbdirty = 1;
+        }
+      }
+    } else if (dip->nlink != want) {
+      bad(repair, "inode %u: nlink %d, should be %u", inum, dip->nlink,
+          want);
+      if (repair) {
+        dip->nlink = want;
+        idirt(inum);
+      }
+    }
+  }
+}
+
+// Report the bitmap errors of blocks [first, b), all of one kind:
+// 1 in use and marked free, 2 the other way around.
+static void badbits(uint first, uint b, int kind) {
+  static const char *what[] = {"", "in use, marked free",
+                               "marked in use, not in use"};
+
+  if (kind == 0)
+    return;
+  if (b - first == 1)
+    bad(repair, "block %u: %s", first, what[kind]);
+  else
+    bad(repair, "blocks %u-%u: %s", first, b - 1, what[kind]);
+}
+
+// Check the bitmap against the blocks claimed, and the refcounts
+// against the pointers to each block (or with FS_SNAP, to each copy).
+static void checkblocks(void) {
+  uint b, c, r, want, first = 0;
+  int k, kind, last = 0;
+
+  for (b = 0; b < sb.size; b++) {
+    c = claims[b];
+    r = nref ? refs[b] : 0;
+    kind = 0;
+    if (!isset(bmap, b) && (b < datastart || c > 0))
+      kind = 1;
+    else if (isset(bmap, b) && b >= datastart && c == 0 &&
+             !(fsref && r == MAXREF)) // kept for good
+      kind = 2;
+    if (kind != last) {
+      badbits(first, b, last); // a run of errors ends
+      first = b;
+      last = kind;
+    }
+    if (kind && repair) {
+      bmap[b / 8] ^= 1 << (b % 8);
+      bdirty = 1;
+    }
+
+    if (nref == 0)
+      continue;
+    if ((sb.flags & FS_SNAP) && b >= sb.copystart && b < datastart)
+      want = c; // the snapshots seeing the copy
+    else if (fsref && b >= datastart && r == MAXREF)
+      continue; // too many to count
+    else if (fsref && b >= datastart)
+      want = c > 1 ? min(c, MAXREF) : r <= 1 ? r : 0; // 0 or 1 for one
+    else
+      want = 0;
+    if (r != want) {
+      bad(repair, "block %u: refcount %u, should be %u", b, r, want);
+      if (repair) {
+        refs[b] = want;
+        rdirty = 1;
+      }
+    }
+  }
+
+  badbits(first, b, last);
+
+  if (!fsref)
+    for (b = datastart; b < sb.size; b++)
+      if (claims[b] > 1)
+        bad(0, "block %u: in %u places", b, claims[b]);
+  for (k = 0; k < NSNAP; k++)
+    if (snaps[k].state == SNAP_LIVE && !snapseen[k])
+      bad(0, "snapshot %.14s: not in /.snap", snaps[k].name);
+}
+
+// Write what -y repaired.
+static void writeback(void) {
+  char *buf = alloc(BSIZE);
+  struct dirent *de;
+  uint b;
+  int i;
+
+  for (b = 0; b < ninodeblk; b++)
+    if (idirty[b])
+      wblks(sb.inodestart + b, 1, itab + (size_t)b * BSIZE);
+  if (bdirty)
+    wblks(sb.bmapstart, nbmap, (char *)bmap);
+  if (rdirty)
+    wblks(sb.refstart, nref, (char *)refs);
+  for (i = 0; i < nfixes; i++) {
+    rblks(fixes[i].bno, 1, buf);
+    de = (struct dirent *)buf + fixes[i].fbn;
+    memset(de, 0, sizeof(*de));
+    wblks(fixes[i].bno, 1, buf);
+  }
+  if (sbdirty)
+    writesb();
+  fsync(fsfd);
+  free(buf);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  char *keyfile = 0;
+  uint b, ndir = 0, nfile = 0, nused = 0;
+  double t = now();
+  int opt, l;
+
+  nthread = min(sysconf(_SC_NPROCESSORS_ONLN), MAXTHREAD);
+  while ((opt = getopt(argc, argv, "yj:k:")) != -1) {
+    if (opt == 'y')
+      repair = 1;
+    else if (opt == 'j' && (nthread = atoi(optarg)) > 0 &&
+             nthread <= MAXTHREAD)
+      ;
+    else if (opt == 'k')
+      keyfile = optarg;
+    else
+      usage();
+  }
+  if (argc - optind != 1)
+    usage();
+  if (nthread < 1)
+    nthread = 1;
+  if ((fsfd = open(argv[optind], repair ? O_RDWR : O_RDONLY)) < 0)
+    fail("can't open %s", argv[optind]);
+
+  readsb(keyfile);
+  if (checklog() < 0) {
+    printf("fsck: mount the image, or run fsck -y, to install the log\n");
+    exit(FSCK_ERRORS);
+  }
+  readsb(keyfile); // the log may have held a newer one
+
+  itab = alloc((size_t)ninodeblk * BSIZE);
+  bmap = alloc((size_t)nbmap * BSIZE);
+  claims = alloc((size_t)sb.size * sizeof(uint));
+  nrefs = alloc((size_t)sb.ninodes * sizeof(uint));
+  parent = alloc((size_t)sb.ninodes * sizeof(uint));
+  dotdot = alloc((size_t)sb.ninodes * sizeof(uint));
+  onlist = alloc(sb.ninodes);
+  idirty = alloc(ninodeblk);
+  rblks(sb.bmapstart, nbmap, (char *)bmap);
+  if (nref) {
+    refs = alloc((size_t)nref * BSIZE);
+    rblks(sb.refstart, nref, (char *)refs);
+  }
+  if (sb.flags & FS_SNAP) {
+    save = alloc((size_t)(nsave / SPB + 1) * BSIZE);
+    rblks(sb.savestart, nsave / SPB + 1, (char *)save);
+    checksnap();
+    if (repair && nsnap > 0) {
+      printf("fsck: snapshots see the bitmap and inodes as they are: "
+             "checking only\n");
+      repair = 0;
+    }
+  }
+  for (l = 0; l < sb.norphan; l++)
+    if (sb.orphan[l] < sb.ninodes)
+      onlist[sb.orphan[l]] = 1;
+
+  // the inodes, then the indirect blocks a level at a time, then the
+  // directory blocks
+  parallel(iscan);
+  for (l = nlevel; l >= 0; l--)
+    level(l);
+
+  memset(onlist, 0, sb.ninodes); // checkinodes() checks the list
+  checkinodes();
+  checkblocks();
+  if (repair)
+    writeback();
+
+  for (b = ROOTINO; b < sb.ninodes; b++) {
+    ndir += dinode(b)->type == T_DIR;
+    nfile += dinode(b)->type == T_FILE;
+  }
+  for (b = 0; b < sb.size; b++)
+    nused += isset(bmap, b);
+  printf("fsck: %u dirs, %u files, %u/%u blocks, %d errors, %d fixed, "
+         "%.3f s\n",
+         ndir, nfile, nused, sb.size, nerr, nfixed, now() - t);
+  if (nerr == 0)
+    return FSCK_OK;
+  return nerr == nfixed ? FSCK_FIXED : FSCK_ERRORS;
+}
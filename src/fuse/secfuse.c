@@ -0,0 +1,711 @@
+// secfuse: serves an image to the host through FUSE, so it can be
+// mounted and driven with standard tools (fio, cp, tar ...). It speaks
+// the kernel protocol (linux/fuse.h) on /dev/fuse itself, with a pool
+// of threads each reading requests from its own clone of the device,
+// and answers them with the ff*() calls.
+//
+// The kernel names files by node id; ours is the inode no, with the
+// snapshot slot in the high half, so the root is FUSE_ROOT_ID. The
+// ff*() calls take paths, so the node table keeps a path for each
+// node the kernel has looked up and not yet forgotten.
+#include "../defs.h"
+#include "../buf.h"
+#include "../fcntl.h"
+#include "../file.h"
+#include "../fs.h"
+#include <errno.h>
+#include <linux/fuse.h>
+#include <linux/mount.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define MAXWRITE (1024 * 1024)    // largest read or write request
+#define BUFSIZE (MAXWRITE + 8192) // a request, or a reply
+#define MAXTHREAD 8 // threads serving requests: each holds up to two
+                    // of the NINODE in-memory inodes, besides open files
+#define NHASH 1024                // node table buckets
+#define NGROW 64                  // locks of writes that grow files
+#define TIMEOUT 60                // s the kernel may cache names, attrs
+
+// Host file modes and mount calls: sys/stat.h and sys/mount.h would
+// bring in the host's struct stat, which clashes with file.h's.
+#define MODE_DIR 0040000
+#define MODE_REG 0100000
+#define MODE_CHR 0020000
+#define MNT_DETACH 2
+int mount(const char *src, const char *dst, const char *type,
+          unsigned long flags, const void *data);
+int umount2(const char *dst, int flags);
+
+// A node the kernel knows.
+struct node {
+  uint64 id;      // snapshot slot + 1 << 32 | inum
+  uint64 nlookup; // lookups the kernel has not forgotten
+  char *path;     // a path of it
+  struct node *next;
+};
+
+static struct node *nodes[NHASH];
+static pthread_mutex_t nodelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t growlock[NGROW];
+static char zeros[64 * 1024];
+
+static struct secfs *fs;
+static char *mnt;           // mount point
+static int devfd;           // /dev/fuse, as mounted
+static int writeback = 1;   // let the kernel cache writes
+static volatile int served; // DESTROY came
+
+static void usage(void) {
+  printf("Usage: secfuse [-o data=journal|data=ordered|sync] [-k keyfile] "
+         "[-j threads] fs.img mountpoint\n");
+  exit(1);
+}
+
+static struct node **nodeslot(uint64 id) {
+  struct node **np;
+
+  for (np = &nodes[id % NHASH]; *np && (*np)->id != id; np = &(*np)->next)
+    ;
+  return np;
+}
+
+// The kernel looked up node id as path.
+static void nodeget(uint64 id, const char *path) {
+  struct node **np, *n;
+
+  pthread_mutex_lock(&nodelock);
+  if ((n = *nodeslot(id)) == 0) {
+    if ((n = calloc(1, sizeof(*n))) == 0) {
+      printf("panic: nodeget: out of memory");
+      exit(1);
+    }
+    n->id = id;
+    np = &nodes[id % NHASH];
+    n->next = *np;
+    *np = n;
+  }
+  if (n->path == 0 || strcmp(n->path, path)) {
+    free(n->path);
+    n->path = strdup(path);
+  }
+  n->nlookup++;
+  pthread_mutex_unlock(&nodelock);
+}
+
+// The kernel forgot k lookups of node id.
+static void nodeforget(uint64 id, uint64 k) {
+  struct node **np, *n;
+
+  if (id == FUSE_ROOT_ID)
+    return;
+  pthread_mutex_lock(&nodelock);
+  np = nodeslot(id);
+  if ((n = *np) != 0)
+    n->nlookup = k < n->nlookup ? n->nlookup - k : 0;
+  if (n && n->nlookup == 0) {
+    *np = n->next;
+    free(n->path);
+    free(n);
+  }
+  pthread_mutex_unlock(&nodelock);
+}
+
+// Point the nodes at path old to new.
+static void noderename(const char *old, const char *new) {
+  struct node *n;
+  int i;
+
+  pthread_mutex_lock(&nodelock);
+  for (i = 0; i < NHASH; i++)
+    for (n = nodes[i]; n; n = n->next)
+      if (!strcmp(n->path, old)) {
+        free(n->path);
+        n->path = strdup(new);
+      }
+  pthread_mutex_unlock(&nodelock);
+}
+
+// Copy the path of node id to path[MAXPATH]. Returns 0 or -errno.
+static int nodepath(uint64 id, char *path) {
+  struct node *n;
+
+  if (id == FUSE_ROOT_ID) {
+    strcpy(path, "/");
+    return 0;
+  }
+  pthread_mutex_lock(&nodelock);
+  if ((n = *nodeslot(id)) != 0)
+    strcpy(path, n->path);
+  pthread_mutex_unlock(&nodelock);
+  return n ? 0 : -ESTALE;
+}
+
+// Copy the path of name in directory node id to path[MAXPATH].
+static int childpath(uint64 id, const char *name, char *path) {
+  int r, n;
+
+  if ((r = nodepath(id, path)) < 0)
+    return r;
+  n = strlen(path);
+  if (strlen(name) > DIRSIZ || n + 1 + strlen(name) >= MAXPATH)
+    return -ENAMETOOLONG;
+  if (n > 1)
+    path[n++] = '/';
+  strcpy(path + n, name);
+  return 0;
+}
+
+static void fillattr(struct inode *ip, struct fuse_attr *a) {
+  int ro = ireadonly(ip);
+
+  memset(a, 0, sizeof(*a));
+  a->ino = (uint64)ip->snap << 32 | ip->inum;
+  a->size = ip->size;
+  a->blocks = (ip->size + 511) / 512;
+  a->nlink = ip->nlink;
+  a->uid = getuid();
+  a->gid = getgid();
+  a->blksize = BSIZE;
+  if (ip->type == T_DIR)
+    a->mode = MODE_DIR | (ro ? 0555 : 0755);
+  else if (ip->type == T_DEVICE)
+    a->mode = MODE_CHR | 0666;
+  else
+    a->mode = MODE_REG | (ro ? 0444 : 0644);
+}
+
+// Fill in an entry for ip, found at path, and count the lookup.
+static void fillentry(struct inode *ip, const char *path,
+                      struct fuse_entry_out *e) {
+  memset(e, 0, sizeof(*e));
+  fillattr(ip, &e->attr);
+  e->nodeid = e->attr.ino;
+  e->entry_valid = e->attr_valid = TIMEOUT;
+  nodeget(e->nodeid, path);
+}
+
+// Fill in the attributes of path. Returns 0 or -ENOENT.
+static int statpath(const char *path, struct fuse_attr *a) {
+  char p[MAXPATH];
+  struct inode *ip;
+
+  strcpy(p, path);
+  begin_op();
+  if ((ip = namei(p)) == 0) {
+    end_op();
+    return -ENOENT;
+  }
+  ilock(ip);
+  fillattr(ip, a);
+  iunlockput(ip);
+  end_op();
+  return 0;
+}
+
+// Look up name in directory node id, with dirlookup().
+static int dolookup(uint64 id, const char *name, struct fuse_entry_out *e) {
+  char path[MAXPATH], dpath[MAXPATH];
+  struct inode *dp, *ip;
+  int r;
+
+  if ((r = childpath(id, name, path)) < 0 || (r = nodepath(id, dpath)) < 0)
+    return r;
+  begin_op();
+  if ((dp = namei(dpath)) == 0) {
+    end_op();
+    return -ENOENT;
+  }
+  ilock(dp);
+  if (dp->type != T_DIR || (ip = dirlookup(dp, (char *)name, 0)) == 0) {
+    r = dp->type != T_DIR ? -ENOTDIR : -ENOENT;
+    iunlockput(dp);
+    end_op();
+    return r;
+  }
+  iunlockput(dp);
+  ilock(ip);
+  fillentry(ip, path, e);
+  iunlockput(ip);
+  end_op();
+  return sizeof(*e);
+}
+
+// The errno for an ff*() call on path that failed, as they do not
+// tell why: ENOENT if path is not there, else err.
+static int failed(const char *path, int err) {
+  struct fuse_attr a;
+
+  return statpath(path, &a) < 0 ? -ENOENT : -err;
+}
+
+// Open path for the kernel: regular files read-write when the kernel
+// caches writes, as it may then read through a write-only open.
+static int openpath(const char *path, int flags, int create) {
+  struct fuse_attr a;
+  int fd, mode = flags & 3;
+
+  if (writeback && mode == O_WRONLY)
+    mode = O_RDWR;
+  fd = ffopen(path, mode | (create ? O_CREATE : 0));
+  if (fd >= 0 || create)
+    return fd >= 0 ? fd : failed(path, EACCES);
+  if (statpath(path, &a) < 0)
+    return -ENOENT;
+  return mode != O_RDONLY && !(a.mode & 0200) ? -EROFS : -EMFILE;
+}
+
+// Count the free blocks and inodes from the bitmap and inode blocks.
+static int dostatfs(struct fuse_kstatfs *st) {
+  struct superblock *sb = curfs->super;
+  struct dinode *dip;
+  struct buf *bp;
+  uint b, i, used = 0, iused = 0;
+
+  for (b = 0; b < sb->size; b += BPB) {
+    bp = bread(curfs->dev, BBLOCK(b, (*sb)));
+    for (i = 0; i < BPB && b + i < sb->size; i += 8)
+      used += __builtin_popcount(bp->data[i / 8]);
+    brelse(bp);
+  }
+  for (i = 0; i < sb->ninodes; i += IPB) {
+    bp = bread(curfs->dev, IBLOCK(i, (*sb)));
+    for (dip = (struct dinode *)bp->data;
+         dip < (struct dinode *)bp->data + IPB; dip++)
+      iused += dip->type != 0;
+    brelse(bp);
+  }
+  memset(st, 0, sizeof(*st));
+  st->blocks = sb->size;
+  st->bfree = st->bavail = sb->size - used;
+  st->files = sb->ninodes;
+  st->ffree = sb->ninodes - iused;
+  st->bsize = st->frsize = BSIZE;
+  st->namelen = DIRSIZ;
+  return sizeof(struct fuse_statfs_out);
+}
+
+// Fill out with the entries of directory fd from byte offset off on,
+// at most size bytes of them.
+static int doreaddir(int fd, uint64 off, uint size, char *out) {
+  struct dirent de[64];
+  struct fuse_dirent *d;
+  int n, i, len = 0, k;
+
+  if (size > BUFSIZE)
+    size = BUFSIZE;
+  while ((n = ffpread(fd, de, sizeof(de), off)) >= (int)sizeof(de[0])) {
+    for (i = 0; i < n / (int)sizeof(de[0]); i++, off += sizeof(de[0])) {
+      if (de[i].inum == 0)
+        continue;
+      k = strnlen(de[i].name, DIRSIZ);
+      if (len + FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + k) > size)
+        return len;
+      d = (struct fuse_dirent *)(out + len);
+      d->ino = de[i].inum;
+      d->off = off + sizeof(de[0]);
+      d->namelen = k;
+      d->type = 0; // unknown: the kernel asks
+      memcpy(d->name, de[i].name, k);
+      memset(d->name + k, 0, FUSE_DIRENT_ALIGN(k) - k);
+      len += FUSE_DIRENT_SIZE(d);
+    }
+  }
+  return n < 0 ? -EBADF : len;
+}
+
+// Write n bytes at off to fd. Files have no holes, and the kernel
+// may write cached pages back in any order, so a write past the end
+// first fills the gap with zeros. Writes that grow a file do it under
+// a lock of the file, so that a gap is never filled over one of them.
+static int dowrite(int fd, void *p, int n, uint64 off) {
+  pthread_mutex_t *lk = 0;
+  struct stat st;
+  uint64 end;
+  int r, k;
+
+  if (ffstat(fd, &st) < 0)
+    return -EBADF;
+  if (off + n > st.size) {
+    lk = &growlock[st.ino % NGROW];
+    pthread_mutex_lock(lk);
+    ffstat(fd, &st);
+  }
+  for (end = st.size; end < off; end += k) {
+    k = off - end < sizeof(zeros) ? off - end : sizeof(zeros);
+    if (ffpwrite(fd, zeros, k, end) != k)
+      break;
+  }
+  r = end < off ? -1 : ffpwrite(fd, p, n, off);
+  if (lk)
+    pthread_mutex_unlock(lk);
+  return r < 0 ? -ENOSPC : r;
+}
+
+// Truncate or extend path, open as fd or not (fd -1), to size bytes.
+// Files can only shrink to 0.
+static int doresize(const char *path, int fd, uint64 size, uint64 cur) {
+  int r = 0, mine = fd < 0;
+
+  if (size == cur)
+    return 0;
+  if (size != 0 && size < cur)
+    return -EOPNOTSUPP;
+  if (size == 0)
+    fd = ffopen(path, O_WRONLY | O_TRUNC);
+  else if (mine)
+    fd = ffopen(path, O_WRONLY);
+  if (fd < 0)
+    return failed(path, EACCES);
+  if (size > 0)
+    r = dowrite(fd, "", 1, size - 1);
+  if (size == 0 || mine)
+    ffclose(fd);
+  return r < 0 ? r : 0;
+}
+
+// Rename a file as link and unlink; the kernel asks to move a
+// directory as a copy, as link() cannot link directories.
+static int dorename(uint64 id, const char *name, uint64 newid,
+                    const char *newname) {
+  char old[MAXPATH], new[MAXPATH];
+  struct fuse_attr a, na;
+  int r;
+
+  if ((r = childpath(id, name, old)) < 0 ||
+      (r = childpath(newid, newname, new)) < 0)
+    return r;
+  if ((r = statpath(old, &a)) < 0)
+    return r;
+  if ((a.mode & MODE_DIR) == MODE_DIR)
+    return -EXDEV;
+  if (!strcmp(old, new))
+    return 0;
+  if (statpath(new, &na) == 0) {
+    if ((na.mode & MODE_DIR) == MODE_DIR)
+      return -EISDIR;
+    if (ffunlink(new) < 0)
+      return -EACCES;
+  }
+  if (fflink(old, new) < 0)
+    return failed(new, EACCES);
+  if (ffunlink(old) < 0) {
+    ffunlink(new);
+    return -EACCES;
+  }
+  noderename(old, new);
+  return 0;
+}
+
+// Handle request h with arguments arg. Put the reply in out, and
+// return its length, -errno, or 1 if it gets no reply.
+static int handle(struct fuse_in_header *h, void *arg, char *out) {
+  char path[MAXPATH], *name = arg;
+  uint64 id = h->nodeid;
+  struct fuse_attr a;
+  int r, fd;
+
+  switch (h->opcode) {
+  case FUSE_INIT: {
+    struct fuse_init_in *in = arg;
+    struct fuse_init_out *o = (void *)out;
+
+    if (in->major != FUSE_KERNEL_VERSION || in->minor < 28) {
+      printf("secfuse: kernel FUSE %u.%u is too old\n", in->major,
+             in->minor);
+      return -EPROTO;
+    }
+    memset(o, 0, sizeof(*o));
+    o->major = FUSE_KERNEL_VERSION;
+    o->minor = FUSE_KERNEL_MINOR_VERSION;
+    o->max_readahead = in->max_readahead < MAXWRITE ? in->max_readahead
+                                                    : MAXWRITE;
+    o->flags = in->flags & (FUSE_ASYNC_READ | FUSE_BIG_WRITES |
+                            FUSE_PARALLEL_DIROPS | FUSE_MAX_PAGES |
+                            (writeback ? FUSE_WRITEBACK_CACHE : 0));
+    o->max_background = 64;
+    o->congestion_threshold = 48;
+    o->max_write = MAXWRITE;
+    o->time_gran = 1;
+    o->max_pages = MAXWRITE / 4096;
+    return sizeof(*o);
+  }
+  case FUSE_DESTROY:
+    served = 1;
+    return 0;
+  case FUSE_LOOKUP:
+    return dolookup(id, name, (void *)out);
+  case FUSE_FORGET:
+    nodeforget(id, ((struct fuse_forget_in *)arg)->nlookup);
+    return 1;
+  case FUSE_BATCH_FORGET: {
+    struct fuse_batch_forget_in *in = arg;
+    struct fuse_forget_one *f = (void *)(in + 1);
+    uint i;
+
+    for (i = 0; i < in->count; i++)
+      nodeforget(f[i].nodeid, f[i].nlookup);
+    return 1;
+  }
+  case FUSE_INTERRUPT:
+    return 1; // every call runs to its end
+  case FUSE_GETATTR:
+  case FUSE_SETATTR: {
+    struct fuse_attr_out *o = (void *)out;
+    struct fuse_setattr_in *in = arg;
+
+    if ((r = nodepath(id, path)) < 0 || (r = statpath(path, &a)) < 0)
+      return r;
+    if (h->opcode == FUSE_SETATTR && (in->valid & FATTR_SIZE)) {
+      fd = in->valid & FATTR_FH ? in->fh : -1;
+      if ((r = doresize(path, fd, in->size, a.size)) < 0 ||
+          (r = statpath(path, &a)) < 0)
+        return r;
+    }
+    // modes, owners and times are not kept
+    memset(o, 0, sizeof(*o));
+    o->attr = a;
+    o->attr_valid = TIMEOUT;
+    return sizeof(*o);
+  }
+  case FUSE_MKDIR:
+    name = (char *)((struct fuse_mkdir_in *)arg + 1);
+    if ((r = childpath(id, name, path)) < 0)
+      return r;
+    if (ffmkdir(path) < 0)
+      return statpath(path, &a) == 0 ? -EEXIST : -EACCES;
+    return dolookup(id, name, (void *)out);
+  case FUSE_MKNOD: {
+    struct fuse_mknod_in *in = arg;
+
+    name = (char *)(in + 1);
+    if ((in->mode & 0170000) != MODE_REG)
+      return -EPERM;
+    if ((r = childpath(id, name, path)) < 0)
+      return r;
+    if ((fd = ffopen(path, O_CREATE | O_RDONLY)) < 0)
+      return -EACCES;
+    ffclose(fd);
+    return dolookup(id, name, (void *)out);
+  }
+  case FUSE_CREATE: {
+    struct fuse_create_in *in = arg;
+    struct fuse_open_out *o =
+        (void *)(out + sizeof(struct fuse_entry_out));
+
+    name = (char *)(in + 1);
+    if ((r = childpath(id, name, path)) < 0)
+      return r;
+    if ((fd = openpath(path, in->flags, 1)) < 0)
+      return fd;
+    if ((r = dolookup(id, name, (void *)out)) < 0) {
+      ffclose(fd);
+      return r;
+    }
+    memset(o, 0, sizeof(*o));
+    o->fh = fd;
+    o->open_flags = FOPEN_KEEP_CACHE;
+    return sizeof(struct fuse_entry_out) + sizeof(*o);
+  }
+  case FUSE_UNLINK:
+  case FUSE_RMDIR:
+    if ((r = childpath(id, name, path)) < 0 || (r = statpath(path, &a)) < 0)
+      return r;
+    if (h->opcode == FUSE_UNLINK && (a.mode & MODE_DIR) == MODE_DIR)
+      return -EISDIR;
+    if (h->opcode == FUSE_RMDIR && (a.mode & MODE_DIR) != MODE_DIR)
+      return -ENOTDIR;
+    if (ffunlink(path) < 0)
+      return h->opcode == FUSE_RMDIR ? -ENOTEMPTY : -EACCES;
+    return 0;
+  case FUSE_RENAME: {
+    struct fuse_rename_in *in = arg;
+
+    name = (char *)(in + 1);
+    return dorename(id, name, in->newdir, name + strlen(name) + 1);
+  }
+  case FUSE_RENAME2: {
+    struct fuse_rename2_in *in = arg;
+
+    name = (char *)(in + 1);
+    if (in->flags)
+      return -EINVAL;
+    return dorename(id, name, in->newdir, name + strlen(name) + 1);
+  }
+  case FUSE_LINK: {
+    struct fuse_link_in *in = arg;
+    char old[MAXPATH];
+
+    name = (char *)(in + 1);
+    if ((r = nodepath(in->oldnodeid, old)) < 0 ||
+        (r = childpath(id, name, path)) < 0)
+      return r;
+    if (fflink(old, path) < 0)
+      return statpath(path, &a) == 0 ? -EEXIST : -EPERM;
+    return dolookup(id, name, (void *)out);
+  }
+  case FUSE_OPEN:
+  case FUSE_OPENDIR: {
+    struct fuse_open_out *o = (void *)out;
+
+    if ((r = nodepath(id, path)) < 0)
+      return r;
+    if (h->opcode == FUSE_OPENDIR && (fd = ffopen(path, O_RDONLY)) < 0)
+      fd = failed(path, EMFILE);
+    else if (h->opcode == FUSE_OPEN)
+      fd = openpath(path, ((struct fuse_open_in *)arg)->flags, 0);
+    if (fd < 0)
+      return fd;
+    memset(o, 0, sizeof(*o));
+    o->fh = fd;
+    o->open_flags = h->opcode == FUSE_OPEN ? FOPEN_KEEP_CACHE : 0;
+    return sizeof(*o);
+  }
+  case FUSE_READ: {
+    struct fuse_read_in *in = arg;
+
+    r = ffpread(in->fh, out, in->size < MAXWRITE ? in->size : MAXWRITE,
+                in->offset);
+    return r < 0 ? -EBADF : r;
+  }
+  case FUSE_WRITE: {
+    struct fuse_write_in *in = arg;
+    struct fuse_write_out *o = (void *)out;
+
+    if ((r = dowrite(in->fh, in + 1, in->size, in->offset)) < 0)
+      return r;
+    memset(o, 0, sizeof(*o));
+    o->size = r;
+    return sizeof(*o);
+  }
+  case FUSE_READDIR: {
+    struct fuse_read_in *in = arg;
+
+    return doreaddir(in->fh, in->offset, in->size, out);
+  }
+  case FUSE_RELEASE:
+  case FUSE_RELEASEDIR:
+    ffclose(((struct fuse_release_in *)arg)->fh);
+    return 0;
+  case FUSE_FLUSH:
+  case FUSE_FSYNCDIR:
+    return 0;
+  case FUSE_FSYNC:
+    return ffsync(((struct fuse_fsync_in *)arg)->fh) < 0 ? -EBADF : 0;
+  case FUSE_STATFS:
+    return dostatfs(&((struct fuse_statfs_out *)out)->st);
+  default:
+    return -ENOSYS;
+  }
+}
+
+// Serve requests from a clone of devfd until the image is unmounted.
+static void *serve(void *arg) {
+  struct fuse_out_header o;
+  struct fuse_in_header *h;
+  struct iovec iov[2];
+  char *in, *out;
+  FILE *dev;
+  int fd = devfd, n;
+
+  secfs_use(fs);
+  if ((in = malloc(BUFSIZE)) == 0 || (out = malloc(BUFSIZE)) == 0) {
+    printf("panic: serve: out of memory");
+    exit(1);
+  }
+  // a clone of its own spreads requests over threads without a
+  // shared queue lock; devfd itself does if cloning is not supported
+  if ((dev = fopen("/dev/fuse", "r+")) != 0 &&
+      ioctl(fileno(dev), FUSE_DEV_IOC_CLONE, &devfd) == 0)
+    fd = fileno(dev);
+
+  h = (void *)in;
+  while (!served) {
+    if ((n = read(fd, in, BUFSIZE)) < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == ENOENT)
+        continue;
+      break; // ENODEV: unmounted
+    }
+    if (n < (int)sizeof(*h))
+      continue;
+    if ((n = handle(h, h + 1, out)) == 1)
+      continue;
+    o.unique = h->unique;
+    o.error = n < 0 ? n : 0;
+    o.len = sizeof(o) + (n > 0 ? n : 0);
+    iov[0].iov_base = &o;
+    iov[0].iov_len = sizeof(o);
+    iov[1].iov_base = out;
+    iov[1].iov_len = n > 0 ? n : 0;
+    writev(fd, iov, n > 0 ? 2 : 1); // ENOENT: interrupted meanwhile
+  }
+
+  if (dev)
+    fclose(dev);
+  free(in);
+  free(out);
+  return 0;
+}
+
+static void stop(int sig) { umount2(mnt, MNT_DETACH); }
+
+int main(int argc, char *argv[]) {
+  int opt, i, nthread = 4, datamode = DATA_JOURNAL, sync = 0;
+  pthread_t th[MAXTHREAD];
+  char *keyfile = 0, opts[256];
+  FILE *dev;
+
+  while ((opt = getopt(argc, argv, "o:k:j:")) != -1) {
+    if (opt == 'o' && !strcmp(optarg, "data=journal"))
+      datamode = DATA_JOURNAL;
+    else if (opt == 'o' && !strcmp(optarg, "data=ordered"))
+      datamode = DATA_ORDERED;
+    else if (opt == 'o' && !strcmp(optarg, "sync"))
+      sync = 1;
+    else if (opt == 'k')
+      keyfile = optarg;
+    else if (opt == 'j' && (nthread = atoi(optarg)) > 0 &&
+             nthread <= MAXTHREAD)
+      ;
+    else
+      usage();
+  }
+  if (argc - optind != 2)
+    usage();
+  mnt = argv[optind + 1];
+  // -o sync writes through: the kernel must not hold writes back
+  writeback = !sync;
+
+  if ((fs = secfs_mount(argv[optind], datamode, sync, keyfile)) == 0) {
+    printf("secfuse: can't mount %s\n", argv[optind]);
+    exit(1);
+  }
+  if ((dev = fopen("/dev/fuse", "r+")) == 0) {
+    printf("secfuse: can't open /dev/fuse\n");
+    exit(1);
+  }
+  devfd = fileno(dev);
+  snprintf(opts, sizeof(opts),
+           "fd=%d,rootmode=40000,user_id=%u,group_id=%u,default_permissions,"
+           "allow_other,max_read=%d",
+           devfd, getuid(), getgid(), MAXWRITE);
+  if (mount("secfs", mnt, "fuse.secfs", MS_NOSUID | MS_NODEV, opts) < 0) {
+    printf("secfuse: can't mount on %s: %s\n", mnt, strerror(errno));
+    exit(1);
+  }
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  for (i = 0; i < NGROW; i++)
+    pthread_mutex_init(&growlock[i], 0);
+  for (i = 0; i < nthread; i++)
+    pthread_create(&th[i], 0, serve, 0);
+  for (i = 0; i < nthread; i++)
+    pthread_join(th[i], 0);
+
+  fclose(dev);
+  secfs_unmount(fs);
+  return 0;
+}
@@ -0,0 +1,15 @@
+#include "../defs.h"
+
+// clone src dst: copy file src to dst, sharing its blocks
+int fclone(char *args[], int arg_cnt) {
+  if (arg_cnt != 3) {
+    printf("Usage: clone src dst\n");
+    return -1;
+  }
+
+  if (ffclone(args[1], args[2]) < 0) {
+    printf("clone: cannot clone %s to %s\n", args[1], args[2]);
+    return -1;
+  }
+  return 0;
+}
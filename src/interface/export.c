@@ -0,0 +1,135 @@
+#include "../defs.h"
+#include "../fcntl.h"
+#include "../file.h"
+#include "../fs.h"
+#include <errno.h>
+#include <unistd.h>
+
+// ffreadv() fills NEXPORTIOV buffers of EXPORTBUF bytes at a call, and
+// writev() hands them all to the host file: a MiB a pair of calls.
+#define EXPORTBUF (256 * 1024)
+#define NEXPORTIOV 4
+
+static int exportpath(char *src, char *dst);
+
+// Copy file src to host file dst, which must not exist yet.
+static int exportfile(char *src, char *dst) {
+  static char buf[NEXPORTIOV][EXPORTBUF];
+  struct iovec iov[NEXPORTIOV];
+  int i, n, fd, hfd, r = 0;
+
+  if ((fd = ffopen(src, O_RDONLY)) < 0) {
+    printf("export: cannot open %s\n", src);
+    return -1;
+  }
+  if ((hfd = hostcreate(dst)) < 0) {
+    printf("export: can't create %s%s\n", dst,
+           errno == EEXIST ? ": file exists" : "");
+    ffclose(fd);
+    return -1;
+  }
+
+  while (r == 0) {
+    for (i = 0; i < NEXPORTIOV; i++) {
+      iov[i].iov_base = buf[i];
+      iov[i].iov_len = EXPORTBUF;
+    }
+    if ((n = ffreadv(fd, iov, NEXPORTIOV)) <= 0) {
+      r = n;
+      break;
+    }
+    // what was read, as the iovecs to write
+    for (i = 0; i < NEXPORTIOV; i++) {
+      iov[i].iov_len = n < EXPORTBUF ? n : EXPORTBUF;
+      n -= iov[i].iov_len;
+    }
+    for (i = 0; r == 0 && i < NEXPORTIOV && iov[i].iov_len > 0;) {
+      if ((n = writev(hfd, iov + i, NEXPORTIOV - i)) <= 0) {
+        r = -1;
+        break;
+      }
+      for (; i < NEXPORTIOV && n >= iov[i].iov_len; n -= iov[i++].iov_len)
+        ;
+      if (n > 0) { // a short write, within iov[i]
+        iov[i].iov_base = (char *)iov[i].iov_base + n;
+        iov[i].iov_len -= n;
+      }
+    }
+  }
+
+  if (r < 0)
+    printf("export: copy error on %s\n", src);
+  ffclose(fd);
+  close(hfd);
+  return r;
+}
+
+// Copy directory src to host directory dst, made if need be, and
+// everything under it.
+static int exportdir(char *src, char *dst) {
+  char s[512], t[512], name[DIRSIZ + 1];
+  struct dirent de;
+  int fd, r = 0;
+
+  if (hostmkdir(dst) < 0) {
+    printf("export: can't create %s\n", dst);
+    return -1;
+  }
+  if ((fd = ffopen(src, O_RDONLY)) < 0) {
+    printf("export: cannot open %s\n", src);
+    return -1;
+  }
+
+  while (ffread(fd, &de, sizeof(de)) == sizeof(de)) {
+    if (de.inum == 0)
+      continue;
+    memmove(name, de.name, DIRSIZ);
+    name[DIRSIZ] = 0;
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+      continue;
+    snprintf(s, sizeof(s), "%s/%s", src, name);
+    if (snprintf(t, sizeof(t), "%s/%s", dst, name) >= sizeof(t)) {
+      printf("export: path too long: %s/%s\n", dst, name);
+      r = -1;
+      continue;
+    }
+    if (exportpath(s, t) < 0)
+      r = -1;
+  }
+  ffclose(fd);
+  return r;
+}
+
+static int exportpath(char *src, char *dst) {
+  struct stat st;
+
+  if (ustat(src, &st) < 0) {
+    printf("export: cannot stat %s\n", src);
+    return -1;
+  }
+  if (st.type == T_DIR)
+    return exportdir(src, dst);
+  return exportfile(src, dst);
+}
+
+// Copy files and directories to the host's current directory, each
+// under its last path element. Existing host files are not
+// overwritten; existing directories are copied into.
+int fexport(char *args[], int arg_cnt) {
+  char *p, *name;
+  int i, r = 0;
+
+  if (arg_cnt < 2) {
+    printf("Usage: export files...\n");
+    return -1;
+  }
+
+  for (i = 1; i < arg_cnt; i++) {
+    for (p = args[i] + strlen(args[i]); p > args[i] && p[-1] == '/'; p--)
+      p[-1] = 0;
+    name = (p = strrchr(args[i], '/')) != 0 ? p + 1 : args[i];
+    if (exportpath(args[i], name) < 0)
+      r = -1;
+  }
+  return r;
+}
@@ -0,0 +1,19 @@
+// Host-side file calls for import and export, apart from the shell's
+// own headers: ../fcntl.h and ../file.h clash with the host's.
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../defs.h"
+
+// Create host file path for writing. One that exists already is never
+// overwritten: -1 with errno EEXIST.
+int hostcreate(const char *path) {
+  return open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+}
+
+// Make host directory path; one that exists already will do.
+int hostmkdir(const char *path) {
+  if (mkdir(path, 0777) < 0 && errno != EEXIST)
+    return -1;
+  return 0;
+}
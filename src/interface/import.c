@@ -1,39 +1,118 @@
 #include "../defs.h"
 #include "../fcntl.h"
+#include <dirent.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-int fimport(char *args[], int arg_cnt) {
-  if (arg_cnt < 2) {
-    printf("Usage: import files...\n");
+// Big enough for ffwrite() to fill whole log transactions.
+#define IMPORTBUF (256 * 1024)
+
+static int importpath(char *src, char *dst);
+
+// Copy host file src, open as f, to file dst. The file is mapped and
+// handed to ffwrite() IMPORTBUF at a time straight from the mapping;
+// what can't be mapped (a pipe, say) is read instead.
+static int importfile(FILE *f, char *src, char *dst) {
+  static char buf[IMPORTBUF];
+  off_t size, off;
+  char *p = MAP_FAILED;
+  int n, fd, r = 0;
+
+  if ((fd = ffopen(dst, O_CREATE | O_WRONLY | O_TRUNC)) < 0) {
+    printf("import: cannot create %s\n", dst);
     return -1;
   }
 
-  int n, fd;
-  char buf[512];
-  FILE *outer_file = fopen(args[1], "rb");
-  if (outer_file == NULL) {
-    printf("import: can't open import file\n");
-    return -1;
+  if ((size = lseek(fileno(f), 0, SEEK_END)) > 0 &&
+      (p = mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(f), 0)) != MAP_FAILED) {
+    madvise(p, size, MADV_SEQUENTIAL);
+    for (off = 0; off < size && r == 0; off += n) {
+      n = size - off < IMPORTBUF ? size - off : IMPORTBUF;
+      if (ffwrite(fd, p + off, n) != n)
+        r = -1;
+    }
+    munmap(p, size);
+  } else {
+    rewind(f);
+    while (r == 0 && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+      if (ffwrite(fd, buf, n) != n)
+        r = -1;
   }
 
-  char inst[] = "touch";
-  char *args_touch[] = {inst, args[1], 0};
-  if (touch(args_touch, 2) < 0) {
+  if (r < 0)
+    printf("import: write error on %s\n", src);
+  ffclose(fd);
+  return r;
+}
+
+// Copy host directory src to directory dst, made if need be, and
+// everything under it.
+static int importdir(DIR *d, char *src, char *dst) {
+  char s[512], t[512];
+  struct dirent *de;
+  int fd, r = 0;
+
+  if ((fd = ffopen(dst, O_RDONLY)) >= 0)
+    ffclose(fd);
+  else if (ffmkdir(dst) < 0) {
+    printf("import: cannot create %s\n", dst);
     return -1;
   }
 
-  if ((fd = ffopen(args[1], 1)) < 0) {
-    printf("import: cannot open %s\n", args[1]);
+  while ((de = readdir(d)) != 0) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    if (snprintf(s, sizeof(s), "%s/%s", src, de->d_name) >= sizeof(s) ||
+        snprintf(t, sizeof(t), "%s/%s", dst, de->d_name) >= sizeof(t)) {
+      printf("import: path too long: %s/%s\n", src, de->d_name);
+      r = -1;
+      continue;
+    }
+    if (importpath(s, t) < 0)
+      r = -1;
+  }
+  return r;
+}
+
+static int importpath(char *src, char *dst) {
+  FILE *f;
+  DIR *d;
+  int r;
+
+  if ((d = opendir(src)) != 0) {
+    r = importdir(d, src, dst);
+    closedir(d);
+    return r;
+  }
+  if ((f = fopen(src, "rb")) == NULL) {
+    printf("import: can't open %s\n", src);
     return -1;
   }
+  r = importfile(f, src, dst);
+  fclose(f);
+  return r;
+}
 
-  while ((n = fread(buf, sizeof(char), sizeof(buf), outer_file)) > 0) {
-    if (ffwrite(fd, buf, n) < 0) {
-      ffclose(fd);
-      printf("import: write error\n");
-      return -1;
-    }
+// Copy host files and directories into the current directory, each
+// under its last path element.
+int fimport(char *args[], int arg_cnt) {
+  char *p, *name;
+  int i, r = 0;
+
+  if (arg_cnt < 2) {
+    printf("Usage: import files...\n");
+    return -1;
   }
 
-  ffclose(fd);
-  return 0;
+  // many small files share commits
+  begin_batch();
+  for (i = 1; i < arg_cnt; i++) {
+    for (p = args[i] + strlen(args[i]); p > args[i] && p[-1] == '/'; p--)
+      p[-1] = 0;
+    name = (p = strrchr(args[i], '/')) != 0 ? p + 1 : args[i];
+    if (importpath(args[i], name) < 0)
+      r = -1;
+  }
+  end_batch();
+  return r;
 }
@@ -1,6 +1,6 @@
 #include "../defs.h"
 
-int mkdir(char *args[], int arg_cnt) {
+int fmkdir(char *args[], int arg_cnt) {
   int i;
 
   if (arg_cnt < 2) {
@@ -0,0 +1,24 @@
+#include "../defs.h"
+
+// snap name: take a snapshot, seen as /.snap/name
+// snap -d name: delete it
+int snap(char *args[], int arg_cnt) {
+  if (arg_cnt == 2 && strcmp(args[1], "-d") != 0) {
+    if (snapcreate(args[1]) < 0) {
+      printf("snap: cannot take %s\n", args[1]);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (arg_cnt == 3 && !strcmp(args[1], "-d")) {
+    if (snapdelete(args[2]) < 0) {
+      printf("snap: cannot delete %s\n", args[2]);
+      return -1;
+    }
+    return 0;
+  }
+
+  printf("Usage: snap name | snap -d name\n");
+  return -1;
+}
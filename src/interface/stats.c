@@ -0,0 +1,63 @@
+#include "../defs.h"
+#include "../stats.h"
+
+// Print the percentiles of each latency histogram.
+static void printhist(void) {
+  uint64 b[NHBUCKET], n;
+  int h, i;
+
+  printf("%-11s %10s %10s %10s %10s %10s %10s\n", "(us)", "count", "p50",
+         "p90", "p99", "p999", "max");
+  for (h = 0; h < NHIST; h++) {
+    histget(h, b);
+    for (i = 0, n = 0; i < NHBUCKET; i++)
+      n += b[i];
+    printf("%-11s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", histname[h],
+           n, histpct(b, 0.5) / 1e3, histpct(b, 0.9) / 1e3,
+           histpct(b, 0.99) / 1e3, histpct(b, 0.999) / 1e3,
+           histpct(b, 1) / 1e3);
+  }
+}
+
+// stats: print the file system counters
+// stats hist: print the latency percentiles
+// stats reset: count from 0 again
+// stats log on|off: start (clearing it) or stop the event log
+// stats log: print the logged events
+int stats(char *args[], int arg_cnt) {
+  uint64 v[NSTAT], n;
+  int i;
+
+  if (arg_cnt == 2 && !strcmp(args[1], "reset")) {
+    statreset();
+    return 0;
+  }
+  if (arg_cnt == 2 && !strcmp(args[1], "hist")) {
+    printhist();
+    return 0;
+  }
+  if (arg_cnt == 2 && !strcmp(args[1], "log")) {
+    evdump(stdout);
+    return 0;
+  }
+  if (arg_cnt == 3 && !strcmp(args[1], "log") &&
+      (!strcmp(args[2], "on") || !strcmp(args[2], "off"))) {
+    evlog(!strcmp(args[2], "on"));
+    return 0;
+  }
+  if (arg_cnt != 1) {
+    printf("Usage: stats [hist | reset | log [on | off]]\n");
+    return -1;
+  }
+
+  statget(v);
+  for (i = 0; i < NSTAT; i++)
+    printf("%-18s %llu\n", statname[i], v[i]);
+  n = v[ST_BHIT] + v[ST_BMISS];
+  if (n > 0)
+    printf("%-18s %.1f%%\n", "bcache_hit_ratio", 100.0 * v[ST_BHIT] / n);
+  if (v[ST_COMMIT] > 0)
+    printf("%-18s %.1f us\n", "commit_latency",
+           v[ST_COMMITNS] / 1e3 / v[ST_COMMIT]);
+  return 0;
+}
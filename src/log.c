@@ -2,6 +2,7 @@
 #include "defs.h"
 #include "fs.h"
 #include "spinlock.h"
+#include "stats.h"
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -15,53 +16,114 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
+  int reserved;    // log blocks reserved by the outstanding calls.
   int committing;  // in commit(), please wait.
+  uint64 ncommit;  // commits done; the open transaction has this no
+  int exclusive;   // begin_opx(): 1 waiting for the others, 2 running
   int dev;
+  uint fssize;     // blocks of the image, to check the header against
+  int datamode;    // DATA_JOURNAL or DATA_ORDERED
+  uchar *freed;    // bitmap of blocks freed by the running transaction
+  uint *freedlist; // the same blocks, to clear freed at commit
+  int nfreed;
+  int maxfreed;
   struct logheader lh;
 };
 
 static void recover_from_log(void);
 static void commit();
 
-struct log dlog;
+// log blocks reserved by the calling thread's operation
+static __thread int opblks;
+// the calling thread runs a batch (begin_batch())
+static __thread int batching;
+// the transaction the calling thread's last operation ended in
+static __thread uint64 lasttrans;
 
-void initlog(int dev, struct superblock *sb) {
+void initlog(int dev, struct superblock *sb, int datamode) {
+  struct log *log;
+
+  if ((log = curfs->log = calloc(1, sizeof(struct log))) == 0) {
+    printf("panic: initlog: out of memory");
+    exit(1);
+  }
   if (sizeof(struct logheader) >= BSIZE) {
     printf("panic: initlog: too big logheader");
     exit(1);
   }
 
-  init_spinlock(&dlog.lock, "dlog");
-  dlog.start = sb->logstart;
-  dlog.size = sb->nlog;
-  dlog.dev = dev;
+  if (sb->nlog < NLOG) {
+    printf("panic: initlog: log too small, remake the image");
+    exit(1);
+  }
+
+  init_spinlock(&log->lock, "log");
+  log->start = sb->logstart;
+  log->size = sb->nlog;
+  log->dev = dev;
+  log->fssize = sb->size;
+  log->datamode = datamode;
+  if (datamode == DATA_ORDERED &&
+      (log->freed = calloc(sb->size / 8 + 1, 1)) == 0) {
+    printf("panic: initlog: out of memory");
+    exit(1);
+  }
   recover_from_log();
 }
 
+// Free the log of the calling thread's mount, once no operation is
+// outstanding.
+void logdone(void) {
+  struct log *log = curfs->log;
+
+  free(log->freed);
+  free(log->freedlist);
+  free(log);
+  curfs->log = 0;
+}
+
 // Copy committed blocks from log to their home location
 static void install_trans(int recovering) {
+  struct log *log = curfs->log;
   int tail;
 
-  for (tail = 0; tail < dlog.lh.n; tail++) {
-    struct buf *lbuf = bread(dlog.dev, dlog.start + tail + 1); // read log block
-    struct buf *dbuf = bread(dlog.dev, dlog.lh.block[tail]);   // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE); // copy block to dst
-    bwrite(dbuf);                           // write dst to disk
+  for (tail = 0; tail < log->lh.n; tail++) {
+    struct buf *dbuf = bread(log->dev, log->lh.block[tail]); // read dst
+    if (recovering) {
+      struct buf *lbuf = bread(log->dev, log->start + tail + 1); // log block
+      memmove(dbuf->data, lbuf->data, BSIZE); // copy block to dst
+      brelse(lbuf);
+    }
+    // otherwise dst is pinned in the cache with what was logged, and
+    // reading the log block back would only cost a disk read
+    bwrite(dbuf); // write dst to disk
     if (recovering == 0)
       bunpin(dbuf);
-    brelse(lbuf);
     brelse(dbuf);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into the in-memory log header.
+// A header that is not one commit could write (a damaged or tampered
+// block, an encrypted one under the wrong key) stops the mount.
 static void read_head(void) {
-  struct buf *buf = bread(dlog.dev, dlog.start);
+  struct log *log = curfs->log;
+  struct buf *buf = bread(log->dev, log->start);
   struct logheader *lh = (struct logheader *)(buf->data);
   int i;
-  dlog.lh.n = lh->n;
-  for (i = 0; i < dlog.lh.n; i++) {
-    dlog.lh.block[i] = lh->block[i];
+  if (lh->n < 0 || lh->n > NLOG) {
+    printf("panic: read_head: bad log header");
+    exit(1);
+  }
+  log->lh.n = lh->n;
+  for (i = 0; i < log->lh.n; i++) {
+    if ((uint)lh->block[i] >= log->fssize ||
+        (lh->block[i] >= log->start &&
+         lh->block[i] < log->start + log->size)) {
+      printf("panic: read_head: bad log header");
+      exit(1);
+    }
+    log->lh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
@@ -70,85 +132,182 @@ static void read_head(void) {
 // This is the true point at which the
 // current transaction commits.
 static void write_head(void) {
-  struct buf *buf = bread(dlog.dev, dlog.start);
+  struct log *log = curfs->log;
+  struct buf *buf = bread(log->dev, log->start);
   struct logheader *hb = (struct logheader *)(buf->data);
   int i;
-  hb->n = dlog.lh.n;
-  for (i = 0; i < dlog.lh.n; i++) {
-    hb->block[i] = dlog.lh.block[i];
+  hb->n = log->lh.n;
+  for (i = 0; i < log->lh.n; i++) {
+    hb->block[i] = log->lh.block[i];
   }
   bwrite(buf);
   brelse(buf);
 }
 
 static void recover_from_log(void) {
+  struct log *log = curfs->log;
+
   read_head();
   install_trans(1); // if committed, copy from log to disk
-  dlog.lh.n = 0;
+  log->lh.n = 0;
   write_head(); // clear the log
 }
 
 // called at the start of each FS system call.
-void begin_op(void) {
-  acquire_spinlock(&dlog.lock);
+void begin_op(void) { begin_opn(MAXOPBLKS); }
+
+// Start an operation that will log at most nblks blocks.
+// Big writes compute nblks with writeifit() so that one
+// transaction carries as much data as the log can hold.
+void begin_opn(int nblks) {
+  struct log *log = curfs->log;
+
+  if (nblks > MAXLOGOP) {
+    printf("panic: begin_opn: too many blocks");
+    exit(1);
+  }
+
+  acquire_spinlock(&log->lock);
   while (1) {
-    // TODO
-    if (dlog.committing) {
-      // sleep(&dlog, &dlog.lock);
-    } else if (dlog.lh.n + (dlog.outstanding + 1) * MAXOPBLKS > NLOG) {
+    if (log->committing || log->exclusive) {
+      sleep_spinlock(log, &log->lock);
+    } else if (log->lh.n + log->reserved + nblks > log->size - 1 &&
+               log->outstanding == 0) {
+      // a batch left its operations uncommitted; commit them now.
+      log->committing = 1;
+      release_spinlock(&log->lock);
+      commit();
+      acquire_spinlock(&log->lock);
+      log->committing = 0;
+      log->ncommit++;
+      wakeup_spinlock(log);
+    } else if (log->lh.n + log->reserved + nblks > log->size - 1) {
       // this op might exhaust log space; wait for commit.
-      // sleep(&dlog, &dlog.lock);
+      sleep_spinlock(log, &log->lock);
     } else {
-      dlog.outstanding += 1;
-      release_spinlock(&dlog.lock);
+      log->outstanding += 1;
+      log->reserved += nblks;
+      opblks = nblks;
+      release_spinlock(&log->lock);
+      statadd(ST_TRANS, 1);
       break;
     }
   }
 }
 
+// Start an operation that runs alone, between the others: it waits
+// for them to end and keeps new ones waiting until it ends.
+// Taking a snapshot uses it, so no operation is half done in it.
+void begin_opx(void) {
+  struct log *log = curfs->log;
+
+  acquire_spinlock(&log->lock);
+  while (log->exclusive)
+    sleep_spinlock(log, &log->lock);
+  log->exclusive = 1;
+  while (log->committing || log->outstanding > 0)
+    sleep_spinlock(log, &log->lock);
+  log->exclusive = 2;
+  log->outstanding = 1;
+  log->reserved = MAXOPBLKS;
+  opblks = MAXOPBLKS;
+  release_spinlock(&log->lock);
+  statadd(ST_TRANS, 1);
+}
+
 // called at the end of each FS system call.
 // commits if this was the last outstanding operation.
 void end_op(void) {
+  struct log *log = curfs->log;
   int do_commit = 0;
 
-  acquire_spinlock(&dlog.lock);
-  dlog.outstanding -= 1;
-  if (dlog.committing) {
+  acquire_spinlock(&log->lock);
+  log->outstanding -= 1;
+  log->reserved -= opblks;
+  opblks = 0;
+  if (log->exclusive == 2)
+    log->exclusive = 0; // it was the only one
+  if (log->committing) {
     printf("panic: log: committing");
     exit(1);
   }
 
-  if (dlog.outstanding == 0) {
+  lasttrans = log->ncommit;
+  if (log->outstanding == 0 && !batching) {
     do_commit = 1;
-    dlog.committing = 1;
+    log->committing = 1;
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
     // the amount of reserved space.
-    // TODO
-    // wakeup(&dlog);
+    wakeup_spinlock(log);
   }
-  release_spinlock(&dlog.lock);
+  release_spinlock(&log->lock);
 
   if (do_commit) {
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire_spinlock(&dlog.lock);
-    dlog.committing = 0;
-    // TODO
-    // wakeup(&dlog);
-    release_spinlock(&dlog.lock);
+    acquire_spinlock(&log->lock);
+    log->committing = 0;
+    log->ncommit++;
+    wakeup_spinlock(log);
+    release_spinlock(&log->lock);
   }
 }
 
+// Run the calling thread's next operations as a batch, to share one
+// commit: their end_op()s leave what they logged to end_batch(), or
+// to whichever operation commits first (one of another thread, or one
+// that finds the log full). They are durable only after end_batch().
+void begin_batch(void) { batching = 1; }
+
+// Commit the operations of the calling thread's batch, and return
+// once that commit is done. An operation of another thread may keep
+// end_op() from committing; then wait for the commit that ends it, or
+// make it once no operation is outstanding (the others may be batches
+// too).
+void end_batch(void) {
+  struct log *log = curfs->log;
+
+  batching = 0;
+  begin_opn(0);
+  end_op();
+
+  acquire_spinlock(&log->lock);
+  while (log->ncommit <= lasttrans) {
+    if (log->committing || log->exclusive || log->outstanding > 0) {
+      sleep_spinlock(log, &log->lock);
+      continue;
+    }
+    log->committing = 1;
+    release_spinlock(&log->lock);
+    commit();
+    acquire_spinlock(&log->lock);
+    log->committing = 0;
+    log->ncommit++;
+    wakeup_spinlock(log);
+  }
+  release_spinlock(&log->lock);
+}
+
+// End the calling thread's operation and start another that may log
+// nblks blocks, so a long job like a big truncation can be split into
+// transactions. The caller must leave the disk consistent first, and
+// must not hold a lock that another outstanding operation waits for.
+void log_restart(int nblks) {
+  end_op();
+  begin_opn(nblks);
+}
+
 // Copy modified blocks from cache to log.
 static void write_log(void) {
+  struct log *log = curfs->log;
   int tail;
 
-  for (tail = 0; tail < dlog.lh.n; tail++) {
-    struct buf *to = bread(dlog.dev, dlog.start + tail + 1); // log block
-    struct buf *from = bread(dlog.dev, dlog.lh.block[tail]); // cache block
+  for (tail = 0; tail < log->lh.n; tail++) {
+    struct buf *to = bnew(log->dev, log->start + tail + 1); // log block
+    struct buf *from = bread(log->dev, log->lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
     bwrite(to); // write the log
     brelse(from);
@@ -156,14 +315,70 @@ static void write_log(void) {
   }
 }
 
+// Each phase is timed (stats.h).
 static void commit() {
-  if (dlog.lh.n > 0) {
-    write_log();      // Write modified blocks from cache to log
-    write_head();     // Write header to disk -- the real commit
+  struct log *log = curfs->log;
+  uint64 t0, t1, t2;
+  uint n = log->lh.n;
+
+  if (n > 0) {
+    t0 = t1 = statnsec();
+    write_log(); // Write modified blocks from cache to log
+    histadd(H_WRITELOG, (t2 = statnsec()) - t1, n);
+    write_head(); // Write header to disk -- the real commit
+    histadd(H_WRITEHEAD, (t1 = statnsec()) - t2, n);
     install_trans(0); // Now install writes to home locations
-    dlog.lh.n = 0;
+    histadd(H_INSTALL, (t2 = statnsec()) - t1, n);
+    log->lh.n = 0;
     write_head(); // Erase the transaction from the log
+    histadd(H_WRITEHEAD, (t1 = statnsec()) - t2, 0);
+    histadd(H_COMMIT, t1 - t0, n);
+    statadd(ST_COMMIT, 1);
+    statadd(ST_LOGBLK, n);
+    statadd(ST_COMMITNS, t1 - t0);
+  }
+
+  // blocks freed by this transaction may be rewritten in place now
+  while (log->nfreed > 0) {
+    uint b = log->freedlist[--log->nfreed];
+    log->freed[b / 8] &= ~(1 << (b % 8));
+  }
+}
+
+// Does file data bypass the log (ordered mode)?
+// Then data blocks are written in place with bwrite() before the
+// transaction that points at them commits, and only metadata
+// (bitmap, inode, indirect and directory blocks) is logged.
+int log_ordered(void) { return curfs->log->datamode == DATA_ORDERED; }
+
+// Record that block b was freed by the running transaction.
+// Until that transaction commits the old owner still points at b on
+// disk, so in ordered mode b must not be reused for in-place data.
+void log_free(uint b) {
+  struct log *log = curfs->log;
+
+  if (!log_ordered())
+    return;
+
+  acquire_spinlock(&log->lock);
+  if (log->nfreed == log->maxfreed) {
+    log->maxfreed = log->maxfreed ? log->maxfreed * 2 : 64;
+    log->freedlist = realloc(log->freedlist, log->maxfreed * sizeof(uint));
+    if (log->freedlist == 0) {
+      printf("panic: log_free: out of memory");
+      exit(1);
+    }
   }
+  log->freedlist[log->nfreed++] = b;
+  log->freed[b / 8] |= 1 << (b % 8);
+  release_spinlock(&log->lock);
+}
+
+// Was block b freed by the running transaction?
+int log_freed(uint b) {
+  struct log *log = curfs->log;
+
+  return log_ordered() && (log->freed[b / 8] & (1 << (b % 8)));
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -176,31 +391,34 @@ static void commit() {
 //   log_write(bp)
 //   brelse(bp)
 void log_write(struct buf *b) {
+  struct log *log = DEVFS(b->dev)->log;
   int i;
-  acquire_spinlock(&dlog.lock);
+  acquire_spinlock(&log->lock);
 
-  if (dlog.lh.n >= NLOG || dlog.lh.n >= dlog.size - 1) {
+  if (log->lh.n >= NLOG || log->lh.n >= log->size - 1) {
     printf("panic: too big a transaction");
     exit(1);
   }
 
-  if (dlog.outstanding < 1) {
+  if (log->outstanding < 1) {
     printf("panic: log_write outside of trans");
     exit(1);
   }
 
   // log absorption
-  for (i = 0; i < dlog.lh.n; i++) {
-    if (dlog.lh.block[i] == b->blkno)
+  for (i = 0; i < log->lh.n; i++) {
+    if (log->lh.block[i] == b->blkno)
       break;
   }
-  dlog.lh.block[i] = b->blkno;
+  log->lh.block[i] = b->blkno;
 
   // Add new block to log?
-  if (i == dlog.lh.n) {
+  if (i == log->lh.n) {
     bpin(b);
-    dlog.lh.n++;
+    log->lh.n++;
+  } else {
+    statadd(ST_ABSORB, 1);
   }
 
-  release_spinlock(&dlog.lock);
+  release_spinlock(&log->lock);
 }
@@ -0,0 +1,138 @@
+#include "defs.h"
+
+// LZ4 block format, as used for compressed file clusters.
+// A block is a list of sequences: a token byte (literal length in the
+// high 4 bits, match length - 4 in the low 4 bits, 15 meaning more
+// length bytes follow), the literals, then a 2-byte little-endian
+// match offset. The last sequence has literals only.
+
+#define HASHLOG 12     // log2 of the compressor's hash table size
+#define MINMATCH 4     // shortest match
+#define LASTLITERALS 5 // the last bytes are always literals
+#define MFLIMIT 12     // no match starts this close to the end
+#define MAXOFFSET 65535
+
+static uint read32(const uchar *p) {
+  uint v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint lz4hash(uint v) { return (v * 2654435761U) >> (32 - HASHLOG); }
+
+// Write length n as 255-bytes and a remainder after a token that held 15.
+static uchar *putlen(uchar *op, uint n) {
+  for (; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = n;
+  return op;
+}
+
+// Compress src[0..n-1] into dst, which has room for cap bytes.
+// Returns the compressed size, or 0 if it does not fit.
+int lz4_compress(const char *src, int n, char *dst, int cap) {
+  int table[1 << HASHLOG];
+  const uchar *s = (const uchar *)src, *ip = s, *anchor = s, *end = s + n;
+  const uchar *match, *p, *q;
+  uchar *op = (uchar *)dst, *oend = op + cap, *token;
+  uint h, lit, len;
+
+  memset(table, 0xff, sizeof(table));
+  while (n > MFLIMIT && ip < end - MFLIMIT) {
+    h = lz4hash(read32(ip));
+    match = table[h] < 0 ? 0 : s + table[h];
+    table[h] = ip - s;
+    if (match == 0 || ip - match > MAXOFFSET || read32(match) != read32(ip)) {
+      ip++;
+      continue;
+    }
+
+    // extend the match, stopping short of the last literals
+    for (p = ip + MINMATCH, q = match + MINMATCH;
+         p < end - LASTLITERALS && *p == *q; p++, q++)
+      ;
+    lit = ip - anchor;
+    len = p - ip - MINMATCH;
+    if (op + 1 + lit / 255 + 1 + lit + 2 + len / 255 + 1 > oend)
+      return 0;
+
+    token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15)
+      op = putlen(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    *op++ = (ip - match) & 0xff;
+    *op++ = (ip - match) >> 8;
+    *token |= len >= 15 ? 15 : len;
+    if (len >= 15)
+      op = putlen(op, len - 15);
+
+    ip = anchor = p;
+  }
+
+  // the rest as literals
+  lit = end - anchor;
+  if (op + 1 + lit / 255 + 1 + lit > oend)
+    return 0;
+  token = op++;
+  *token = (lit >= 15 ? 15 : lit) << 4;
+  if (lit >= 15)
+    op = putlen(op, lit - 15);
+  memcpy(op, anchor, lit);
+  op += lit;
+
+  return op - (uchar *)dst;
+}
+
+// Decompress the n bytes at src into dst, which has room for cap bytes.
+// Returns the decompressed size, or -1 if src is not valid LZ4 data.
+int lz4_decompress(const char *src, int n, char *dst, int cap) {
+  const uchar *ip = (const uchar *)src, *iend = ip + n, *match;
+  uchar *op = (uchar *)dst, *oend = op + cap;
+  uint token, len, off, b;
+
+  while (ip < iend) {
+    token = *ip++;
+
+    // literals
+    len = token >> 4;
+    if (len == 15) {
+      do {
+        if (ip >= iend)
+          return -1;
+        len += b = *ip++;
+      } while (b == 255);
+    }
+    if (len > iend - ip || len > oend - op)
+      return -1;
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+    if (ip == iend)
+      break; // the last sequence
+
+    // match
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (off == 0 || off > op - (uchar *)dst)
+      return -1;
+    len = token & 15;
+    if (len == 15) {
+      do {
+        if (ip >= iend)
+          return -1;
+        len += b = *ip++;
+      } while (b == 255);
+    }
+    len += MINMATCH;
+    if (len > oend - op)
+      return -1;
+    for (match = op - off; len > 0; len--) // may overlap
+      *op++ = *match++;
+  }
+
+  return op - (uchar *)dst;
+}
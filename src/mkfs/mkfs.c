@@ -1,32 +1,63 @@
+#define _GNU_SOURCE // FTW_ACTIONRETVAL
 #include <assert.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#define BSIZE bsize // mkfs makes one image, of block size -b
 #include "../defs.h"
 #include "../fs.h"
 
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
 int fsfd;                            // fd for the file system
-int nblks = FSSIZE;                  // total block num for the file system
+uint nblks = FSSIZE;                 // total block num for the file system
 int nlog = NLOG;                     // num of log blocks
-int ninode = NINODEBLK / IPB + 1;    // num of inode blocks
-int nbmp = FSSIZE / (BSIZE * 8) + 1; // num of bit-map blocks
-int nmeta; // num of meta blocks (boot, sb, nlog, inode, bitmap)
+int ninode;                          // num of inode blocks
+int nbmp;                            // num of bit-map blocks
+int nref;                            // num of refcount blocks
+int nidx;                            // num of fingerprint index blocks
+int nsave;                           // num of save table blocks (FS_SNAP)
+int ncopy;                           // num of copy blocks (FS_SNAP)
+int nmeta; // num of meta blocks (boot, sb, nlog, inode, bitmap, dedup, snap)
 int ndata; // num of data blocks
 
 uint freeinode = 1;
 uint freeblock;
 struct superblock sb;
-char zeroes[BSIZE];
+uint bsize = DEFBSIZE; // block size (-b)
+char zeroes[MAXBSIZE];
+char *meta; // inode and bitmap blocks, built in memory and written at once
+int keyed;  // -k: blocks from the log on are encrypted
+
+// Inode geometry of the format being made (-O 64bit changes it).
+uint ndirect = NDIRECT;   // direct blocks in an inode
+int nlevel = 2;           // levels of indirect blocks
+uint64 maxfile;           // max file size in blocks
+
+// An inode as mkfs builds it, kept as a dinode or a dinode64 on disk.
+// Addresses are in disk byte order, the size in host order.
+struct xinode {
+  short type;
+  short nlink;
+  short major;
+  short minor;
+  uint64 size;
+  uint addrs[NADDRS];
+};
 
 void wblk(uint, void *);
+void encblks(uint bno, char *buf, size_t n);
 uint iialloc(ushort type);
 void iappend(uint inum, void *xp, int n);
-void winode(uint inum, struct dinode *ip);
-void rinode(uint inum, struct dinode *ip);
+void winode(uint inum, struct xinode *ip);
+void rinode(uint inum, struct xinode *ip);
 void bballoc(int used);
+void populate(char *dir);
 
 // convert to intel byte order
 ushort xshort(ushort x) {
@@ -47,115 +78,249 @@ uint xint(uint x) {
   return y;
 }
 
+uint64 xlong(uint64 x) {
+  uint64 y;
+  uchar *a = (uchar *)&y;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    a[i] = x >> (8 * i);
+  return y;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: mkfs [-b bsize] [-i ninodes] [-d dir] "
+          "[-O 64bit|compress|dedup|snapshot|reflink] [-k keyfile] fs.img "
+          "[nblocks]\n");
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: mkfs fs.img \n");
+  uint rootino, snapino;
+  struct xinode din;
+  char buf[MAXBSIZE];
+  int opt, i, ninodes = NINODEBLK;
+  char *dir = 0;
+  uchar key[XTSKEYLEN];
+
+  while ((opt = getopt(argc, argv, "b:i:d:O:k:")) != -1) {
+    if (opt == 'i' && (ninodes = atoi(optarg)) > 0 && ninodes < 65536)
+      continue;
+    if (opt == 'b' && (bsize = atoi(optarg)) >= DEFBSIZE &&
+        bsize <= MAXBSIZE && (bsize & (bsize - 1)) == 0)
+      continue;
+    if (opt == 'd') {
+      dir = optarg;
+      continue;
+    }
+    if (opt == 'O' && strcmp(optarg, "64bit") == 0) {
+      // 64-bit file sizes and a triply indirect block
+      sb.flags |= FS_64BIT;
+      ndirect = NDIRECT64;
+      nlevel = 3;
+      continue;
+    }
+    if (opt == 'O' && strcmp(optarg, "compress") == 0) {
+      // file data compressed in clusters, written raw here
+      sb.flags |= FS_COMPRESS;
+      continue;
+    }
+    if (opt == 'O' && strcmp(optarg, "dedup") == 0) {
+      // file blocks shared by content, written unshared here
+      sb.flags |= FS_DEDUP;
+      continue;
+    }
+    if (opt == 'O' && strcmp(optarg, "snapshot") == 0) {
+      // snapshots of the whole file system under /.snap
+      sb.flags |= FS_SNAP;
+      continue;
+    }
+    if (opt == 'O' && strcmp(optarg, "reflink") == 0) {
+      // files cloned with their blocks shared
+      sb.flags |= FS_REFLINK;
+      continue;
+    }
+    if (opt == 'k' && xts_loadkey(optarg, key) == 0) {
+      // AES-XTS encryption of everything but the super block
+      xts_setkey(key);
+      xts_encrypt(KEYCHECK, (char *)sb.keycheck, (char *)sb.keycheck,
+                  sizeof(sb.keycheck));
+      sb.flags |= FS_ENCRYPT;
+      keyed = 1;
+      continue;
+    }
+    usage();
+  }
+  if ((sb.flags & FS_COMPRESS) && CLUSTER / BSIZE < 2) {
+    fprintf(stderr, "mkfs: compress needs blocks of at most %d bytes\n",
+            CLUSTER / 2);
     exit(1);
   }
-
-  uint rootino, inum, off;
-  struct dirent de;
-  struct dinode din;
-  char buf[BSIZE];
+  if ((sb.flags & FS_COMPRESS) && (sb.flags & FS_DEDUP)) {
+    fprintf(stderr, "mkfs: compress and dedup do not go together\n");
+    exit(1);
+  }
+  if ((sb.flags & FS_SNAP) &&
+      (sb.flags & (FS_COMPRESS | FS_DEDUP | FS_REFLINK))) {
+    fprintf(stderr, "mkfs: snapshot goes with no compress, dedup or reflink\n");
+    exit(1);
+  }
+  if ((sb.flags & FS_COMPRESS) && (sb.flags & FS_REFLINK)) {
+    fprintf(stderr, "mkfs: compress and reflink do not go together\n");
+    exit(1);
+  }
+  if (sb.flags & FS_64BIT)
+    maxfile = MAXFILE64;
+  else
+    maxfile = min(MAXFILE, 0xFFFFFFFF / BSIZE); // 32-bit file size
+  maxfile = min(maxfile, 0xFFFFFFFF);
+  if (optind >= argc)
+    usage();
+  if (optind + 1 < argc)
+    nblks = strtoul(argv[optind + 1], 0, 0);
 
   // check alignence
   assert((BSIZE % sizeof(struct dinode)) == 0);
+  assert(sizeof(struct dinode64) == sizeof(struct dinode));
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
   // open a clean image file
-  fsfd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0666);
+  fsfd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0666);
   if (fsfd < 0) {
     printf("mkfs: can't open image file");
     exit(1);
   }
 
   // compute meta block and data block numbers
-  nmeta = 1 + 1 + nlog + ninode + nbmp;
+  ninode = ninodes / IPB + 1;
+  nbmp = nblks / BPB + 1;
+  if (sb.flags & (FS_DEDUP | FS_SNAP | FS_REFLINK))
+    nref = nblks / BSIZE + 1; // a byte per block
+  if (sb.flags & FS_DEDUP)
+    nidx = nblks / DDPB + 1; // room for an entry per block
+  if (sb.flags & FS_SNAP) {
+    nsave = (nbmp + ninode) / SPB + 1; // an entry per bitmap and inode block
+    ncopy = NSNAP * (nbmp + ninode);   // a copy of each for each snapshot
+  }
+  nmeta = SBBLOCK + 1 + nlog + ninode + nbmp + nref + nidx;
+  if (sb.flags & FS_SNAP)
+    nmeta += 1 + nsave + ncopy; // and the snapshot table
+  if (nblks <= nmeta + 1) {
+    fprintf(stderr, "mkfs: %u blocks is too small\n", nblks);
+    exit(1);
+  }
   ndata = nblks - nmeta;
 
   // set attributes of superblock
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(nblks);
   sb.ndata = xint(ndata);
-  sb.ninodes = xint(ninode);
+  sb.ninodes = xint(ninode * IPB);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2 + nlog);
-  sb.bmapstart = xint(2 + nlog + ninode);
+  sb.logstart = xint(SBBLOCK + 1);
+  sb.inodestart = xint(SBBLOCK + 1 + nlog);
+  sb.bmapstart = xint(SBBLOCK + 1 + nlog + ninode);
+  // zeroed: no block is shared yet
+  if (sb.flags & (FS_DEDUP | FS_SNAP | FS_REFLINK))
+    sb.refstart = xint(SBBLOCK + 1 + nlog + ninode + nbmp);
+  if (sb.flags & FS_DEDUP) {
+    sb.idxstart = xint(SBBLOCK + 1 + nlog + ninode + nbmp + nref);
+    sb.nidx = xint(nidx);
+  }
+  if (sb.flags & FS_SNAP) {
+    // all zeroed: no snapshot, nothing saved
+    sb.snapdir = xint(ROOTINO + 1);
+    sb.snapstart = xint(SBBLOCK + 1 + nlog + ninode + nbmp + nref);
+    sb.savestart = xint(xint(sb.snapstart) + 1);
+    sb.copystart = xint(xint(sb.savestart) + nsave);
+    sb.ncopy = xint(ncopy);
+  }
+  sb.flags = xint(sb.flags);
+  sb.bsize = xint(bsize);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks "
          "%u) data blocks %d total %d\n",
-         nmeta, nlog, ninode, nbmp, ndata, FSSIZE);
+         nmeta, nlog, ninode, nbmp, ndata, nblks);
 
   freeblock = nmeta; // the first free block that we can allocate
 
-  // initialize all blocks to 0
-  for (int i = 0; i < FSSIZE; i++)
-    wblk(i, zeroes);
+  // The image is created sparse: blocks never written read as zeroes,
+  // so only the super block, the inode and bitmap blocks and the root
+  // directory are written. Encrypted, a hole would not decrypt to
+  // zeroes, so the other meta blocks read before they are first written
+  // (the log header, refcounts, index, snapshot and save tables) are
+  // written too. Free data blocks, log blocks past the header and copy
+  // blocks are only read once written.
+  if (ftruncate(fsfd, (off_t)nblks * BSIZE) < 0) {
+    printf("mkfs: ftruncate");
+    exit(1);
+  }
+  if ((meta = calloc(ninode + nbmp, BSIZE)) == 0) {
+    printf("mkfs: out of memory");
+    exit(1);
+  }
 
   // write the super block
   memset(buf, 0, BSIZE);
-  memcpy(buf, &sb, sizeof(sb));
-  wblk(1, buf);
+  memcpy(buf + SBOFF % BSIZE, &sb, sizeof(sb));
+  wblk(SBBLOCK, buf);
+  if (keyed) {
+    wblk(SBBLOCK + 1, zeroes);
+    for (i = SBBLOCK + 1 + nlog + ninode + nbmp; i < nmeta - ncopy; i++)
+      wblk(i, zeroes);
+  }
 
   // allocate inode for root dir
   rootino = iialloc(T_DIR);
   assert(rootino == ROOTINO);
+  if (sb.snapdir) { // and /.snap
+    snapino = iialloc(T_DIR);
+    assert(snapino == xint(sb.snapdir));
+  }
 
-  // add . and .. for root
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
-
-  // allocate init dir
-  /*
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "bin");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "dev");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "etc");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "home");
-  iappend(rootino, &de, sizeof(de));
-  */
+  // add . and .. for root, and copy in the tree under dir
+  populate(dir);
 
   // fix size of root inode dir
   rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off / BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
+  din.size = (din.size + BSIZE - 1) / BSIZE * BSIZE;
   winode(rootino, &din);
 
   bballoc(freeblock);
 
+  // write the inode and bitmap blocks in one go
+  size_t n = (size_t)(ninode + nbmp) * BSIZE;
+  encblks(sb.inodestart, meta, n);
+  if (pwrite(fsfd, meta, n, (off_t)sb.inodestart * BSIZE) != n) {
+    printf("mkfs: write");
+    exit(1);
+  }
+
   return 0;
 }
 
+// Encrypt n bytes of whole blocks at buf, the first one block bno,
+// in place if the image is encrypted.
+void encblks(uint bno, char *buf, size_t n) {
+  size_t i;
+
+  if (!keyed || bno <= SBBLOCK)
+    return;
+  for (i = 0; i < n; i += BSIZE)
+    xts_encrypt(bno + i / BSIZE, buf + i, buf + i, BSIZE);
+}
+
 // write a block
 void wblk(uint bno, void *buf) {
-  if (lseek(fsfd, bno * BSIZE, 0) != bno * BSIZE) {
-    printf("mkfs: lseek");
-    exit(1);
-  }
+  char ebuf[MAXBSIZE];
 
-  if (write(fsfd, buf, BSIZE) != BSIZE) {
+  if (keyed) {
+    memcpy(ebuf, buf, BSIZE);
+    encblks(bno, ebuf, BSIZE);
+    buf = ebuf;
+  }
+  if (pwrite(fsfd, buf, BSIZE, (off_t)bno * BSIZE) != BSIZE) {
     printf("mkfs: write");
     exit(1);
   }
@@ -163,110 +328,149 @@ void wblk(uint bno, void *buf) {
 
 // read a block
 void rblk(uint bno, void *buf) {
-  if (lseek(fsfd, bno * BSIZE, 0) != bno * BSIZE) {
-    printf("mkfs: lseek");
-    exit(1);
-  }
-
-  if (read(fsfd, buf, BSIZE) != BSIZE) {
+  if (pread(fsfd, buf, BSIZE, (off_t)bno * BSIZE) != BSIZE) {
     printf("mkfs: read");
     exit(1);
   }
+  if (keyed && bno > SBBLOCK)
+    xts_decrypt(bno, buf, buf, BSIZE);
 }
 
-// write a inode
-void winode(uint inum, struct dinode *ip) {
-  uint bn;
-  char buf[BSIZE];
+// write a inode (to the inode blocks in memory)
+void winode(uint inum, struct xinode *ip) {
   struct dinode *dip;
-
-  // does this step redundant?
-  bn = IBLOCK(inum, sb);
-  rblk(bn, buf);
-
-  dip = ((struct dinode *)buf) + (inum % IPB);
-  *dip = *ip;
-  wblk(bn, buf);
+  struct dinode64 *dip64;
+
+  dip = (struct dinode *)(meta + (IBLOCK(inum, sb) - sb.inodestart) * BSIZE);
+  dip += inum % IPB;
+  dip->type = ip->type;
+  dip->nlink = ip->nlink;
+  dip->major = ip->major;
+  dip->minor = ip->minor;
+  if (sb.flags & xint(FS_64BIT)) {
+    dip64 = (struct dinode64 *)dip;
+    dip64->size = xlong(ip->size);
+    memcpy(dip64->addrs, ip->addrs, sizeof(dip64->addrs));
+  } else {
+    dip->size = xint(ip->size);
+    memcpy(dip->addrs, ip->addrs, sizeof(dip->addrs));
+  }
 }
 
-// read a inode
-void rinode(uint inum, struct dinode *ip) {
-  uint bn;
-  char buf[BSIZE];
+// read a inode (from the inode blocks in memory)
+void rinode(uint inum, struct xinode *ip) {
   struct dinode *dip;
-
-  // does this step redundant?
-  bn = IBLOCK(inum, sb);
-  rblk(bn, buf);
-
-  dip = ((struct dinode *)buf) + (inum % IPB);
-  *ip = *dip;
+  struct dinode64 *dip64;
+
+  dip = (struct dinode *)(meta + (IBLOCK(inum, sb) - sb.inodestart) * BSIZE);
+  dip += inum % IPB;
+  bzero(ip, sizeof(*ip));
+  ip->type = dip->type;
+  ip->nlink = dip->nlink;
+  ip->major = dip->major;
+  ip->minor = dip->minor;
+  if (sb.flags & xint(FS_64BIT)) {
+    dip64 = (struct dinode64 *)dip;
+    ip->size = xlong(dip64->size);
+    memcpy(ip->addrs, dip64->addrs, sizeof(dip64->addrs));
+  } else {
+    ip->size = xint(dip->size);
+    memcpy(ip->addrs, dip->addrs, sizeof(dip->addrs));
+  }
 }
 
 // allocate a inode
 uint iialloc(ushort type) {
   uint inum = freeinode++;
-  struct dinode din;
+  struct xinode din;
 
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
-  din.size = xint(0);
+  din.size = 0;
   winode(inum, &din);
 
   return inum;
 }
 
+// mark the first used blocks allocated in the bitmap blocks in memory
 void bballoc(int used) {
-  uchar buf[BSIZE];
+  uchar *bmap = (uchar *)meta + (size_t)ninode * BSIZE;
   int i;
 
   printf("bballoc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE * 8);
-  bzero(buf, BSIZE);
-  for (i = 0; i < used; i++) {
-    buf[i / 8] = buf[i / 8] | (0x1 << (i % 8));
-  }
-  printf("bballoc: write bitmap block at block %d\n", sb.bmapstart);
-  wblk(sb.bmapstart, buf);
+  assert(used <= nblks);
+  for (i = 0; i < used / 8; i++)
+    bmap[i] = 0xFF;
+  for (i = used / 8 * 8; i < used; i++)
+    bmap[i / 8] |= 0x1 << (i % 8);
+  printf("bballoc: bitmap blocks %d-%d\n", sb.bmapstart,
+         sb.bmapstart + nbmp - 1);
 }
 
-#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// return the address of block fbn of din, allocating it if necessary
+static uint ibmap(struct xinode *din, uint fbn) {
+  uint indirect[MAXBSIZE / sizeof(uint)];
+  uint *a, x;
+  uint64 span;
+  int level;
+
+  if (fbn < ndirect) {
+    if (xint(din->addrs[fbn]) == 0)
+      din->addrs[fbn] = xint(freeblock++);
+    return xint(din->addrs[fbn]);
+  }
+  fbn -= ndirect;
+
+  // find the tree of indirect blocks fbn is in
+  for (level = 1, span = NINDIRECT; fbn >= span; level++, span *= NINDIRECT)
+    fbn -= span;
+  assert(level <= nlevel);
+
+  // and walk it down to fbn
+  a = &din->addrs[ndirect + level - 1];
+  if (xint(*a) == 0) {
+    *a = xint(freeblock++);
+    wblk(xint(*a), zeroes);
+  }
+  for (;;) {
+    x = xint(*a);
+    span /= NINDIRECT;
+    rblk(x, (char *)indirect);
+    a = &indirect[fbn / span];
+    fbn %= span;
+    if (xint(*a) == 0) {
+      *a = xint(freeblock++);
+      if (span > 1)
+        wblk(xint(*a), zeroes); // a new lower level block
+      wblk(x, (char *)indirect);
+    }
+    if (span == 1)
+      return xint(*a);
+  }
+}
 
 void iappend(uint inum, void *xp, int n) {
   char *p = (char *)xp;
   uint fbn, off, n1;
-  struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  struct xinode din;
+  char buf[MAXBSIZE];
   uint x; // for data address
 
   rinode(inum, &din);
-  off = xint(din.size); // convert back
+  off = din.size;
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while (n > 0) {
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if (fbn < NDIRECT) {
-      if (xint(din.addrs[fbn]) == 0) {
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if (xint(din.addrs[NDIRECT]) == 0) {
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rblk(xint(din.addrs[NDIRECT]), (char *)indirect);
-
-      if (indirect[fbn - NDIRECT] == 0) {
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wblk(xint(din.addrs[NDIRECT]), (char *)indirect);
-      }
-      x = xint(indirect[fbn - NDIRECT]);
-    }
+    assert(fbn < maxfile);
+    x = ibmap(&din, fbn);
 
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rblk(x, buf);
+    if (off % BSIZE == 0) // a new block, a hole not to read
+      memset(buf, 0, BSIZE);
+    else
+      rblk(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
     wblk(x, buf);
     n -= n1;
@@ -274,6 +478,244 @@ void iappend(uint inum, void *xp, int n) {
     p += n1;
   }
 
-  din.size = xint(off);
+  din.size = off;
   winode(inum, &din);
 }
+
+/* Populate the image from a host directory */
+#define NWORKER 8            // max threads copying file data
+#define COPYBUF (1024 * 1024) // bytes copied per read
+#define MAXDEPTH 64          // max depth of the host tree
+
+// A directory being built: its entries are written once all are known.
+struct mdir {
+  uint inum;
+  struct dirent *de;
+  int n, max;
+};
+
+// A file whose data goes to contiguous blocks from bno.
+struct job {
+  char *path;
+  uint bno;
+  off_t size;
+};
+
+struct mdir *dirs;
+int ndirs;
+int dstack[MAXDEPTH]; // dirs index of the directory at each level
+struct job *jobs;
+int njobs;
+int nextjob;
+pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *grow(void *p, int n, size_t sz) {
+  if ((p = realloc(p, n * sz)) == 0) {
+    printf("mkfs: out of memory");
+    exit(1);
+  }
+  return p;
+}
+
+// add an entry to directory d
+static void dirent_add(struct mdir *d, uint inum, const char *name) {
+  if (d->n == d->max) {
+    d->max = d->max ? d->max * 2 : 16;
+    d->de = grow(d->de, d->max, sizeof(struct dirent));
+  }
+  bzero(&d->de[d->n], sizeof(struct dirent));
+  d->de[d->n].inum = xshort(inum);
+  strncpy(d->de[d->n].name, name, DIRSIZ);
+  d->n++;
+}
+
+// start building directory inum, a child of directory parent
+static int mdir_new(uint inum, uint parent) {
+  dirs = grow(dirs, ndirs + 1, sizeof(struct mdir));
+  bzero(&dirs[ndirs], sizeof(struct mdir));
+  dirs[ndirs].inum = inum;
+  dirent_add(&dirs[ndirs], inum, ".");
+  dirent_add(&dirs[ndirs], parent, "..");
+  return ndirs++;
+}
+
+// Write an indirect block of the given level (1 lists data blocks)
+// for the blocks of the run from bno + *i on, after the lower level
+// blocks it lists, and return its block no.
+static uint mkind(uint bno, uint nb, uint *i, int level) {
+  uint a[MAXBSIZE / sizeof(uint)];
+  int j;
+
+  bzero(a, BSIZE);
+  for (j = 0; j < NINDIRECT && *i < nb; j++)
+    a[j] = xint(level == 1 ? bno + (*i)++ : mkind(bno, nb, i, level - 1));
+  wblk(freeblock, a);
+  return freeblock++;
+}
+
+// Point din at nb contiguous data blocks from bno, and write
+// the indirect blocks that needs right after them.
+static void imap(struct xinode *din, uint bno, uint nb) {
+  uint i;
+  int level;
+
+  for (i = 0; i < nb && i < ndirect; i++)
+    din->addrs[i] = xint(bno + i);
+
+  for (level = 1; i < nb; level++)
+    din->addrs[ndirect + level - 1] = xint(mkind(bno, nb, &i, level));
+}
+
+// Called by nftw() for each file under the host directory, parents
+// first: allocate its inode, its entry in the parent and, for a file,
+// a contiguous run of data blocks that a worker fills in later.
+static int visit(const char *path, const struct stat *st, int flag,
+                 struct FTW *ftw) {
+  const char *name = path + ftw->base;
+  struct xinode din;
+  uint inum, pinum, nb;
+
+  if (ftw->level == 0)
+    return FTW_CONTINUE; // the root directory
+  if (ftw->level == 1 && sb.snapdir && strcmp(name, SNAPDIR) == 0) {
+    fprintf(stderr, "mkfs: skip %s: reserved\n", path);
+    return flag == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+  }
+  if (ftw->level >= MAXDEPTH || strlen(name) > DIRSIZ ||
+      (flag != FTW_F && flag != FTW_D) ||
+      (flag == FTW_F && !S_ISREG(st->st_mode))) {
+    fprintf(stderr, "mkfs: skip %s\n", path);
+    return flag == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+  }
+  if (flag == FTW_F && st->st_size > (off_t)maxfile * BSIZE) {
+    fprintf(stderr, "mkfs: skip %s: too big\n", path);
+    return FTW_CONTINUE;
+  }
+  if (freeinode >= xint(sb.ninodes)) {
+    fprintf(stderr, "mkfs: out of inodes, use -i\n");
+    exit(1);
+  }
+
+  inum = iialloc(flag == FTW_D ? T_DIR : T_FILE);
+  dirent_add(&dirs[dstack[ftw->level - 1]], inum, name);
+
+  if (flag == FTW_D) {
+    pinum = dirs[dstack[ftw->level - 1]].inum;
+    dstack[ftw->level] = mdir_new(inum, pinum);
+    rinode(pinum, &din); // for ".."
+    din.nlink = xshort(xshort(din.nlink) + 1);
+    winode(pinum, &din);
+    return FTW_CONTINUE;
+  }
+
+  nb = (st->st_size + BSIZE - 1) / BSIZE;
+  if ((uint64)freeblock + nb + nb / (NINDIRECT - 1) + NLEVEL > nblks) {
+    fprintf(stderr, "mkfs: out of blocks\n");
+    exit(1);
+  }
+  rinode(inum, &din);
+  din.size = st->st_size;
+  jobs = grow(jobs, njobs + 1, sizeof(struct job));
+  jobs[njobs].path = strdup(path);
+  jobs[njobs].bno = freeblock;
+  jobs[njobs].size = st->st_size;
+  njobs++;
+  freeblock += nb;
+  imap(&din, jobs[njobs - 1].bno, nb);
+  winode(inum, &din);
+
+  return FTW_CONTINUE;
+}
+
+// Read up to n bytes, short only at end of file.
+static ssize_t readn(int fd, char *buf, size_t n) {
+  ssize_t r, tot;
+
+  for (tot = 0; tot < n; tot += r)
+    if ((r = read(fd, buf + tot, n - tot)) <= 0)
+      break;
+  return tot;
+}
+
+// copy the data of the files in jobs to their blocks, a file at a time
+static void *copier(void *arg) {
+  char *buf;
+  struct job *j;
+  off_t off;
+  ssize_t n;
+  size_t len;
+  int fd;
+
+  if ((buf = malloc(COPYBUF)) == 0) {
+    printf("mkfs: out of memory");
+    exit(1);
+  }
+  for (;;) {
+    pthread_mutex_lock(&joblock);
+    j = nextjob < njobs ? &jobs[nextjob++] : 0;
+    pthread_mutex_unlock(&joblock);
+    if (j == 0)
+      break;
+
+    if ((fd = open(j->path, O_RDONLY)) < 0) {
+      fprintf(stderr, "mkfs: can't open %s\n", j->path);
+      continue;
+    }
+    // whole chunks, so each starts on a block
+    for (off = 0; off < j->size; off += n) {
+      // the file may have grown
+      if ((n = readn(fd, buf, min(COPYBUF, j->size - off))) <= 0)
+        break;
+      len = n;
+      if (keyed) {
+        // encrypted whole blocks, the last one padded with zeroes
+        len = (n + BSIZE - 1) / BSIZE * BSIZE;
+        memset(buf + n, 0, len - n);
+        encblks(j->bno + off / BSIZE, buf, len);
+      }
+      if (pwrite(fsfd, buf, len, (off_t)j->bno * BSIZE + off) != len) {
+        printf("mkfs: write");
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+
+  free(buf);
+  return 0;
+}
+
+// Build the root directory and, if dir is set, copy the host tree
+// under dir into the image: one pass lays out all inodes, directories
+// and contiguous data runs, then worker threads stream the file data.
+void populate(char *dir) {
+  pthread_t tid[NWORKER];
+  struct xinode din;
+  int i, nworker;
+
+  dstack[0] = mdir_new(ROOTINO, ROOTINO);
+  if (sb.snapdir) {
+    dirent_add(&dirs[dstack[0]], xint(sb.snapdir), SNAPDIR);
+    mdir_new(xint(sb.snapdir), ROOTINO);
+    rinode(ROOTINO, &din); // for ".."
+    din.nlink = xshort(xshort(din.nlink) + 1);
+    winode(ROOTINO, &din);
+  }
+  if (dir && nftw(dir, visit, 64, FTW_PHYS | FTW_ACTIONRETVAL) != 0) {
+    fprintf(stderr, "mkfs: can't read %s\n", dir);
+    exit(1);
+  }
+
+  for (i = 0; i < ndirs; i++)
+    iappend(dirs[i].inum, dirs[i].de, dirs[i].n * sizeof(struct dirent));
+
+  nworker = min(NWORKER, njobs);
+  for (i = 0; i < nworker; i++)
+    pthread_create(&tid[i], 0, copier, 0);
+  for (i = 0; i < nworker; i++)
+    pthread_join(tid[i], 0);
+
+  if (dir)
+    printf("populate: %d dirs %d files, %u blocks used\n", ndirs, njobs,
+           freeblock);
+}
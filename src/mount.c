@@ -0,0 +1,135 @@
+// Mounting and unmounting images, for the shell and for programs
+// linking libsecfs. Each mount has a device no of its own and its own
+// caches, log, inode and file tables and background threads; a thread
+// works on one mount at a time (secfs_use()), and the ff*() calls
+// (filecall.c) work on it.
+#include "defs.h"
+#include "file.h"
+
+struct secfs *mounts[NMOUNT]; // by device no
+__thread struct secfs *curfs;
+static pthread_mutex_t mountlock = PTHREAD_MUTEX_INITIALIZER;
+
+// AES keys are per process: encrypted images mounted at once must
+// share theirs.
+static uchar mountkey[XTSKEYLEN];
+static int nkeyed; // mounts of encrypted images
+
+// Mount the image in file path: datamode is DATA_JOURNAL or
+// DATA_ORDERED, sync is 1 to write file data through at once (as
+// secfs -o sync), and keyfile is the key of an encrypted image, or 0.
+// The calling thread then works on it. Returns the mount, or 0 if the
+// image or key cannot be read, NMOUNT images are mounted, another
+// encrypted image is mounted with another key, or a trace is being
+// taken (trace.c).
+struct secfs *secfs_mount(const char *path, int datamode, int sync,
+                          const char *keyfile) {
+  uchar key[XTSKEYLEN];
+  struct secfs *fs;
+  FILE *img;
+  uint dev;
+
+  if (keyfile && xts_loadkey(keyfile, key) < 0)
+    return 0;
+  if ((fs = calloc(1, sizeof(*fs))) == 0)
+    return 0;
+  pthread_mutex_lock(&mountlock);
+  for (dev = ROOTDEV; dev < NMOUNT && mounts[dev]; dev++)
+    ;
+  if (dev == NMOUNT ||
+      (keyfile && nkeyed > 0 && memcmp(key, mountkey, XTSKEYLEN) != 0) ||
+      tracemount() < 0) {
+    pthread_mutex_unlock(&mountlock);
+    free(fs);
+    return 0;
+  }
+  if ((img = fopen(path, "r+b")) == NULL) {
+    traceunmount();
+    pthread_mutex_unlock(&mountlock);
+    free(fs);
+    return 0;
+  }
+  if (keyfile) {
+    if (nkeyed++ == 0) {
+      memcpy(mountkey, key, XTSKEYLEN);
+      xts_setkey(key);
+    }
+  }
+  fs->dev = dev;
+  fs->bsize = DEFBSIZE;
+  fs->syncwrite = sync;
+  fs->path = strdup(path);
+  fs->keyed = keyfile != 0;
+  mounts[dev] = fs;
+  pthread_mutex_unlock(&mountlock);
+  curfs = fs;
+
+  // init buffer cache
+  binit();
+  // init virtual disk
+  virtio_disk_init(img);
+  // init inode table
+  iinit();
+  // init fs
+  fsinit(dev, datamode);
+  // init file table
+  fileinit();
+  // init page cache and its flusher
+  pcacheinit();
+  // init cwd
+  init_cwd();
+
+  return fs;
+}
+
+// Close the files left open on fs, write everything back, free what
+// unlinked files held and close the image. No other thread may be
+// working on fs. The calling thread is left with no mount. Returns 0,
+// or -1 if fs is not mounted.
+int secfs_unmount(struct secfs *fs) {
+  int fd;
+
+  pthread_mutex_lock(&mountlock);
+  if (fs == 0 || fs->dev >= NMOUNT || mounts[fs->dev] != fs) {
+    pthread_mutex_unlock(&mountlock);
+    return -1;
+  }
+  pthread_mutex_unlock(&mountlock);
+
+  curfs = fs;
+  for (fd = 0; fd < NOFILE; fd++)
+    if (fs->ofile[fd])
+      ffclose(fd);
+  pcachedone();
+  fsdone();
+  logdone();
+  filedone();
+  bdone();
+  virtio_disk_done();
+
+  pthread_mutex_lock(&mountlock);
+  mounts[fs->dev] = 0;
+  if (fs->keyed)
+    nkeyed--;
+  traceunmount();
+  pthread_mutex_unlock(&mountlock);
+  curfs = 0;
+  free(fs->path);
+  free(fs);
+  return 0;
+}
+
+// Make the calling thread work on fs, or if fs is 0, on the first
+// image mounted (by device no), if any.
+void secfs_use(struct secfs *fs) {
+  int dev;
+
+  if (fs == 0) {
+    pthread_mutex_lock(&mountlock);
+    for (dev = 0; dev < NMOUNT && mounts[dev] == 0; dev++)
+      ;
+    fs = dev < NMOUNT ? mounts[dev] : 0;
+    pthread_mutex_unlock(&mountlock);
+  }
+  curfs = fs;
+}
@@ -0,0 +1,18 @@
+#ifndef PAGE_H
+#define PAGE_H
+
+#include "defs.h"
+
+// A cached block of file data that has no disk block of its own yet,
+// or whose disk block is stale. Protected by the owning inode's lock.
+struct page {
+  struct inode *ip; // owner
+  uint lbn;         // block no within the file
+
+  struct page *hnext;         // next page in the same hash bucket
+  struct page *prev, *next;   // all pages, oldest first
+  struct page *iprev, *inext; // pages of the same inode
+  char data[];                // the data of the page, BSIZE bytes
+};
+
+#endif
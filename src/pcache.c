@@ -0,0 +1,249 @@
+#include "file.h"
+#include "page.h"
+#include "spinlock.h"
+#include <errno.h>
+#include <time.h>
+
+#define NPBUCKET 251 // hash buckets for page lookup
+#define PHASH(ip, lbn) ((((uint64)(ip) >> 4) * 31 + (lbn)) % NPBUCKET)
+
+// Write-back cache of file data, one per mount.
+// ffwrite() copies data into pages without allocating disk blocks;
+// iflush() allocates the blocks and writes the pages out, on ffclose(),
+// ffsync(), when the cache is full, and from the flusher thread.
+struct pcache {
+  struct spinlock lock;
+  struct page *hash[NPBUCKET];
+  struct page head; // list of all pages, head.next is the oldest
+  int npage;
+
+  pthread_t flusher;
+  pthread_mutex_t flush_mutex;
+  pthread_cond_t flush_cond;
+  int flush_kicked;
+  int flush_stop; // pcachedone() is stopping the flusher
+};
+
+static void *flusher(void *arg);
+
+void pcacheinit(void) {
+  struct pcache *pc;
+
+  if ((pc = curfs->pages = calloc(1, sizeof(struct pcache))) == 0) {
+    printf("panic: pcacheinit: out of memory");
+    exit(1);
+  }
+  init_spinlock(&pc->lock, "pcache");
+  pc->head.prev = &pc->head;
+  pc->head.next = &pc->head;
+  pthread_mutex_init(&pc->flush_mutex, 0);
+  pthread_cond_init(&pc->flush_cond, 0);
+
+  if (pthread_create(&pc->flusher, 0, flusher, curfs) != 0) {
+    printf("panic: pcacheinit: flusher");
+    exit(1);
+  }
+}
+
+// Write back every page, stop the flusher and free the cache.
+void pcachedone(void) {
+  struct pcache *pc = curfs->pages;
+
+  pflushall();
+  pthread_mutex_lock(&pc->flush_mutex);
+  pc->flush_stop = 1;
+  pthread_cond_signal(&pc->flush_cond);
+  pthread_mutex_unlock(&pc->flush_mutex);
+  pthread_join(pc->flusher, 0);
+  pthread_mutex_destroy(&pc->flush_mutex);
+  pthread_cond_destroy(&pc->flush_cond);
+  free(pc);
+  curfs->pages = 0;
+}
+
+// Return ip's page for block lbn, or 0 if it is not cached.
+// Caller must hold ip->lock.
+struct page *plookup(struct inode *ip, uint lbn) {
+  struct pcache *pc = DEVFS(ip->dev)->pages;
+  struct page *pg;
+
+  acquire_spinlock(&pc->lock);
+  for (pg = pc->hash[PHASH(ip, lbn)]; pg; pg = pg->hnext) {
+    if (pg->ip == ip && pg->lbn == lbn)
+      break;
+  }
+  release_spinlock(&pc->lock);
+
+  return pg;
+}
+
+// Return ip's page for block lbn, adding a zeroed one if it is not
+// cached; *isnew tells which. Caller must hold ip->lock.
+struct page *pget(struct inode *ip, uint lbn, int *isnew) {
+  struct pcache *pc = DEVFS(ip->dev)->pages;
+  struct page *pg;
+
+  if ((pg = plookup(ip, lbn)) != 0) {
+    *isnew = 0;
+    return pg;
+  }
+
+  if ((pg = calloc(1, sizeof(*pg) + BSIZE)) == 0) {
+    printf("panic: pget: out of memory");
+    exit(1);
+  }
+  pg->ip = ip;
+  pg->lbn = lbn;
+  pg->inext = ip->pages;
+  if (ip->pages)
+    ip->pages->iprev = pg;
+  ip->pages = pg;
+  ip->npage++;
+
+  acquire_spinlock(&pc->lock);
+  pg->hnext = pc->hash[PHASH(ip, lbn)];
+  pc->hash[PHASH(ip, lbn)] = pg;
+  pg->prev = pc->head.prev;
+  pg->next = &pc->head;
+  pc->head.prev->next = pg;
+  pc->head.prev = pg;
+  pc->npage++;
+  release_spinlock(&pc->lock);
+
+  *isnew = 1;
+  return pg;
+}
+
+// Remove pg from the cache and free it.
+// Caller must hold pg->ip->lock.
+void pfree(struct page *pg) {
+  struct inode *ip = pg->ip;
+  struct pcache *pc = DEVFS(ip->dev)->pages;
+  struct page **pp;
+
+  if (pg->iprev)
+    pg->iprev->inext = pg->inext;
+  else
+    ip->pages = pg->inext;
+  if (pg->inext)
+    pg->inext->iprev = pg->iprev;
+  ip->npage--;
+
+  acquire_spinlock(&pc->lock);
+  for (pp = &pc->hash[PHASH(ip, pg->lbn)]; *pp; pp = &(*pp)->hnext) {
+    if (*pp == pg) {
+      *pp = pg->hnext;
+      break;
+    }
+  }
+  pg->prev->next = pg->next;
+  pg->next->prev = pg->prev;
+  pc->npage--;
+  release_spinlock(&pc->lock);
+
+  free(pg);
+}
+
+// Discard all of ip's pages without writing them.
+// Caller must hold ip->lock.
+void pdrop(struct inode *ip) {
+  while (ip->pages)
+    pfree(ip->pages);
+}
+
+static int lbncmp(const void *a, const void *b) {
+  uint x = (*(struct page **)a)->lbn, y = (*(struct page **)b)->lbn;
+  return x < y ? -1 : x > y;
+}
+
+// Return ip's pages sorted by block no in a malloc'ed array.
+// Caller must hold ip->lock and free the array.
+int ppages(struct inode *ip, struct page ***ppgs) {
+  struct page *pg, **pgs;
+  int n = 0;
+
+  if ((pgs = malloc((ip->npage + 1) * sizeof(*pgs))) == 0) {
+    printf("panic: ppages: out of memory");
+    exit(1);
+  }
+  // new pages go first on ip->pages, so appends come out already sorted
+  n = ip->npage;
+  for (pg = ip->pages; pg; pg = pg->inext)
+    pgs[--n] = pg;
+  for (n = 1; n < ip->npage && pgs[n - 1]->lbn < pgs[n]->lbn; n++)
+    ;
+  if (n < ip->npage)
+    qsort(pgs, ip->npage, sizeof(*pgs), lbncmp);
+  n = ip->npage;
+
+  *ppgs = pgs;
+  return n;
+}
+
+// Is the cache over its size limit?
+// Writers then flush their own file and wake the flusher.
+int pfull(void) { return curfs->pages->npage >= NPAGEBYTES / BSIZE; }
+
+// Wake the flusher thread early.
+void pkick(void) {
+  struct pcache *pc = curfs->pages;
+
+  pthread_mutex_lock(&pc->flush_mutex);
+  pc->flush_kicked = 1;
+  pthread_cond_signal(&pc->flush_cond);
+  pthread_mutex_unlock(&pc->flush_mutex);
+}
+
+// Flush every file that has cached pages.
+void pflushall(void) {
+  struct pcache *pc = curfs->pages;
+  struct inode *ips[NINODE];
+  struct page *pg;
+  int i, n = 0;
+
+  // collect the owners, oldest pages first
+  acquire_spinlock(&pc->lock);
+  for (pg = pc->head.next; pg != &pc->head && n < NINODE; pg = pg->next) {
+    for (i = 0; i < n && ips[i] != pg->ip; i++)
+      ;
+    if (i == n)
+      ips[n++] = idup(pg->ip);
+  }
+  release_spinlock(&pc->lock);
+
+  for (i = 0; i < n; i++) {
+    iflush(ips[i]);
+    begin_op();
+    iput(ips[i]);
+    end_op();
+  }
+}
+
+// Write back cached pages of mount arg every FLUSHSEC seconds,
+// or as soon as writers find the cache full.
+static void *flusher(void *arg) {
+  struct pcache *pc;
+  struct timespec ts;
+  int stop;
+
+  curfs = arg;
+  pc = curfs->pages;
+  for (;;) {
+    pthread_mutex_lock(&pc->flush_mutex);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += FLUSHSEC;
+    while (!pc->flush_kicked && !pc->flush_stop &&
+           pthread_cond_timedwait(&pc->flush_cond, &pc->flush_mutex,
+                                  &ts) != ETIMEDOUT)
+      ;
+    pc->flush_kicked = 0;
+    stop = pc->flush_stop;
+    pthread_mutex_unlock(&pc->flush_mutex);
+    if (stop)
+      break;
+
+    pflushall();
+  }
+
+  return 0;
+}
@@ -1,11 +1,8 @@
 #include "defs.h"
 #include "file.h"
 #include "stdio.h"
+#include <unistd.h>
 
-#define MAX_ARG 5
-FILE *img_file;
-struct file *ofile[NOFILE]; // Open files
-extern struct inode *cwd;
 const char *initdirs[] = {
     "bin",
     "dev",
@@ -16,56 +13,104 @@ const char *initdirs[] = {
 int resolve_inst(char *args[], int arg_cnt);
 void check_initdir();
 
-int main() {
-  // open image file
-  img_file = fopen("fs.img", "r+b");
-  if (img_file == NULL) {
-    printf("main: can't open img_file\n");
+static struct secfs *fs;
+static int failed; // a command failed
+
+static void usage(void) {
+  printf("Usage: secfs [-o data=journal|data=ordered|sync] [-k keyfile] "
+         "[-t tracefile] [-b script|-]\n");
+  exit(1);
+}
+
+// Split line into args (growing *args as needed), return their count.
+static int split(char *line, char ***args, int *maxarg) {
+  int arg_cnt = 0;
+  char *token = strtok(line, " \t\r\n");
+
+  while (token != NULL) {
+    if (arg_cnt + 1 >= *maxarg) {
+      *maxarg *= 2;
+      if ((*args = realloc(*args, *maxarg * sizeof(char *))) == NULL) {
+        printf("main: out of memory\n");
+        exit(1);
+      }
+    }
+    (*args)[arg_cnt++] = token;
+    token = strtok(NULL, " \t\r\n");
+  }
+  (*args)[arg_cnt] = NULL;
+  return arg_cnt;
+}
+
+int main(int argc, char *argv[]) {
+  int opt, datamode = DATA_JOURNAL, sync = 0, lineno = 0;
+  int maxarg = 8, arg_cnt;
+  char *trace = 0, *keyfile = 0, *script = 0, *line = 0, **args;
+  size_t linecap = 0;
+  FILE *in = stdin;
+
+  // parse mount options
+  while ((opt = getopt(argc, argv, "o:k:t:b:")) != -1) {
+    if (opt == 'o' && !strcmp(optarg, "data=journal"))
+      datamode = DATA_JOURNAL;
+    else if (opt == 'o' && !strcmp(optarg, "data=ordered"))
+      datamode = DATA_ORDERED;
+    else if (opt == 'o' && !strcmp(optarg, "sync"))
+      sync = 1;
+    else if (opt == 'k')
+      keyfile = optarg; // for an encrypted image
+    else if (opt == 't')
+      trace = optarg; // record the file calls, for build/replay
+    else if (opt == 'b')
+      script = optarg; // run commands without prompts, "-" from stdin
+    else
+      usage();
+  }
+  if (script && strcmp(script, "-") && (in = fopen(script, "r")) == NULL) {
+    printf("main: can't open %s\n", script);
     exit(1);
   }
 
-  // init buffer cache
-  binit();
-  // init virtual disk
-  virtio_disk_init();
-  // init fs
-  fsinit(ROOTDEV);
-  // init inode table
-  iinit();
-  // init file table
-  fileinit();
-  // init cwd
-  init_cwd();
+  // mount the image
+  if ((fs = secfs_mount("fs.img", datamode, sync, keyfile)) == 0) {
+    printf("main: can't mount fs.img\n");
+    exit(1);
+  }
+  // start tracing
+  if (trace && traceopen(trace) < 0) {
+    printf("main: can't write %s\n", trace);
+    exit(1);
+  }
   // check init dir
   check_initdir();
 
-  printf("SecFs start successfully!\n");
+  if (!script)
+    printf("SecFs start successfully!\n");
 
+  if ((args = malloc(maxarg * sizeof(char *))) == NULL) {
+    printf("main: out of memory\n");
+    exit(1);
+  }
   while (1) {
-    char inst[40];
-    char *args[MAX_ARG];
-    int arg_cnt = 0;
-
-    printf("$ ");
-    fgets(inst, sizeof(inst), stdin);
-    char *token = strtok(inst, " \n");
-    while (token != NULL) {
-      args[arg_cnt] = token;
-      arg_cnt++;
-      if (arg_cnt >= MAX_ARG) {
-        break;
-      }
-      token = strtok(NULL, " \n");
-    }
-    args[arg_cnt] = NULL;
+    if (!script)
+      printf("$ ");
+    if (getline(&line, &linecap, in) < 0)
+      break;
+    lineno++;
+    if ((arg_cnt = split(line, &args, &maxarg)) == 0 || args[0][0] == '#')
+      continue;
 
-    if (resolve_inst(args, arg_cnt))
+    if (resolve_inst(args, arg_cnt)) {
+      failed = 1;
+      if (script)
+        printf("%s:%d: ", script, lineno);
       printf("resolve %s failed\n", args[0]);
+    }
   }
 
-  // close image file
-  fclose(img_file);
-  return 0;
+  // end of input: as exit
+  secfs_unmount(fs);
+  return failed;
 }
 
 // return value: 0: success, -1: fail
@@ -97,7 +142,7 @@ int resolve_inst(char *args[], int arg_cnt) {
     // TODO
     return -1;
   } else if (!strcmp("mkdir", args[0])) {
-    return mkdir(args, arg_cnt);
+    return fmkdir(args, arg_cnt);
   } else if (!strcmp("del", args[0])) {
     return rm(args, arg_cnt);
   } else if (!strcmp("touch", args[0])) {
@@ -106,13 +151,19 @@ int resolve_inst(char *args[], int arg_cnt) {
     return cat(args, arg_cnt);
   } else if (!strcmp("import", args[0])) {
     return fimport(args, arg_cnt);
+  } else if (!strcmp("export", args[0])) {
+    return fexport(args, arg_cnt);
   } else if (!strcmp("testseek", args[0])) {
     return testseek(args, arg_cnt);
+  } else if (!strcmp("snap", args[0])) {
+    return snap(args, arg_cnt);
+  } else if (!strcmp("clone", args[0])) {
+    return fclone(args, arg_cnt);
+  } else if (!strcmp("stats", args[0])) {
+    return stats(args, arg_cnt);
   } else if (!strcmp("exit", args[0])) {
-    fclose(img_file);
-    exit(0);
-  } else if (!strcmp("", args[0])) {
-    return 0;
+    secfs_unmount(fs);
+    exit(failed);
   } else {
     return -1;
   }
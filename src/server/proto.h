@@ -0,0 +1,50 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include "../defs.h"
+
+// The protocol of secfsd (server/secfsd.c): a client sends requests,
+// each a struct sreq and len bytes of payload, without waiting for the
+// replies, which come back in the same order, each a struct srep and
+// len bytes of data. Integers are in host order: clients are local.
+#define S_NOP 0    // ret 0
+#define S_OPEN 1   // payload path, off the O_* mode; ret fd
+#define S_CLOSE 2  // fd
+#define S_PREAD 3  // fd, off, n; data what was read
+#define S_PWRITE 4 // fd, off, payload the data; ret bytes written
+#define S_FSYNC 5  // fd
+#define S_FSTAT 6  // fd; data a struct sstat
+#define S_UNLINK 7 // payload path
+#define S_MKDIR 8  // payload path
+#define S_LINK 9   // payload old path, its 0, new path
+#define NSOP 10
+
+#define SMAXIO (1024 * 1024) // largest payload or data
+#define SPORT 7117           // default TCP port
+#define SSOCK "secfs.sock"   // default Unix socket
+
+struct sreq {
+  uint len; // payload bytes
+  uint tag; // anything, echoed in the reply
+  ushort op;
+  ushort pad;
+  int fd;
+  int64 off;
+  uint n;
+  uint pad2;
+};
+
+struct srep {
+  uint len; // data bytes
+  uint tag;
+  int64 ret; // as the ff*() call returned, -1 on failure
+};
+
+struct sstat {
+  uint ino;
+  short type;
+  short nlink;
+  uint64 size;
+};
+
+#endif
@@ -0,0 +1,369 @@
+// secfsd: serves an image to local clients over a Unix socket, or TCP
+// on the loopback, with the protocol of proto.h. An epoll loop watches
+// the sockets, and hands each connection that has requests waiting to
+// one of a pool of worker threads. The worker reads all the requests
+// that have come (a pipelining client sends many before it waits),
+// runs them in order as one log batch, so that small operations share
+// a commit, and sends all their replies at once. Reads go from the
+// caches straight into the reply buffer.
+#include "../defs.h"
+#include "../file.h"
+#include "proto.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAXWORKER 16             // threads running requests
+#define MAXOUT (4 * 1024 * 1024) // replies a batch gathers before sending
+
+// A client connection.
+struct conn {
+  int sock;
+  char *in; // requests read, not yet run
+  uint nin, capin;
+  char *out; // replies of the running batch
+  uint nout, capout;
+  char fds[NOFILE];  // ff fds the client has open
+  struct conn *next; // in the work queue
+};
+
+static struct secfs *fs;
+static int epfd;
+static volatile int stopping;
+
+// connections with requests waiting
+static struct conn *qhead, *qtail;
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+
+static void usage(void) {
+  printf("Usage: secfsd [-o data=journal|data=ordered|sync] [-k keyfile] "
+         "[-j workers] [-s socket | -p port] fs.img\n");
+  exit(1);
+}
+
+static void *grow(void *p, uint *cap, uint need) {
+  if (need <= *cap)
+    return p;
+  while (*cap < need)
+    *cap = *cap ? *cap * 2 : 64 * 1024;
+  if ((p = realloc(p, *cap)) == 0) {
+    printf("panic: grow: out of memory");
+    exit(1);
+  }
+  return p;
+}
+
+static void enqueue(struct conn *c) {
+  pthread_mutex_lock(&qlock);
+  c->next = 0;
+  if (qtail)
+    qtail->next = c;
+  else
+    qhead = c;
+  qtail = c;
+  pthread_cond_signal(&qcond);
+  pthread_mutex_unlock(&qlock);
+}
+
+// The next connection to serve, or 0 when stopping.
+static struct conn *dequeue(void) {
+  struct conn *c;
+
+  pthread_mutex_lock(&qlock);
+  while (qhead == 0 && !stopping)
+    pthread_cond_wait(&qcond, &qlock);
+  if ((c = qhead) != 0 && (qhead = c->next) == 0)
+    qtail = 0;
+  pthread_mutex_unlock(&qlock);
+  return c;
+}
+
+// Watch c for more requests.
+static void watch(struct conn *c, int op) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = c;
+  epoll_ctl(epfd, op, c->sock, &ev);
+}
+
+// Close the connection and the files the client left open.
+static void drop(struct conn *c) {
+  int fd;
+
+  for (fd = 0; fd < NOFILE; fd++)
+    if (c->fds[fd])
+      ffclose(fd);
+  close(c->sock);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+// The client's file fd, or -1 if it has not opened it.
+static int myfd(struct conn *c, int fd) {
+  return fd >= 0 && fd < NOFILE && c->fds[fd] ? fd : -1;
+}
+
+// Run request q with payload p, and add its reply to c->out.
+static void run(struct conn *c, struct sreq *q, char *p) {
+  struct srep *r;
+  struct stat st;
+  struct sstat *ss;
+  char *data;
+  int fd = myfd(c, q->fd);
+  int paths = q->len > 0 && p[q->len - 1] == 0; // payload ends with a 0
+  uint n = q->op == S_PREAD ? q->n : sizeof(struct sstat);
+
+  c->out = grow(c->out, &c->capout, c->nout + sizeof(*r) + n);
+  r = (struct srep *)(c->out + c->nout);
+  data = (char *)(r + 1);
+  r->tag = q->tag;
+  r->len = 0;
+  r->ret = -1;
+  switch (q->op) {
+  case S_NOP:
+    r->ret = 0;
+    break;
+  case S_OPEN:
+    if (paths && (r->ret = ffopen(p, q->off)) >= 0)
+      c->fds[r->ret] = 1;
+    break;
+  case S_CLOSE:
+    if (fd >= 0 && (r->ret = ffclose(fd)) == 0)
+      c->fds[fd] = 0;
+    break;
+  case S_PREAD:
+    if (fd >= 0 && (r->ret = ffpread(fd, data, q->n, q->off)) > 0)
+      r->len = r->ret;
+    break;
+  case S_PWRITE:
+    if (fd >= 0)
+      r->ret = ffpwrite(fd, p, q->len, q->off);
+    break;
+  case S_FSYNC:
+    if (fd >= 0)
+      r->ret = ffsync(fd);
+    break;
+  case S_FSTAT:
+    if (fd >= 0 && (r->ret = ffstat(fd, &st)) == 0) {
+      ss = (struct sstat *)data;
+      ss->ino = st.ino;
+      ss->type = st.type;
+      ss->nlink = st.nlink;
+      ss->size = st.size;
+      r->len = sizeof(*ss);
+    }
+    break;
+  case S_UNLINK:
+    if (paths)
+      r->ret = ffunlink(p);
+    break;
+  case S_MKDIR:
+    if (paths)
+      r->ret = ffmkdir(p);
+    break;
+  case S_LINK:
+    if (paths && strlen(p) + 1 < q->len)
+      r->ret = fflink(p, p + strlen(p) + 1);
+    break;
+  }
+  c->nout += sizeof(*r) + r->len;
+}
+
+// Send c->out. Returns 0, or -1 if the client is gone.
+static int flush(struct conn *c) {
+  uint off = 0;
+  int n;
+
+  while (off < c->nout) {
+    if ((n = send(c->sock, c->out + off, c->nout - off, MSG_NOSIGNAL)) > 0)
+      off += n;
+    else if (errno != EINTR)
+      return -1;
+  }
+  c->nout = 0;
+  return 0;
+}
+
+// Read the requests that have come on c, and run and answer those
+// that have come whole. Returns 0, or -1 to drop c.
+static int serve(struct conn *c) {
+  struct sreq *q;
+  uint off, end, nq;
+  int n;
+
+  c->in = grow(c->in, &c->capin, c->nin + 64 * 1024);
+  n = recv(c->sock, c->in + c->nin, c->capin - c->nin, MSG_DONTWAIT);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    return -1;
+  c->nin += n > 0 ? n : 0;
+
+  for (off = 0;;) {
+    // find the whole requests, up to MAXOUT of replies
+    for (end = off, nq = 0, n = 0; end + sizeof(*q) <= c->nin; nq++) {
+      q = (struct sreq *)(c->in + end);
+      if (q->len > SMAXIO || q->n > SMAXIO)
+        return -1;
+      if (end + sizeof(*q) + q->len > c->nin || n > MAXOUT)
+        break;
+      n += sizeof(struct srep) + (q->op == S_PREAD ? q->n : 0);
+      end += sizeof(*q) + q->len;
+    }
+    if (nq == 0)
+      break;
+    // a batch even of one: end_batch() waits for the commit, which
+    // end_op() leaves to another worker's operation if one is running
+    begin_batch();
+    for (; off < end; off += sizeof(*q) + q->len) {
+      q = (struct sreq *)(c->in + off);
+      run(c, q, (char *)(q + 1));
+    }
+    end_batch(); // durable before they are answered
+    if (flush(c) < 0)
+      return -1;
+  }
+  memmove(c->in, c->in + off, c->nin - off);
+  c->nin -= off;
+  // a request bigger than what fits waits for room
+  if (c->nin >= sizeof(*q)) {
+    q = (struct sreq *)c->in;
+    c->in = grow(c->in, &c->capin, sizeof(*q) + q->len + 64 * 1024);
+  }
+  return 0;
+}
+
+static void *worker(void *arg) {
+  struct conn *c;
+
+  secfs_use(fs);
+  while ((c = dequeue()) != 0) {
+    if (serve(c) < 0)
+      drop(c);
+    else
+      watch(c, EPOLL_CTL_MOD);
+  }
+  return 0;
+}
+
+// A socket listening on the Unix socket path, or on the loopback at
+// port if it is not 0.
+static int listento(const char *path, int port) {
+  struct sockaddr_un un;
+  struct sockaddr_in in;
+  int s, one = 1;
+
+  if (port) {
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (s < 0 || bind(s, (struct sockaddr *)&in, sizeof(in)) < 0)
+      return -1;
+  } else {
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", path);
+    unlink(path);
+    if (s < 0 || bind(s, (struct sockaddr *)&un, sizeof(un)) < 0)
+      return -1;
+  }
+  return listen(s, 128) < 0 ? -1 : s;
+}
+
+static void stop(int sig) { stopping = 1; }
+
+int main(int argc, char *argv[]) {
+  int opt, i, n, s, lsock, port = 0, one = 1, nworker = 4;
+  int datamode = DATA_JOURNAL, sync = 0;
+  char *keyfile = 0, *path = SSOCK;
+  struct epoll_event ev[64];
+  pthread_t th[MAXWORKER];
+  struct conn *c;
+  sigset_t sigs;
+
+  while ((opt = getopt(argc, argv, "o:k:j:s:p:")) != -1) {
+    if (opt == 'o' && !strcmp(optarg, "data=journal"))
+      datamode = DATA_JOURNAL;
+    else if (opt == 'o' && !strcmp(optarg, "data=ordered"))
+      datamode = DATA_ORDERED;
+    else if (opt == 'o' && !strcmp(optarg, "sync"))
+      sync = 1;
+    else if (opt == 'k')
+      keyfile = optarg;
+    else if (opt == 'j' && (nworker = atoi(optarg)) > 0 &&
+             nworker <= MAXWORKER)
+      ;
+    else if (opt == 's')
+      path = optarg;
+    else if (opt == 'p' && (port = atoi(optarg)) > 0 && port < 65536)
+      ;
+    else
+      usage();
+  }
+  if (argc - optind != 1)
+    usage();
+
+  if ((fs = secfs_mount(argv[optind], datamode, sync, keyfile)) == 0) {
+    printf("secfsd: can't mount %s\n", argv[optind]);
+    exit(1);
+  }
+  if ((lsock = listento(path, port)) < 0) {
+    printf("secfsd: can't listen on %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  epfd = epoll_create1(0);
+  ev[0].events = EPOLLIN;
+  ev[0].data.ptr = 0; // the listening socket
+  epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev[0]);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  // the workers block the signals, so they wake epoll_wait()
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, 0);
+  for (i = 0; i < nworker; i++)
+    pthread_create(&th[i], 0, worker, 0);
+  pthread_sigmask(SIG_UNBLOCK, &sigs, 0);
+
+  while (!stopping) {
+    if ((n = epoll_wait(epfd, ev, 64, -1)) < 0)
+      continue; // EINTR: stopping?
+    for (i = 0; i < n; i++) {
+      if (ev[i].data.ptr) {
+        enqueue(ev[i].data.ptr);
+        continue;
+      }
+      if ((s = accept(lsock, 0, 0)) < 0)
+        continue;
+      if (port)
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if ((c = calloc(1, sizeof(*c))) == 0) {
+        close(s);
+        continue;
+      }
+      c->sock = s;
+      watch(c, EPOLL_CTL_ADD);
+    }
+  }
+
+  pthread_mutex_lock(&qlock);
+  pthread_cond_broadcast(&qcond);
+  pthread_mutex_unlock(&qlock);
+  for (i = 0; i < nworker; i++)
+    pthread_join(th[i], 0);
+  if (!port)
+    unlink(path);
+  secfs_unmount(fs); // closes what clients left open
+  return 0;
+}
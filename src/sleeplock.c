@@ -27,6 +27,26 @@ void acquire_sleeplock(struct sleeplock *lk) {
   pthread_mutex_unlock(&lk->mutex);
 }
 
+// Acquire lk and return how long it took to get it (ns), or 0 if it
+// was free; only a wait reads the clock.
+uint64 acquire_sleeplock_wait(struct sleeplock *lk) {
+  uint64 t = 0;
+
+  pthread_mutex_lock(&lk->mutex);
+
+  if (lk->locked) {
+    t = statnsec();
+    while (lk->locked) {
+      pthread_cond_wait(&lk->cond, &lk->mutex);
+    }
+    t = statnsec() - t;
+  }
+  lk->locked = 1;
+
+  pthread_mutex_unlock(&lk->mutex);
+  return t;
+}
+
 void release_sleeplock(struct sleeplock *lk) {
   pthread_mutex_lock(&lk->mutex);
 
@@ -15,6 +15,7 @@ struct sleeplock {
 void init_sleeplock(struct sleeplock *lk, char *name);
 void destroy_sleeplock(struct sleeplock *lk);
 void acquire_sleeplock(struct sleeplock *lk);
+uint64 acquire_sleeplock_wait(struct sleeplock *lk);
 void release_sleeplock(struct sleeplock *lk);
 int hold_sleeplock(struct sleeplock *lk);
 
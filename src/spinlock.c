@@ -1,5 +1,10 @@
 #include "spinlock.h"
 
+// sleep_spinlock()/wakeup_spinlock() share one condition variable;
+// sleepers re-check their condition, so a broadcast is enough.
+static pthread_mutex_t sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleep_cond = PTHREAD_COND_INITIALIZER;
+
 void init_spinlock(struct spinlock *lk, char *name) {
   lk->name = name;
   lk->locked = 0;
@@ -9,7 +14,10 @@ void init_spinlock(struct spinlock *lk, char *name) {
 // to be complete ?
 void destroy_spinlock(struct spinlock *lk) { pthread_spin_destroy(&lk->lock); }
 
-int hold_spinlock(struct spinlock *lk) { return lk->locked; }
+// Is the calling thread holding the lock?
+int hold_spinlock(struct spinlock *lk) {
+  return lk->locked && pthread_equal(lk->cpu, pthread_self());
+}
 
 void acquire_spinlock(struct spinlock *lk) {
   if (hold_spinlock(lk)) {
@@ -17,8 +25,9 @@ void acquire_spinlock(struct spinlock *lk) {
     exit(1);
   }
 
-  lk->locked = 1;
   pthread_spin_lock(&lk->lock);
+  lk->locked = 1;
+  lk->cpu = pthread_self();
 }
 
 void release_spinlock(struct spinlock *lk) {
@@ -30,3 +39,27 @@ void release_spinlock(struct spinlock *lk) {
   lk->locked = 0;
   pthread_spin_unlock(&lk->lock);
 }
+
+// Atomically release lk and wait on chan.
+// Reacquires lk when awakened.
+void sleep_spinlock(void *chan, struct spinlock *lk) {
+  (void)chan;
+
+  // Take sleep_mutex before releasing lk so that a wakeup issued
+  // after the caller's condition check cannot be missed.
+  pthread_mutex_lock(&sleep_mutex);
+  release_spinlock(lk);
+  pthread_cond_wait(&sleep_cond, &sleep_mutex);
+  pthread_mutex_unlock(&sleep_mutex);
+
+  acquire_spinlock(lk);
+}
+
+// Wake up all threads sleeping on chan.
+void wakeup_spinlock(void *chan) {
+  (void)chan;
+
+  pthread_mutex_lock(&sleep_mutex);
+  pthread_cond_broadcast(&sleep_cond);
+  pthread_mutex_unlock(&sleep_mutex);
+}
@@ -6,6 +6,7 @@
 struct spinlock {
   uint locked; // Is the lock held?
   pthread_spinlock_t lock;
+  pthread_t cpu; // The thread holding the lock.
 
   // debug fields:
   char *name; // name of lock.
@@ -16,5 +17,7 @@ void destroy_spinlock(struct spinlock *lk);
 void acquire_spinlock(struct spinlock *lk);
 void release_spinlock(struct spinlock *lk);
 int hold_spinlock(struct spinlock *lk);
+void sleep_spinlock(void *chan, struct spinlock *lk);
+void wakeup_spinlock(void *chan);
 
 #endif
@@ -0,0 +1,240 @@
+// Counters and latency histograms of what the file system does
+// (stats.h). Each thread counts in a slot of its own, taken on its
+// first count; when the thread ends its counts are added to the
+// retired sums and the slot is freed, so reading them sums the retired
+// sums and the slots of the live threads. A reset does not touch the
+// slots, which their threads write without locks: it remembers the
+// sums then, and later reads subtract them.
+//
+// When on, the event log keeps the last NEVENT timed events, to tell
+// which phase a slow operation spent its time in.
+#include "defs.h"
+#include "stats.h"
+#include <time.h>
+
+#define SLOTSIZE ((sizeof(struct statslot) + 63) / 64 * 64)
+#define NEVENT 4096 // events the log keeps
+
+// An event of the log.
+struct event {
+  uint64 ts;           // when it ended (ns since the log was cleared)
+  uint dur;            // how long it took (ns)
+  uint arg;            // as stats.h says for each H_*
+  ushort h;            // H_*
+  ushort tid;          // statslot id of the thread
+  volatile uint64 seq; // index of the event + 1, once filled in
+};
+
+__thread struct statslot *statmine;
+static struct statslot *slots;
+static int nslot;
+static struct statslot base;    // the sums at the last reset
+static struct statslot retired; // the sums of the threads that ended
+static pthread_mutex_t statlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t statkey; // frees a thread's slot when it ends
+static pthread_once_t statonce = PTHREAD_ONCE_INIT;
+
+volatile int evlogon;
+static struct event events[NEVENT];
+static uint64 nevent; // events logged, next is events[nevent % NEVENT]
+static uint64 evbase; // when the log was cleared
+
+const char *statname[NSTAT] = {
+    "bcache_hits",    "bcache_misses", "bcache_evictions", "disk_reads",
+    "disk_writes",    "disk_read_bytes", "disk_write_bytes", "transactions",
+    "commits",        "blocks_logged", "absorbed_writes",  "commit_ns",
+    "blocks_alloced", "blocks_freed",  "iget_hits",        "iget_misses",
+    "dirent_scanned",
+};
+
+const char *histname[NHIST] = {
+    "disk_read",  "disk_write", "commit",    "write_log",
+    "write_head", "install",    "bget_wait", "ilock_wait",
+};
+
+// Add the counts of slot s to sum.
+static void statadds(struct statslot *sum, volatile struct statslot *s) {
+  int i, j;
+
+  for (i = 0; i < NSTAT; i++)
+    sum->v[i] += s->v[i];
+  for (i = 0; i < NHIST; i++)
+    for (j = 0; j < NHBUCKET; j++)
+      sum->h[i][j] += s->h[i][j];
+}
+
+// Called as a thread that counted ends: add its counts to the retired
+// sums, and unlink and free its slot.
+static void statretire(void *p) {
+  struct statslot *s = p, **pp;
+
+  pthread_mutex_lock(&statlock);
+  statadds(&retired, s);
+  for (pp = &slots; *pp != s; pp = &(*pp)->next)
+    ;
+  *pp = s->next;
+  pthread_mutex_unlock(&statlock);
+  free(s);
+  statmine = 0;
+}
+
+static void statkeyinit(void) {
+  if (pthread_key_create(&statkey, statretire) != 0) {
+    printf("panic: statslot: pthread_key_create");
+    exit(1);
+  }
+}
+
+// Take a slot for the calling thread.
+struct statslot *statslot(void) {
+  struct statslot *s;
+
+  pthread_once(&statonce, statkeyinit);
+  if ((s = aligned_alloc(64, SLOTSIZE)) == 0) {
+    printf("panic: statslot: out of memory");
+    exit(1);
+  }
+  memset(s, 0, sizeof(*s));
+  pthread_mutex_lock(&statlock);
+  s->id = nslot++;
+  s->next = slots;
+  slots = s;
+  pthread_mutex_unlock(&statlock);
+  pthread_setspecific(statkey, s);
+  return s;
+}
+
+// The sums of all slots, ended threads' too. Caller holds statlock.
+static void statsum(struct statslot *sum) {
+  volatile struct statslot *s;
+
+  *sum = retired;
+  for (s = slots; s; s = s->next)
+    statadds(sum, s);
+}
+
+// Put in v[0..NSTAT-1] the counters, as counted since the last reset.
+void statget(uint64 *v) {
+  struct statslot *sum;
+  int i;
+
+  if ((sum = malloc(sizeof(*sum))) == 0) {
+    printf("panic: statget: out of memory");
+    exit(1);
+  }
+  pthread_mutex_lock(&statlock);
+  statsum(sum);
+  for (i = 0; i < NSTAT; i++)
+    v[i] = sum->v[i] - base.v[i];
+  pthread_mutex_unlock(&statlock);
+  free(sum);
+}
+
+// Put in b[0..NHBUCKET-1] histogram h, as counted since the last reset.
+void histget(int h, uint64 *b) {
+  struct statslot *sum;
+  int i;
+
+  if ((sum = malloc(sizeof(*sum))) == 0) {
+    printf("panic: histget: out of memory");
+    exit(1);
+  }
+  pthread_mutex_lock(&statlock);
+  statsum(sum);
+  for (i = 0; i < NHBUCKET; i++)
+    b[i] = sum->h[h][i] - base.h[h][i];
+  pthread_mutex_unlock(&statlock);
+  free(sum);
+}
+
+// The least value bucket i counts.
+static uint64 histlow(int i) {
+  int e;
+
+  if (i < 2 * HSUB)
+    return i;
+  e = i / HSUB + HSUBBITS - 1;
+  return (uint64)(i % HSUB + HSUB) << (e - HSUBBITS);
+}
+
+// The q quantile (0 < q <= 1) of histogram b in ns: the most a value in
+// its bucket can be. 0 if b is empty.
+uint64 histpct(const uint64 *b, double q) {
+  uint64 n = 0, k;
+  int i;
+
+  for (i = 0; i < NHBUCKET; i++)
+    n += b[i];
+  if (n == 0)
+    return 0;
+  k = (uint64)(q * n + 0.999999);
+  for (i = 0, n = 0; i < NHBUCKET - 1; i++)
+    if ((n += b[i]) >= k)
+      break;
+  return i < NHBUCKET - 1 ? histlow(i + 1) - 1 : histlow(i);
+}
+
+// Count from 0 again.
+void statreset(void) {
+  pthread_mutex_lock(&statlock);
+  statsum(&base);
+  pthread_mutex_unlock(&statlock);
+}
+
+// A monotonic clock in ns, to time things with.
+uint64 statnsec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Turn the event log on (clearing it) or off.
+void evlog(int on) {
+  uint64 i;
+
+  pthread_mutex_lock(&statlock);
+  if (on && !evlogon) {
+    for (i = 0; i < NEVENT; i++)
+      events[i].seq = 0;
+    nevent = 0;
+    evbase = statnsec();
+  }
+  evlogon = on;
+  pthread_mutex_unlock(&statlock);
+}
+
+// Log that an event of histogram h took ns and just ended.
+void evput(int h, uint64 ns, uint arg) {
+  uint64 i = __sync_fetch_and_add(&nevent, 1);
+  struct event *e = &events[i % NEVENT];
+
+  e->seq = 0;
+  e->ts = statnsec() - evbase;
+  e->dur = ns > 0xFFFFFFFF ? 0xFFFFFFFF : ns;
+  e->arg = arg;
+  e->h = h;
+  e->tid = statmine->id;
+  __sync_synchronize();
+  e->seq = i + 1;
+}
+
+// Print the logged events to f, oldest first: when each began and
+// ended (us), what it was, how long it took (us), its arg and thread.
+// Events being logged meanwhile may be left out.
+void evdump(FILE *f) {
+  uint64 i, n = nevent;
+  struct event e;
+
+  fprintf(f, "%12s %12s %-11s %10s %10s %4s\n", "start_us", "end_us", "event",
+          "dur_us", "arg", "tid");
+  for (i = n > NEVENT ? n - NEVENT : 0; i < n; i++) {
+    e = events[i % NEVENT];
+    __sync_synchronize();
+    if (e.seq != i + 1 || events[i % NEVENT].seq != i + 1)
+      continue;
+    fprintf(f, "%12.1f %12.1f %-11s %10.1f %10u %4u\n",
+            e.ts > e.dur ? (e.ts - e.dur) / 1e3 : 0.0, e.ts / 1e3,
+            histname[e.h], e.dur / 1e3, e.arg, e.tid);
+  }
+}
@@ -0,0 +1,90 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "defs.h"
+
+// Counters of what the file system does, kept per thread so that
+// counting costs an add to memory no other thread writes, and summed
+// when read (stats.c).
+#define ST_BHIT 0      // bget() found the block cached
+#define ST_BMISS 1     // bget() had to recycle a buffer
+#define ST_BEVICT 2    // ... that held another block
+#define ST_DREAD 3     // blocks read from disk
+#define ST_DWRITE 4    // blocks written to disk
+#define ST_DREADB 5    // bytes read from disk
+#define ST_DWRITEB 6   // bytes written to disk
+#define ST_TRANS 7     // transactions begun
+#define ST_COMMIT 8    // commits that wrote the log
+#define ST_LOGBLK 9    // blocks those commits logged
+#define ST_ABSORB 10   // log_write()s of a block already in the log
+#define ST_COMMITNS 11 // time spent in those commits (ns)
+#define ST_BALLOC 12   // blocks allocated
+#define ST_BFREE 13    // blocks freed
+#define ST_IHIT 14     // iget() found the inode in the table
+#define ST_IMISS 15    // iget() took a free table entry
+#define ST_DIRSCAN 16  // directory entries dirlookup() looked at
+#define NSTAT 17
+
+// Latency histograms, also kept per thread. What each one times is
+// also an event of the event log, with arg as noted.
+#define H_DISKREAD 0  // virtio_disk_rw() reading a block (arg block no)
+#define H_DISKWRITE 1 // virtio_disk_rw() writing one (arg block no)
+#define H_COMMIT 2    // a whole commit() (arg blocks logged)
+#define H_WRITELOG 3  // write_log() of a commit (arg blocks logged)
+#define H_WRITEHEAD 4 // each write_head() of a commit (arg log entries)
+#define H_INSTALL 5   // install_trans() of a commit (arg blocks logged)
+#define H_BGETWAIT 6  // bget() waiting for the buffer lock (arg block no)
+#define H_ILOCKWAIT 7 // ilock() waiting for the inode lock (arg inum)
+#define NHIST 8
+
+// Buckets are HDR-like: the values below HSUB, then HSUB buckets for
+// each power of 2 up to 2^40 ns, so a value is off by at most 1/HSUB.
+#define HSUBBITS 3
+#define HSUB (1 << HSUBBITS)
+#define NHBUCKET (HSUB * (40 - HSUBBITS + 1))
+
+// A thread's counts.
+struct statslot {
+  uint64 v[NSTAT];
+  uint64 h[NHIST][NHBUCKET];
+  struct statslot *next;
+  int id; // the thread, numbered from 0 as they first count
+};
+
+extern const char *statname[NSTAT]; // "bcache_hits", ... by ST_*
+extern const char *histname[NHIST]; // "disk_read", ... by H_*
+
+extern __thread struct statslot *statmine; // this thread's, or 0
+extern volatile int evlogon;
+struct statslot *statslot(void);
+void evput(int h, uint64 ns, uint arg);
+
+// Add n to counter i.
+static inline void statadd(int i, uint64 n) {
+  if (statmine == 0)
+    statmine = statslot();
+  statmine->v[i] += n;
+}
+
+static inline int histbucket(uint64 ns) {
+  int e;
+
+  if (ns < HSUB)
+    return ns;
+  e = 63 - __builtin_clzll(ns); // 2^e <= ns < 2^(e+1)
+  if (e >= 40)
+    return NHBUCKET - 1;
+  return (e - HSUBBITS) * HSUB + (ns >> (e - HSUBBITS));
+}
+
+// Count a time of ns in histogram h, and log it if the event log is
+// on. Lock waits of 0 (the lock was free) are not logged.
+static inline void histadd(int h, uint64 ns, uint arg) {
+  if (statmine == 0)
+    statmine = statslot();
+  statmine->h[h][histbucket(ns)]++;
+  if (evlogon && ns > 0)
+    evput(h, ns, arg);
+}
+
+#endif
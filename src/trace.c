@@ -0,0 +1,131 @@
+// Tracing of the ff*() calls, to replay a workload offline
+// (src/bench/replay.c). Off unless traceopen() was called. A trace is
+// of one image, of the block size in its header, so it is only taken
+// while one image is mounted, and no other is mounted meanwhile.
+#include "defs.h"
+#include "trace.h"
+#include <time.h>
+
+static FILE *tracef;
+static uint64 tracebase; // when the trace began
+static int ntid;         // threads seen so far
+static int nmount;       // images mounted
+static __thread int tid = -1;
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *tracename[NTRACEOP] = {
+    "?",     "open",   "close",  "read",  "write", "pread", "pwrite",
+    "readv", "writev", "sync",   "stat",  "seek",  "dup",   "link",
+    "clone", "unlink", "mkdir",  "mknod", "chdir",
+};
+
+static uint64 nsec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Record every ff*() call from now on in file path.
+// Returns 0, or -1 if it cannot be written or more or fewer than one
+// image is mounted.
+int traceopen(const char *path) {
+  struct tracehdr h;
+  FILE *f;
+
+  pthread_mutex_lock(&tracelock);
+  if (nmount != 1 || tracef) {
+    pthread_mutex_unlock(&tracelock);
+    return -1;
+  }
+  pthread_mutex_unlock(&tracelock);
+  if ((f = fopen(path, "wb")) == NULL)
+    return -1;
+  memset(&h, 0, sizeof(h));
+  h.magic = TRACEMAGIC;
+  h.version = 1;
+  h.bsize = BSIZE;
+  if (fwrite(&h, sizeof(h), 1, f) != 1) {
+    fclose(f);
+    return -1;
+  }
+  pthread_mutex_lock(&tracelock);
+  if (nmount != 1 || tracef) { // mounted or opened meanwhile
+    pthread_mutex_unlock(&tracelock);
+    fclose(f);
+    return -1;
+  }
+  tracebase = nsec();
+  tracef = f;
+  pthread_mutex_unlock(&tracelock);
+  return 0;
+}
+
+// Stop recording, and write out the trace.
+void traceclose(void) {
+  pthread_mutex_lock(&tracelock);
+  if (tracef)
+    fclose(tracef);
+  tracef = 0;
+  pthread_mutex_unlock(&tracelock);
+}
+
+// Count an image being mounted (secfs_mount()). Returns 0, or -1 if a
+// trace is being taken.
+int tracemount(void) {
+  int r = 0;
+
+  pthread_mutex_lock(&tracelock);
+  if (tracef)
+    r = -1;
+  else
+    nmount++;
+  pthread_mutex_unlock(&tracelock);
+  return r;
+}
+
+// Count an image unmounted; the trace ends with its image.
+void traceunmount(void) {
+  pthread_mutex_lock(&tracelock);
+  if (--nmount == 0 && tracef) {
+    fclose(tracef);
+    tracef = 0;
+  }
+  pthread_mutex_unlock(&tracelock);
+}
+
+// The start time of a call beginning now, for traceop(),
+// or 0 if tracing is off.
+uint64 tracestart(void) { return tracef ? nsec() : 0; }
+
+// Record a call to op that started at t and returned ret; the other
+// arguments are as struct tracerec has them. Does nothing if t is 0.
+void traceop(uint64 t, int op, int fd, const char *path, const char *path2,
+             int64 off, int64 len, int64 ret) {
+  struct tracerec r;
+  uint64 d;
+  int n1 = path ? strlen(path) + 1 : 0, n2 = path2 ? strlen(path2) + 1 : 0;
+
+  if (t == 0)
+    return;
+  d = nsec() - t;
+  r.dur = d > 0xFFFFFFFF ? 0xFFFFFFFF : d;
+  r.op = op;
+  r.fd = fd;
+  r.off = off;
+  r.len = len;
+  r.ret = ret;
+  r.plen = n1 + n2;
+
+  pthread_mutex_lock(&tracelock);
+  if (tracef && t >= tracebase) {
+    if (tid < 0)
+      tid = ntid++;
+    r.tid = tid;
+    r.ts = t - tracebase;
+    fwrite(&r, sizeof(r), 1, tracef);
+    fwrite(path, 1, n1, tracef);
+    fwrite(path2, 1, n2, tracef);
+  }
+  pthread_mutex_unlock(&tracelock);
+}
@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "defs.h"
+
+// A trace file is a struct tracehdr, then a struct tracerec per
+// ff*() call, each followed by plen bytes of path names (two for
+// fflink() and ffclone(), each ending with a 0).
+#define TRACEMAGIC 0x52544653 // "SFTR"
+
+struct tracehdr {
+  uint magic;   // TRACEMAGIC
+  uint version; // 1
+  uint bsize;   // block size of the traced image
+  uint pad;
+};
+
+// What a call was.
+#define TR_OPEN 1   // path, off = omode
+#define TR_CLOSE 2  // fd
+#define TR_READ 3   // fd, len
+#define TR_WRITE 4  // fd, len
+#define TR_PREAD 5  // fd, off, len
+#define TR_PWRITE 6 // fd, off, len
+#define TR_READV 7  // fd, len = the bytes of all buffers
+#define TR_WRITEV 8 // fd, len
+#define TR_SYNC 9   // fd
+#define TR_STAT 10  // fd
+#define TR_SEEK 11  // fd, off = the new offset
+#define TR_DUP 12   // fd
+#define TR_LINK 13  // old and new path
+#define TR_CLONE 14 // old and new path
+#define TR_UNLINK 15 // path
+#define TR_MKDIR 16 // path
+#define TR_MKNOD 17 // path, off = major, len = minor
+#define TR_CHDIR 18 // path
+#define NTRACEOP 19
+
+extern const char *tracename[NTRACEOP]; // "open", ... by TR_*
+
+struct tracerec {
+  uint64 ts;   // start (ns since the trace began)
+  int64 off;   // offset, or another argument (above)
+  int64 ret;   // return value
+  uint dur;    // duration (ns)
+  int fd;      // fd argument, or -1
+  uint len;    // byte count, or another argument
+  uchar op;    // TR_*
+  uchar tid;   // thread that made the call, numbered from 0 (mod 256)
+  ushort plen; // bytes of path names that follow
+};
+
+#endif
@@ -1,38 +1,113 @@
 #include "buf.h"
 #include "spinlock.h"
+#include "stats.h"
 #include <stdio.h>
+#include <unistd.h>
 
-extern FILE *img_file;
+// The image file of a mount.
+struct disk {
+  FILE *img;
+  struct spinlock lock;
+  uint cryptstart; // first encrypted block (below)
+#ifdef CRASHTEST
+  long crashafter; // writes to go before the crash, or -1
+#endif
+};
 
-struct spinlock vdisk_lock;
+// Set up the disk of the calling thread's mount, the image file img.
+void virtio_disk_init(FILE *img) {
+  struct disk *d;
+#ifdef CRASHTEST
+  char *s;
+#endif
 
-void virtio_disk_init(void) { init_spinlock(&vdisk_lock, "virtio_disk"); }
+  if ((d = calloc(1, sizeof(*d))) == NULL) {
+    printf("panic: virtio_disk_init: out of memory");
+    exit(1);
+  }
+  d->img = img;
+  d->cryptstart = 0xFFFFFFFF;
+  init_spinlock(&d->lock, "virtio_disk");
+  curfs->disk = d;
+#ifdef CRASHTEST
+  // with SECFS_CRASH_AFTER=n in the environment the process dies right
+  // after the nth write to this image, like a power cut
+  d->crashafter = (s = getenv("SECFS_CRASH_AFTER")) != NULL ? atol(s) : -1;
+#endif
+}
+
+// Close the image file of the calling thread's mount.
+void virtio_disk_done(void) {
+  fclose(curfs->disk->img);
+  free(curfs->disk);
+  curfs->disk = 0;
+}
+
+// Blocks from cryptstart on are encrypted on disk (AES-XTS with the
+// block no as tweak), set by fsinit() for an image made with mkfs -k.
+// Only disk I/O pays for it: a block is decrypted once when it is read
+// into the buffer cache, and encrypted on its way out. Every block
+// read is decrypted: mkfs -k writes the meta blocks read before the
+// file system first writes them, and a free block is never read, only
+// taken with bnew(), so holes of the sparse image are not read.
+void virtio_disk_crypt(uint start) { curfs->disk->cryptstart = start; }
+
+// The calling thread's buffer for a block being encrypted, taken once
+// so that writes do not malloc, and per thread so that they encrypt in
+// parallel, outside the disk lock.
+static __thread char *bounce;
 
+// Read or write b on the image of its device.
 void virtio_disk_rw(struct buf *b, int write) {
-  acquire_spinlock(&vdisk_lock);
+  struct disk *d = DEVFS(b->dev)->disk;
+  uint cryptstart = d->cryptstart;
+  char *data = b->data;
+  uint64 t = statnsec();
 
-  // TODO
-  // may be use long for bigger fs?
-  uint offset = b->blkno * 1024;
-  int seek = fseek(img_file, offset, SEEK_SET);
+  if (write && b->blkno >= cryptstart) {
+    if (bounce == NULL && (bounce = malloc(MAXBSIZE)) == NULL) {
+      printf("panic: virtio_disk_rw: out of memory");
+      exit(1);
+    }
+    data = bounce;
+    xts_encrypt(b->blkno, b->data, data, BSIZE);
+  }
+
+  acquire_spinlock(&d->lock);
+
+  // 64-bit offset: an image may be bigger than 4 GiB
+  off_t offset = (off_t)b->blkno * BSIZE;
+  int seek = fseeko(d->img, offset, SEEK_SET);
   if (seek) {
     printf("panic: fseek failed");
     exit(1);
   }
 
   if (write) {
-    size_t wret = fwrite(b->data, sizeof(char), BSIZE, img_file);
+    size_t wret = fwrite(data, sizeof(char), BSIZE, d->img);
     if (wret != BSIZE) {
       printf("panic: write disk error");
       exit(1);
     }
+#ifdef CRASHTEST
+    if (d->crashafter >= 0 && --d->crashafter < 0) {
+      fflush(d->img);
+      _exit(99);
+    }
+#endif
   } else {
-    size_t rret = fread(b->data, sizeof(char), BSIZE, img_file);
+    size_t rret = fread(b->data, sizeof(char), BSIZE, d->img);
     if (rret != BSIZE) {
       printf("panic: read disk error");
       exit(1);
     }
   }
 
-  release_spinlock(&vdisk_lock);
+  release_spinlock(&d->lock);
+  statadd(write ? ST_DWRITE : ST_DREAD, 1);
+  statadd(write ? ST_DWRITEB : ST_DREADB, BSIZE);
+
+  if (!write && b->blkno >= cryptstart)
+    xts_decrypt(b->blkno, b->data, b->data, BSIZE);
+  histadd(write ? H_DISKWRITE : H_DISKREAD, statnsec() - t, b->blkno);
 }
@@ -0,0 +1,172 @@
+# 崩溃一致性测试:用SECFS_CRASH_AFTER=n让secfs-crash(以-DCRASHTEST编译的secfs)在第n次磁盘写之后立即退出(模拟断电)，
+# 对journal和ordered两种模式扫描n，每次崩溃后:
+#   1. fsck -y 能写回日志并修好镜像，再次fsck没有错误
+#   2. 重新挂载(恢复日志、回收孤儿inode)后导出文件，fsck没有错误
+#   3. 每个导出的文件都是它某个版本的前缀:没有旧文件的残留字节(stale)，也没有未写入的零字节
+# 在build目录下运行(make test-crash): python ../test/crash_test.py [步长，默认每次写都崩溃一次]
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+SECFS = os.path.abspath("secfs-crash")
+MKFS = os.path.abspath("mkfs")
+FSCK = os.path.abspath("fsck")
+NBLOCKS = 6000
+
+
+# 文件的一个版本:每16字节一条记录"<4字符标记> <偏移>\n"，任何两处都不相同
+def content(tag, size):
+    recs = ("%s %010d\n" % (tag, off) for off in range(0, size, 16))
+    return "".join(recs).encode()[:size]
+
+
+# 各文件所有可能的版本(崩溃后只能是其中之一的前缀)
+VERSIONS = {
+    "f1": [content("f1v1", 40000), content("f1v2", 70000)],
+    "f2": [content("f2v1", 200000)],
+    "f3": [content("f3v1", 5000)],
+    "f4": [content("f4v1", 150000)],
+}
+STALE = content("gone", 400000)  # 已删除的旧文件
+
+
+def write(path, data):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def secfs(d, mode, script, crash=None):
+    env = dict(os.environ)
+    env.pop("SECFS_CRASH_AFTER", None)
+    if crash is not None:
+        env["SECFS_CRASH_AFTER"] = str(crash)
+    with open(os.path.join(d, "script"), "w") as f:
+        f.write(script)
+    return subprocess.run([SECFS, "-o", "data=" + mode, "-b", "script"],
+                          cwd=d, env=env, capture_output=True, text=True)
+
+
+def fsck(img, *opts):
+    return subprocess.run([FSCK] + list(opts) + [img],
+                          capture_output=True, text=True)
+
+
+# 新镜像:先写满一个旧文件再删除，让工作负载分配到的块上都有旧数据
+def fresh(d, mode):
+    if subprocess.run([MKFS, "fs.img", str(NBLOCKS)], cwd=d,
+                      capture_output=True).returncode != 0:
+        sys.exit("mkfs failed")
+    write(os.path.join(d, "stale"), STALE)
+    r = secfs(d, mode, "import stale\ndel stale\nexit\n")
+    if r.returncode != 0:
+        sys.exit("setup failed: " + r.stdout)
+    os.remove(os.path.join(d, "stale"))
+
+
+# 工作负载:导入，删除一个文件，覆盖一个文件并导入新文件(会复用删除的块)
+def workload(host):
+    write(os.path.join(host, "v1", "f1"), VERSIONS["f1"][0])
+    write(os.path.join(host, "v2", "f1"), VERSIONS["f1"][1])
+    write(os.path.join(host, "v1", "f2"), VERSIONS["f2"][0])
+    write(os.path.join(host, "v1", "d", "f3"), VERSIONS["f3"][0])
+    write(os.path.join(host, "v1", "f4"), VERSIONS["f4"][0])
+    return ("import {0}/v1/f1 {0}/v1/f2 {0}/v1/d\n"
+            "del f2\n"
+            "import {0}/v2/f1 {0}/v1/f4\n"
+            "stats\n"
+            "exit\n").format(host)
+
+
+def check(d, mode, n, img):
+    errs = []
+    # fsck修复一份副本
+    work = os.path.join(d, "copy.img")
+    shutil.copy(img, work)
+    r = fsck(work, "-y")
+    if r.returncode not in (0, 1):
+        errs.append("fsck -y exit %d: %s" % (r.returncode, r.stdout.strip()))
+    elif fsck(work).returncode != 0:
+        errs.append("fsck after fsck -y: " + fsck(work).stdout.strip())
+
+    # 重新挂载，导出文件
+    out = os.path.join(d, "out")
+    shutil.rmtree(out, ignore_errors=True)
+    os.makedirs(out)
+    shutil.copy(img, os.path.join(out, "fs.img"))
+    secfs(out, mode, "export f1\nexport f2\nexport d\nexport f4\nexit\n")
+    r = fsck(os.path.join(out, "fs.img"))
+    if r.returncode != 0:
+        errs.append("fsck after mount: " + r.stdout.strip())
+
+    for name, path in (("f1", "f1"), ("f2", "f2"), ("f3", "d/f3"),
+                       ("f4", "f4")):
+        p = os.path.join(out, path)
+        if not os.path.exists(p):
+            continue
+        with open(p, "rb") as f:
+            data = f.read()
+        if not any(v[:len(data)] == data for v in VERSIONS[name]):
+            why = "stale bytes" if b"gone " in data else \
+                  "zero bytes" if b"\0" in data else "wrong bytes"
+            errs.append("%s: %d bytes, %s" % (path, len(data), why))
+    for e in errs:
+        print("%s crash after %d writes: %s" % (mode, n, e))
+    return len(errs) == 0
+
+
+def run(mode, step):
+    ok = True
+    with tempfile.TemporaryDirectory() as d:
+        base = os.path.join(d, "base")
+        os.makedirs(base)
+        fresh(base, mode)
+        script = workload(os.path.join(d, "host"))
+
+        # 不崩溃时的磁盘写次数
+        w = os.path.join(d, "w")
+        shutil.copytree(base, w)
+        r = secfs(w, mode, script)
+        writes = [int(l.split()[1]) for l in r.stdout.splitlines()
+                  if l.startswith("disk_writes ")]
+        if r.returncode != 0 or not writes:
+            sys.exit("%s: workload failed: %s" % (mode, r.stdout))
+        total = writes[0]
+
+        # 直到不再崩溃:stats之后卸载时还有写
+        n, crashes = 1, 0
+        while True:
+            shutil.rmtree(w)
+            shutil.copytree(base, w)
+            r = secfs(w, mode, script, crash=n)
+            if r.returncode == 0:
+                break
+            if r.returncode != 99:
+                print("%s crash after %d writes: exit %d" %
+                      (mode, n, r.returncode))
+                ok = False
+            else:
+                ok = check(d, mode, n, os.path.join(w, "fs.img")) and ok
+            crashes += 1
+            n += step
+        if crashes == 0:
+            print("%s: never crashed, is secfs-crash built with -DCRASHTEST?" %
+                  mode)
+            ok = False
+        print("data=%s: %d crash points, about %d disk writes: %s" %
+              (mode, crashes, total, "ok" if ok else "FAILED"))
+    return ok
+
+
+def main():
+    step = int(sys.argv[1]) if len(sys.argv) > 1 else 1
+    ok = True
+    for mode in ("journal", "ordered"):
+        ok = run(mode, step) and ok
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()